@@ -0,0 +1,873 @@
+//
+//  FeedbackBenchmark.cpp
+//  Illuminate
+//
+//  Times FeedbackProcessor at every capture resolution the app offers, for every
+//  kernel instruction set this CPU supports, without a window or camera. Also
+//  measures the error of the hue rotation cube against the exact HSV path and checks
+//  it stays in bounds, checks the worker pool runs every band once while its thread
+//  count changes, checks every kernel instruction set gives the same bytes as the
+//  scalar kernels, and checks the history doesn't show stale pixels where the
+//  region grew.
+//  Usage: FeedbackBenchmark [frames per run]
+//
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "CaptureResolutions.h"
+#include "FeedbackProcessor.h"
+#include "HueLut.h"
+
+static const int NUM_SOURCE_FRAMES = 4;
+static const int WARMUP_FRAMES = 5;
+static const int HUE_TIMING_WIDTH = 1920;
+static const int HUE_TIMING_HEIGHT = 1080;
+static const int HUE_TIMING_RUNS = 3;
+static const double HUE_LUT_MAX_MEAN_ERROR = 0.5; // steps per channel
+static const int HUE_LUT_MAX_ERROR = 3;
+
+struct Scenario {
+    const char      *name;
+    FeedbackParams  params;
+    bool            darkInput;  // mostly black frames with a few bright spots instead of noise
+
+    Scenario() : name(""), darkInput(false) {}
+};
+
+static std::vector<Scenario> makeScenarios()
+{
+    std::vector<Scenario> scenarios;
+    Scenario s;
+
+    s.name = "trail";
+    s.params.blurOn = true;
+    scenarios.push_back(s);
+
+    s.name = "trail+blur";
+    s.params.spatialBlurRadius = 30;
+    scenarios.push_back(s);
+
+    s.name = "trail+blur 1";
+    s.params.spatialBlurPasses = 1;
+    scenarios.push_back(s);
+
+    s.name = "trail+bloom";
+    s.params.spatialBlurRadius = 0;
+    s.params.spatialBlurPasses = 3;
+    s.params.bloomLevels = 5;
+    scenarios.push_back(s);
+
+    s.name = "trail+bgsub";
+    s.params.bloomLevels = 0;
+    s.params.backgroundSubtraction = true;
+    scenarios.push_back(s);
+
+    s.name = "trail+key";
+    s.params.backgroundSubtraction = false;
+    s.params.lumaKey = true;
+    scenarios.push_back(s);
+
+    s.name = "trail+motion";
+    s.params.lumaKey = false;
+    s.params.motionTrails = true;
+    scenarios.push_back(s);
+
+    s.name = "trail+edges";
+    s.params.motionTrails = false;
+    s.params.edgeMode = true;
+    scenarios.push_back(s);
+
+    s.name = "trail+skip";
+    s.params.edgeMode = false;
+    s.params.frameSkip = 3;
+    scenarios.push_back(s);
+
+    s.name = "trail+batch";
+    s.params.batchFrameSkip = true;
+    scenarios.push_back(s);
+
+    s.name = "trail screen";
+    s.params.batchFrameSkip = false;
+    s.params.frameSkip = 0;
+    s.params.blendMode = BLEND_MODE_SCREEN;
+    scenarios.push_back(s);
+
+    s.name = "trail diff";
+    s.params.blendMode = BLEND_MODE_DIFFERENCE;
+    scenarios.push_back(s);
+
+    s.name = "int average";
+    s.params.integerFeedback = true;
+    s.params.blendMode = BLEND_MODE_AVERAGE;
+    scenarios.push_back(s);
+
+    s.name = "trail+mix";
+    s.params.integerFeedback = false;
+    s.params.blendMode = BLEND_MODE_LIGHTEN;
+    s.params.frameSkip = 0;
+    s.params.batchFrameSkip = false;
+    s.params.newestFrameMix = 0.5f;
+    scenarios.push_back(s);
+
+    s.name = "int trail";
+    s.params.newestFrameMix = 0.f;
+    s.params.integerFeedback = true;
+    scenarios.push_back(s);
+
+    s.name = "int mix";
+    s.params.newestFrameMix = 0.5f;
+    scenarios.push_back(s);
+
+    s.name = "16bit trail";
+    s.params.integerFeedback = false;
+    s.params.newestFrameMix = 0.f;
+    s.params.highPrecision = true;
+    scenarios.push_back(s);
+
+    s.name = "16bit mix";
+    s.params.newestFrameMix = 0.5f;
+    scenarios.push_back(s);
+
+    s.name = "gain trail";
+    s.params.newestFrameMix = 0.f;
+    s.params.lazyDecay = true;
+    scenarios.push_back(s);
+
+    s.name = "gain mix";
+    s.params.newestFrameMix = 0.5f;
+    scenarios.push_back(s);
+
+    // keyed or night scenes, where the gain trail skips most of its stores
+    s.name = "16bit dark";
+    s.params.newestFrameMix = 0.f;
+    s.params.lazyDecay = false;
+    s.darkInput = true;
+    scenarios.push_back(s);
+
+    s.name = "gain dark";
+    s.params.lazyDecay = true;
+    scenarios.push_back(s);
+
+    s.name = "linear trail";
+    s.params.lazyDecay = false;
+    s.darkInput = false;
+    s.params.linearLight = true;
+    scenarios.push_back(s);
+
+    s.name = "linear mix";
+    s.params.newestFrameMix = 0.5f;
+    scenarios.push_back(s);
+
+    s.name = "trail+hue";
+    s.params.highPrecision = false;
+    s.params.lazyDecay = false;
+    s.params.linearLight = false;
+    s.params.newestFrameMix = 0.f;
+    s.params.hueModOn = true;
+    s.params.huePosition = 0.25f;
+    scenarios.push_back(s);
+
+    s.name = "trail+huelut";
+    s.params.hueLut = true;
+    scenarios.push_back(s);
+
+    s.name = "trail+grad";
+    s.params.hueModOn = false;
+    s.params.hueLut = false;
+    s.params.gradientMap = true;
+    scenarios.push_back(s);
+
+    s.name = "trail+poster";
+    s.params.gradientIntensity = true;
+    s.params.posterizeLevels = 6;
+    scenarios.push_back(s);
+
+    s.name = "trail 1/2";
+    s.params.gradientMap = false;
+    s.params.gradientIntensity = false;
+    s.params.posterizeLevels = 0;
+    s.params.downscale = 2;
+    scenarios.push_back(s);
+
+    s.name = "trail 1/4";
+    s.params.downscale = 4;
+    scenarios.push_back(s);
+
+    s.name = "trail+echo";
+    s.params.downscale = 1;
+    s.params.historyDepth = 9;
+    s.params.numEchoTaps = 2;
+    s.params.echoTaps[0].age = 4;
+    s.params.echoTaps[0].weight = 0.25f;
+    s.params.echoTaps[1].age = 8;
+    s.params.echoTaps[1].weight = 0.25f;
+    scenarios.push_back(s);
+
+    s.name = "slit rows";
+    s.params.numEchoTaps = 0;
+    s.params.historyDepth = 30;
+    s.params.displacementDepth = 30;
+    scenarios.push_back(s);
+
+    s.name = "slit columns";
+    s.params.displaceColumns = true;
+    scenarios.push_back(s);
+
+    s.name = "1 layer";
+    s.params.historyDepth = 0;
+    s.params.displacementDepth = 0;
+    s.params.displaceColumns = false;
+    s.params.numTrailLayers = 1;
+    s.params.trailLayers[0].feedback = 0.99f;
+    s.params.trailLayers[0].gate = 0.5f;
+    scenarios.push_back(s);
+
+    s.name = "3 layers";
+    s.params.numTrailLayers = 3;
+    s.params.trailLayers[1].feedback = 0.995f;
+    s.params.trailLayers[2].feedback = 0.8f;
+    s.params.trailLayers[2].gate = 0.8f;
+    scenarios.push_back(s);
+
+    return scenarios;
+}
+
+// BGRA, like the frames handed out by the capture on the show machines
+static void fillNoise(std::vector<uint8_t> &buffer, uint32_t seed)
+{
+    for (size_t i = 0 ; i < buffer.size() ; i++) {
+        seed = seed * 1664525u + 1013904223u;
+        buffer[i] = (i & 3) == 3 ? 255 : (uint8_t)(seed >> 24);
+    }
+}
+
+// BGRA, black with one bright 4x4 spot per 64x64 pixels, placed by seed
+static void fillDark(std::vector<uint8_t> &buffer, int width, uint32_t seed)
+{
+    const int height = (int)(buffer.size() / 4 / width);
+    for (size_t i = 0 ; i < buffer.size() ; i++) {
+        buffer[i] = (i & 3) == 3 ? 255 : 0;
+    }
+    for (int spot = (width / 64) * (height / 64) ; spot > 0 ; spot--) {
+        seed = seed * 1664525u + 1013904223u;
+        const int x = (int)((seed >> 8) % (uint32_t)(width - 4));
+        seed = seed * 1664525u + 1013904223u;
+        const int y = (int)((seed >> 8) % (uint32_t)(height - 4));
+        for (int row = y ; row < y + 4 ; row++) {
+            uint8_t *pixel = &buffer[((size_t)row * width + x) * 4];
+            for (int i = 0 ; i < 16 ; i++) {
+                if ((i & 3) != 3) {
+                    pixel[i] = 192 + (uint8_t)((seed >> (i & 15)) & 63);
+                }
+            }
+        }
+    }
+}
+
+// best of HUE_TIMING_RUNS, ms to rotate frame on one thread through lut, or the exact path with NULL
+static double timeHueRotation(const std::vector<uint8_t> &frame, const HueLut *lut, float huePosition)
+{
+    double best = 0.0;
+    std::vector<uint8_t> pixels;
+    for (int run = 0 ; run < HUE_TIMING_RUNS ; run++) {
+        pixels = frame;
+        std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+        if (lut != NULL) {
+            lut->apply(&pixels[0], (int32_t)(pixels.size() / 4), 4, 2, 1, 0);
+        } else {
+            for (size_t i = 0 ; i < pixels.size() ; i += 4) {
+                float r = pixels[i + 2], g = pixels[i + 1], b = pixels[i];
+                rotateHueExact(r, g, b, huePosition);
+                pixels[i + 2] = (uint8_t)r;
+                pixels[i + 1] = (uint8_t)g;
+                pixels[i] = (uint8_t)b;
+            }
+        }
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        best = (run == 0 || ms < best) ? ms : best;
+    }
+    return best;
+}
+
+// Runs every 3rd value per channel through the cube and the exact path, the
+// visual error is reported as mean / max absolute difference per channel and the
+// share of channels more than 2 steps off. Both are also timed on a noise frame,
+// so the speedup the error buys is next to it. Fails when a cube of the default size
+// or bigger is off by HUE_LUT_MAX_MEAN_ERROR on average or by more than
+// HUE_LUT_MAX_ERROR anywhere, smaller cubes are only reported.
+static bool measureHueLutError()
+{
+    const float huePositions[] = {0.1f, 0.25f, 0.5f, -0.3f};
+    const int sizes[] = {17, HueLut::DEFAULT_SIZE, HueLut::MAX_SIZE};
+    const int step = 3;
+    const int levels = 256 / step + 1;
+
+    std::vector<uint8_t> pixels;
+    pixels.reserve(levels * levels * levels * 3);
+    for (int b = 0 ; b < 256 ; b += step) {
+        for (int g = 0 ; g < 256 ; g += step) {
+            for (int r = 0 ; r < 256 ; r += step) {
+                pixels.push_back((uint8_t)r);
+                pixels.push_back((uint8_t)g);
+                pixels.push_back((uint8_t)b);
+            }
+        }
+    }
+    const int32_t count = (int32_t)(pixels.size() / 3);
+    std::vector<uint8_t> frame((size_t)HUE_TIMING_WIDTH * HUE_TIMING_HEIGHT * 4);
+    fillNoise(frame, 4242u);
+
+    bool passed = true;
+    printf("hue rotation of %dx%d on one thread\n", HUE_TIMING_WIDTH, HUE_TIMING_HEIGHT);
+    printf("%-9s %-9s %10s %10s %10s %10s %10s %8s\n", "lut size", "hue", "mean err", "max err", "> 2 steps",
+           "lut ms", "exact ms", "speedup");
+    for (size_t s = 0 ; s < sizeof(sizes) / sizeof(sizes[0]) ; s++) {
+        for (size_t h = 0 ; h < sizeof(huePositions) / sizeof(huePositions[0]) ; h++) {
+            HueLut lut;
+            lut.setSize(sizes[s]);
+            lut.update(huePositions[h]);
+            std::vector<uint8_t> lookedUp = pixels;
+            lut.apply(&lookedUp[0], count, 3, 0, 1, 2);
+
+            double sum = 0.0;
+            int maxError = 0;
+            int64_t over = 0;
+            for (int32_t i = 0 ; i < count ; i++) {
+                float rgb[3] = { (float)pixels[i * 3], (float)pixels[i * 3 + 1], (float)pixels[i * 3 + 2] };
+                rotateHueExact(rgb[0], rgb[1], rgb[2], huePositions[h]);
+                for (int c = 0 ; c < 3 ; c++) {
+                    int error = abs((int)(uint8_t)rgb[c] - (int)lookedUp[i * 3 + c]);
+                    sum += error;
+                    maxError = error > maxError ? error : maxError;
+                    over += error > 2 ? 1 : 0;
+                }
+            }
+            const double lutMs = timeHueRotation(frame, &lut, huePositions[h]);
+            const double exactMs = timeHueRotation(frame, NULL, huePositions[h]);
+            printf("%-9d %-9.2f %10.3f %10d %9.3f%% %10.2f %10.2f %7.1fx\n", sizes[s], huePositions[h],
+                   sum / (count * 3.0), maxError, (100.0 * over) / (count * 3.0), lutMs, exactMs, exactMs / lutMs);
+            if (sizes[s] >= HueLut::DEFAULT_SIZE
+                && (sum / (count * 3.0) >= HUE_LUT_MAX_MEAN_ERROR || maxError > HUE_LUT_MAX_ERROR)) {
+                passed = false;
+            }
+        }
+    }
+    printf("hue lut check: %s\n\n", passed ? "OK" : "FAILED");
+    return passed;
+}
+
+// Alternates the thread count between runs, the way the thread control and the
+// governor do. Every band of every run has to have run exactly once, also counted
+// again after all runs so a worker still busy with an earlier run shows up.
+static bool checkWorkerPool()
+{
+    const int runs = 2000;
+    const int numBands = 16;
+    const int hardwareThreads = WorkerPool::getHardwareThreads();
+    const int threadCounts[] = { 1, 2, std::max(hardwareThreads, 3), 3, 0 };
+    std::vector< std::atomic<int> > counts(runs * numBands);
+    for (size_t i = 0 ; i < counts.size() ; i++) {
+        counts[i] = 0;
+    }
+
+    WorkerPool pool;
+    int failedRuns = 0;
+    for (int r = 0 ; r < runs ; r++) {
+        pool.setNumThreads(threadCounts[r % (sizeof(threadCounts) / sizeof(threadCounts[0]))]);
+        std::atomic<int> *runCounts = &counts[r * numBands];
+        pool.run(numBands, [runCounts](int band) {
+            // gives the other threads a chance to interleave with the band
+            std::this_thread::yield();
+            runCounts[band]++;
+        });
+        for (int b = 0 ; b < numBands ; b++) {
+            if (runCounts[b] != 1) {
+                failedRuns++;
+                break;
+            }
+        }
+    }
+    pool.setNumThreads(1);
+    int wrongBands = 0;
+    for (size_t i = 0 ; i < counts.size() ; i++) {
+        wrongBands += counts[i] != 1 ? 1 : 0;
+    }
+    printf("worker pool: %d runs of %d bands, %d runs short, %d bands not run once: %s\n\n",
+           runs, numBands, failedRuns, wrongBands, failedRuns == 0 && wrongBands == 0 ? "OK" : "FAILED");
+    return failedRuns == 0 && wrongBands == 0;
+}
+
+static FrameView viewOf(std::vector<uint8_t> &buffer, int width, int height)
+{
+    return FrameView(&buffer[0], width, height, width * 4, 4, 2, 1, 0);
+}
+
+// halveRow over a whole row against one value at a time, which is always the
+// scalar tail, on the same noise
+static bool checkHalveRow()
+{
+    const int32_t count = 333;
+    const int32_t stride = 2 * count + 1;
+    std::vector<uint8_t> src((size_t)stride * 2);
+    fillNoise(src, 777u);
+    std::vector<uint8_t> whole(count), single(count);
+    halveRow(&whole[0], &src[0], stride, count);
+    for (int32_t x = 0 ; x < count ; x++) {
+        halveRow(&single[x], &src[2 * x], stride, 1);
+    }
+    return whole == single;
+}
+
+// The row helpers below go a pixel at a time for the single runs, too few bytes for
+// their vector loops, so those are the scalar tails. Noise rows of TAIL_CHECK_PIXELS
+// BGRA pixels, colour bytes masked as on the show machines.
+static const int32_t TAIL_CHECK_PIXELS = 333;
+static const uint32_t TAIL_CHECK_CHANNEL_MASK = 0x00ffffffu;
+static const uint16_t TAIL_CHECK_LUMA_WEIGHTS[4] = {29, 150, 77, 0};
+
+static bool checkSobelRow()
+{
+    const int32_t count = TAIL_CHECK_PIXELS;
+    std::vector<uint8_t> luma((size_t)(count + 2) * 3);
+    fillNoise(luma, 101u);
+    std::vector<uint8_t> whole((size_t)count * 4);
+    fillNoise(whole, 102u);
+    std::vector<uint8_t> single = whole;
+    const uint8_t *above = &luma[0];
+    const uint8_t *middle = &luma[count + 2];
+    const uint8_t *below = &luma[2 * (count + 2)];
+    sobelRow(&whole[0], above, middle, below, count, 4, 12, TAIL_CHECK_CHANNEL_MASK);
+    for (int32_t x = 0 ; x < count ; x++) {
+        sobelRow(&single[x * 4], above + x, middle + x, below + x, 1, 4, 12, TAIL_CHECK_CHANNEL_MASK);
+    }
+    return whole == single;
+}
+
+static bool checkLumaKeyRow()
+{
+    const int32_t count = TAIL_CHECK_PIXELS;
+    LumaKeyRowParams params;
+    params.threshold = 128;
+    params.kneeWidth = 32;
+    params.hysteresis = 16;
+    std::copy(TAIL_CHECK_LUMA_WEIGHTS, TAIL_CHECK_LUMA_WEIGHTS + 4, params.lumaWeights);
+    std::vector<uint8_t> whole((size_t)count * 4);
+    fillNoise(whole, 103u);
+    // key states are 0 or 0xff
+    std::vector<uint8_t> wholeState(count);
+    fillNoise(wholeState, 104u);
+    for (int32_t x = 0 ; x < count ; x++) {
+        wholeState[x] = (wholeState[x] & 1) ? 0xff : 0;
+    }
+    std::vector<uint8_t> single = whole;
+    std::vector<uint8_t> singleState = wholeState;
+    lumaKeyRow(&whole[0], &wholeState[0], count * 4, 4, params);
+    for (int32_t x = 0 ; x < count ; x++) {
+        lumaKeyRow(&single[x * 4], &singleState[x], 4, 4, params);
+    }
+    return whole == single && wholeState == singleState;
+}
+
+static bool checkSubtractBackgroundRow()
+{
+    const int32_t count = TAIL_CHECK_PIXELS * 4;
+    std::vector<uint8_t> whole(count);
+    fillNoise(whole, 105u);
+    // the background close to the row in some pixels, so both sides of the threshold show up
+    std::vector<uint8_t> noise(count);
+    fillNoise(noise, 106u);
+    std::vector<uint16_t> wholeBackground(count);
+    for (int32_t i = 0 ; i < count ; i++) {
+        wholeBackground[i] = (uint16_t)((i / 4) % 3 == 0 ? whole[i] * 256 + noise[i] : noise[i] * 256 + noise[(i + 1) % count]);
+    }
+    std::vector<uint8_t> single = whole;
+    std::vector<uint16_t> singleBackground = wholeBackground;
+    subtractBackgroundRow(&whole[0], &wholeBackground[0], count, 4, 40, 3000, TAIL_CHECK_CHANNEL_MASK);
+    for (int32_t i = 0 ; i < count ; i += 4) {
+        subtractBackgroundRow(&single[i], &singleBackground[i], 4, 4, 40, 3000, TAIL_CHECK_CHANNEL_MASK);
+    }
+    return whole == single && wholeBackground == singleBackground;
+}
+
+static bool checkEchoRow()
+{
+    const int32_t count = TAIL_CHECK_PIXELS * 4;
+    const uint16_t weights[2] = {64, 96};
+    std::vector<uint8_t> tapBytes((size_t)count * 2);
+    fillNoise(tapBytes, 107u);
+    const uint8_t *const taps[2] = {&tapBytes[0], &tapBytes[count]};
+    std::vector<uint8_t> whole(count);
+    fillNoise(whole, 108u);
+    std::vector<uint8_t> single = whole;
+    echoRow(&whole[0], taps, weights, 2, count, TAIL_CHECK_CHANNEL_MASK);
+    for (int32_t i = 0 ; i < count ; i += 4) {
+        const uint8_t *const pixelTaps[2] = {taps[0] + i, taps[1] + i};
+        echoRow(&single[i], pixelTaps, weights, 2, 4, TAIL_CHECK_CHANNEL_MASK);
+    }
+    return whole == single;
+}
+
+// with luma weights and with the brightest colour byte
+static bool checkGradientMapRow()
+{
+    const int32_t count = TAIL_CHECK_PIXELS;
+    std::vector<uint8_t> tableBytes(256 * 4);
+    fillNoise(tableBytes, 109u);
+    const uint32_t *table = reinterpret_cast<const uint32_t*>(&tableBytes[0]);
+    std::vector<uint8_t> row((size_t)count * 4);
+    fillNoise(row, 110u);
+    for (int weighted = 0 ; weighted < 2 ; weighted++) {
+        const uint16_t *weights = weighted ? TAIL_CHECK_LUMA_WEIGHTS : NULL;
+        std::vector<uint8_t> whole = row;
+        std::vector<uint8_t> single = row;
+        gradientMapRow(&whole[0], count, 4, table, weights, TAIL_CHECK_CHANNEL_MASK);
+        for (int32_t x = 0 ; x < count ; x++) {
+            gradientMapRow(&single[x * 4], 1, 4, table, weights, TAIL_CHECK_CHANNEL_MASK);
+        }
+        if (whole != single) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the SSE2 loop, the instruction set check only covers the AVX2 one
+static bool checkTrailLayersRow()
+{
+    const int32_t count = TAIL_CHECK_PIXELS * 4;
+    // each layer's tints repeat after a period, like FeedbackProcessor fills them
+    std::vector<uint8_t> tintBytes(FEEDBACK_DITHER_PERIOD * 2);
+    fillNoise(tintBytes, 111u);
+    std::vector<uint16_t> tints(4 * FEEDBACK_DITHER_PERIOD);
+    for (int32_t i = 0 ; i < 4 * FEEDBACK_DITHER_PERIOD ; i++) {
+        const int32_t layer = i / (2 * FEEDBACK_DITHER_PERIOD);
+        const int32_t phase = i % FEEDBACK_DITHER_PERIOD;
+        tints[i] = (phase & 3) == 3 ? 0 : (uint16_t)(tintBytes[layer * FEEDBACK_DITHER_PERIOD + phase] + 1);
+    }
+    TrailLayerRowParams params[2];
+    params[0].feedbackFixed = 60000;
+    params[0].gate = 100;
+    params[0].tint = &tints[0];
+    params[1].feedbackFixed = 64000;
+    params[1].gate = 200;
+    params[1].tint = &tints[2 * FEEDBACK_DITHER_PERIOD];
+    std::vector<uint8_t> src(count);
+    fillNoise(src, 112u);
+    std::vector<uint8_t> wholeLayers((size_t)count * 2);
+    fillNoise(wholeLayers, 113u);
+    std::vector<uint8_t> whole(count);
+    fillNoise(whole, 114u);
+    std::vector<uint8_t> singleLayers = wholeLayers;
+    std::vector<uint8_t> single = whole;
+    const int32_t tintPhase = 5;
+    uint8_t *const layers[2] = {&wholeLayers[0], &wholeLayers[count]};
+    trailLayersRow(layers, params, 2, &src[0], &whole[0], count, tintPhase, true);
+    for (int32_t i = 0 ; i < count ; i++) {
+        uint8_t *const byteLayers[2] = {&singleLayers[i], &singleLayers[count + i]};
+        trailLayersRow(byteLayers, params, 2, &src[i], &single[i], 1, tintPhase + i, true);
+    }
+    return whole == single && wholeLayers == singleLayers;
+}
+
+static bool checkHueLut()
+{
+    const int32_t count = TAIL_CHECK_PIXELS;
+    HueLut lut;
+    lut.update(0.25f);
+    std::vector<uint8_t> whole((size_t)count * 4);
+    fillNoise(whole, 115u);
+    std::vector<uint8_t> single = whole;
+    lut.apply(&whole[0], count, 4, 2, 1, 0);
+    for (int32_t x = 0 ; x < count ; x++) {
+        lut.apply(&single[x * 4], 1, 4, 2, 1, 0);
+    }
+    return whole == single;
+}
+
+// Down the columns against one byte column at a time. Along the rows the running
+// sums need the whole row, so that is against box means summed one by one.
+static bool checkBoxBlur()
+{
+    const int width = 37;
+    const int height = 23;
+    const int radius = 3;
+    const int passes = 2;
+    std::vector<uint8_t> whole((size_t)width * height * 4);
+    fillNoise(whole, 116u);
+    std::vector<uint8_t> single = whole;
+    BoxBlur blur;
+    blur.configure(radius, passes, width * 4, 4, 1);
+    blur.blurColumns(viewOf(whole, width, height), 0, height, 0, width * 4);
+    for (int32_t i = 0 ; i < width * 4 ; i++) {
+        blur.blurColumns(viewOf(single, width, height), 0, height, i, i + 1);
+    }
+    if (whole != single) {
+        return false;
+    }
+
+    const int32_t count = TAIL_CHECK_PIXELS;
+    const int32_t size = 2 * radius + 1;
+    const uint32_t half = size / 2;
+    const uint32_t reciprocal = (65536 + size - 1) / size;
+    std::vector<uint8_t> row((size_t)count * 4);
+    fillNoise(row, 117u);
+    std::vector<uint8_t> expected = row;
+    blur.configure(radius, passes, count * 4, 4, 1);
+    blur.blurRow(0, &row[0], count);
+    for (int pass = 0 ; pass < passes ; pass++) {
+        const std::vector<uint8_t> in = expected;
+        for (int32_t x = 0 ; x < count ; x++) {
+            for (int32_t c = 0 ; c < 4 ; c++) {
+                uint32_t sum = 0;
+                for (int32_t k = x - radius ; k <= x + radius ; k++) {
+                    sum += in[std::min(std::max(k, 0), count - 1) * 4 + c];
+                }
+                expected[x * 4 + c] = (uint8_t)(((sum + half) * reciprocal) >> 16);
+            }
+        }
+    }
+    return row == expected;
+}
+
+struct TailCheck {
+    const char  *name;
+    bool        (*check)();
+};
+
+static const TailCheck TAIL_CHECKS[] = {
+    {"halveRow", checkHalveRow},
+    {"sobelRow", checkSobelRow},
+    {"lumaKeyRow", checkLumaKeyRow},
+    {"subtractBackgroundRow", checkSubtractBackgroundRow},
+    {"echoRow", checkEchoRow},
+    {"gradientMapRow", checkGradientMapRow},
+    {"trailLayersRow", checkTrailLayersRow},
+    {"HueLut", checkHueLut},
+    {"BoxBlur", checkBoxBlur},
+};
+
+// Every scenario for a few frames with each supported kernel instruction set, each
+// display has to match the scalar one byte for byte. Odd sizes so every row has a
+// tail after the vector loops. The helpers that aren't picked per instruction set
+// have their vector loops checked against their scalar tails, see TAIL_CHECKS.
+static bool checkKernelIsas(const std::vector<Scenario> &scenarios)
+{
+    const int width = 333;
+    const int height = 101;
+    const int frames = 8;
+    const size_t bytes = (size_t)width * height * 4;
+    std::vector< std::vector<uint8_t> > sources(NUM_SOURCE_FRAMES, std::vector<uint8_t>(bytes));
+    std::vector< std::vector<uint8_t> > darkSources(NUM_SOURCE_FRAMES, std::vector<uint8_t>(bytes));
+    for (int i = 0 ; i < NUM_SOURCE_FRAMES ; i++) {
+        fillNoise(sources[i], 54321u + i);
+        fillDark(darkSources[i], width, 54321u + i);
+    }
+
+    bool passed = true;
+    for (size_t s = 0 ; s < scenarios.size() ; s++) {
+        const FeedbackParams &params = scenarios[s].params;
+        std::vector< std::vector<uint8_t> > expected(frames, std::vector<uint8_t>(bytes));
+        for (int isa = 0 ; isa < NUM_KERNEL_ISAS ; isa++) {
+            if (!isKernelIsaSupported((KernelIsa)isa)) {
+                continue;
+            }
+            FeedbackProcessor processor;
+            processor.setKernelIsa((KernelIsa)isa);
+            // some effects work on the source in place, every run starts from the same frames
+            std::vector< std::vector<uint8_t> > frameSources = scenarios[s].darkInput ? darkSources : sources;
+            std::vector<uint8_t> display(bytes);
+            FrameView displayView = viewOf(display, params.getDisplaySize(width), params.getDisplaySize(height));
+            int firstDiff = -1;
+            for (int i = 0 ; i < frames ; i++) {
+                processor.process(viewOf(frameSources[i % frameSources.size()], width, height), displayView, params);
+                if (isa == KERNEL_ISA_SCALAR) {
+                    expected[i] = display;
+                } else if (firstDiff < 0 && display != expected[i]) {
+                    firstDiff = i;
+                }
+            }
+            if (firstDiff >= 0) {
+                printf("kernel check: %s with %s differs from scalar from frame %d\n",
+                       scenarios[s].name, getKernelIsaName((KernelIsa)isa), firstDiff);
+                passed = false;
+            }
+        }
+    }
+    for (size_t i = 0 ; i < sizeof(TAIL_CHECKS) / sizeof(TAIL_CHECKS[0]) ; i++) {
+        if (!TAIL_CHECKS[i].check()) {
+            printf("kernel check: %s vector loop differs from its scalar tail\n", TAIL_CHECKS[i].name);
+            passed = false;
+        }
+    }
+    printf("kernel check: %s\n\n", passed ? "OK" : "FAILED");
+    return passed;
+}
+
+// The region shrinks to the left half while the frames change, then grows back. The
+// history frames recorded in between only hold the left half, the echo and the time
+// displacement must not show the right half from before in the newly processed part.
+static bool checkRegionGrowth()
+{
+    const int width = 64;
+    const int height = 32;
+    const int phaseFrames = 32;
+    const size_t bytes = (size_t)width * height * 4;
+    FeedbackParams echo;
+    echo.blurOn = true;
+    echo.historyDepth = 9;
+    echo.numEchoTaps = 2;
+    echo.echoTaps[0].age = 4;
+    echo.echoTaps[0].weight = 0.25f;
+    echo.echoTaps[1].age = 8;
+    echo.echoTaps[1].weight = 0.25f;
+    FeedbackParams rows;
+    rows.blurOn = true;
+    rows.historyDepth = 30;
+    rows.displacementDepth = 30;
+    FeedbackParams columns = rows;
+    columns.displaceColumns = true;
+    const FeedbackParams variants[] = { echo, rows, columns };
+    const char *names[] = { "echo", "slit rows", "slit columns" };
+
+    bool passed = true;
+    for (size_t v = 0 ; v < sizeof(variants) / sizeof(variants[0]) ; v++) {
+        FeedbackProcessor processor;
+        FeedbackParams params = variants[v];
+        std::vector<uint8_t> frame(bytes), display(bytes);
+        // everything at 50, then only the left half at 200, then all of it at 200
+        for (int i = 0 ; i < 2 * phaseFrames + 1 ; i++) {
+            for (size_t b = 0 ; b < bytes ; b++) {
+                frame[b] = (b & 3) == 3 ? 255 : (i < phaseFrames ? 50 : 200);
+            }
+            params.region = i < phaseFrames || i == 2 * phaseFrames ? FrameRect() : FrameRect(0, 0, width / 2, height);
+            processor.process(viewOf(frame, width, height), viewOf(display, width, height), params);
+        }
+        int wrong = 0;
+        for (size_t b = 0 ; b < bytes ; b++) {
+            wrong += (b & 3) != 3 && display[b] != 200 ? 1 : 0;
+        }
+        if (wrong > 0) {
+            printf("region check: %s shows %d bytes from before the region grew\n", names[v], wrong);
+            passed = false;
+        }
+    }
+    printf("region check: %s\n\n", passed ? "OK" : "FAILED");
+    return passed;
+}
+
+static double timeFrames(FeedbackProcessor &processor, std::vector< std::vector<uint8_t> > &sources,
+                         std::vector<uint8_t> &display, int width, int height, const FeedbackParams &params, int frames)
+{
+    // display is big enough for any downscale
+    FrameView displayView = viewOf(display, params.getDisplaySize(width), params.getDisplaySize(height));
+    for (int i = 0 ; i < WARMUP_FRAMES ; i++) {
+        processor.process(viewOf(sources[i % sources.size()], width, height), displayView, params);
+    }
+    std::chrono::high_resolution_clock::time_point start = std::chrono::high_resolution_clock::now();
+    for (int i = 0 ; i < frames ; i++) {
+        processor.process(viewOf(sources[i % sources.size()], width, height), displayView, params);
+    }
+    return std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+}
+
+static void printTiming(int width, int height, const char *scenario, const char *variant, double seconds, int frames)
+{
+    char resolution[16];
+    snprintf(resolution, sizeof(resolution), "%dx%d", width, height);
+    double nsPerPixel = (seconds * 1e9) / ((double)frames * width * height);
+    printf("%-10s %-12s %-7s %10.3f %10.3f %10.1f\n", resolution, scenario, variant,
+           (seconds * 1e3) / frames, nsPerPixel, frames / seconds);
+}
+
+// the glow's own profile, per pyramid level of the last frame timed
+static void printBloomTimings(const Bloom::Timings &timings)
+{
+    printf("%-10s %-12s", "", "  bloom ms");
+    for (int l = 0 ; l < timings.numLevels ; l++) {
+        printf(" L%d %.3f", l, timings.levelMs[l]);
+    }
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    int frames = argc > 1 ? atoi(argv[1]) : 120;
+    if (frames <= 0) {
+        frames = 120;
+    }
+    std::vector<Scenario> scenarios = makeScenarios();
+
+    bool passed = checkWorkerPool();
+    passed = checkKernelIsas(scenarios) && passed;
+    passed = checkRegionGrowth() && passed;
+    passed = measureHueLutError() && passed;
+
+    printf("detected kernels: %s\n", getKernelIsaName(detectKernelIsa()));
+    printf("%-10s %-12s %-7s %10s %10s %10s\n", "resolution", "scenario", "kernel", "ms/frame", "ns/pixel", "frames/s");
+    for (int r = 0 ; r < numCaptureResolutions ; r++) {
+        const int width = captureResolutionsWidth[r];
+        const int height = captureResolutionsHeight[r];
+        const size_t bytes = (size_t)width * height * 4;
+
+        std::vector< std::vector<uint8_t> > sources(NUM_SOURCE_FRAMES, std::vector<uint8_t>(bytes));
+        std::vector< std::vector<uint8_t> > darkSources(NUM_SOURCE_FRAMES, std::vector<uint8_t>(bytes));
+        for (int i = 0 ; i < NUM_SOURCE_FRAMES ; i++) {
+            fillNoise(sources[i], 12345u + i);
+            fillDark(darkSources[i], width, 12345u + i);
+        }
+        std::vector<uint8_t> display(bytes);
+
+        for (size_t s = 0 ; s < scenarios.size() ; s++) {
+            for (int isa = 0 ; isa < NUM_KERNEL_ISAS ; isa++) {
+                if (!isKernelIsaSupported((KernelIsa)isa)) {
+                    continue;
+                }
+                FeedbackProcessor processor;
+                processor.setKernelIsa((KernelIsa)isa);
+                double seconds = timeFrames(processor, scenarios[s].darkInput ? darkSources : sources,
+                                            display, width, height, scenarios[s].params, frames);
+                printTiming(width, height, scenarios[s].name, getKernelIsaName((KernelIsa)isa), seconds, frames);
+                if (scenarios[s].params.bloomLevels > 0) {
+                    printBloomTimings(processor.getBloom().getTimings());
+                }
+            }
+        }
+    }
+
+    // band scaling with the detected kernels, threads counted including the caller
+    const int hardwareThreads = WorkerPool::getHardwareThreads();
+    printf("\n%-10s %-12s %-7s %10s %10s %10s\n", "resolution", "scenario", "threads", "ms/frame", "ns/pixel", "frames/s");
+    for (int r = numCaptureResolutions - 3 ; r < numCaptureResolutions ; r++) {
+        const int width = captureResolutionsWidth[r];
+        const int height = captureResolutionsHeight[r];
+        const size_t bytes = (size_t)width * height * 4;
+        std::vector< std::vector<uint8_t> > sources(NUM_SOURCE_FRAMES, std::vector<uint8_t>(bytes));
+        std::vector< std::vector<uint8_t> > darkSources(NUM_SOURCE_FRAMES, std::vector<uint8_t>(bytes));
+        for (int i = 0 ; i < NUM_SOURCE_FRAMES ; i++) {
+            fillNoise(sources[i], 12345u + i);
+            fillDark(darkSources[i], width, 12345u + i);
+        }
+        std::vector<uint8_t> display(bytes);
+        for (size_t s = 0 ; s < scenarios.size() ; s++) {
+            for (int threads = 1 ; ; threads = std::min(threads * 2, hardwareThreads)) {
+                FeedbackProcessor processor;
+                FeedbackParams params = scenarios[s].params;
+                params.numThreads = threads;
+                double seconds = timeFrames(processor, scenarios[s].darkInput ? darkSources : sources,
+                                            display, width, height, params, frames);
+                char variant[8];
+                snprintf(variant, sizeof(variant), "%d", threads);
+                printTiming(width, height, scenarios[s].name, variant, seconds, frames);
+                if (threads >= hardwareThreads) {
+                    break;
+                }
+            }
+        }
+    }
+    return passed ? 0 : 1;
+}
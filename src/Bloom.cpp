@@ -0,0 +1,279 @@
+//
+//  Bloom.cpp
+//  Illuminate
+//
+
+#include "Bloom.h"
+
+#include <algorithm>
+#include <chrono>
+
+#include "FeedbackKernels.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+const int BANDS_PER_THREAD = 4;
+const int MIN_BAND_ROWS = 8;
+const int MIN_STRIP_BYTES = 64;
+
+typedef std::chrono::steady_clock Clock;
+
+float getMsSince(Clock::time_point start)
+{
+    return std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+}
+
+// the small levels go in one band, a few rows each isn't worth a wake up
+int getNumBands(const WorkerPool &pool, int32_t rows)
+{
+    if (pool.getNumThreads() == 1) {
+        return 1;
+    }
+    return std::max(std::min(pool.getNumThreads() * BANDS_PER_THREAD, (int)(rows / MIN_BAND_ROWS)), 1);
+}
+
+int getNumStrips(const WorkerPool &pool, int32_t rowLength)
+{
+    if (pool.getNumThreads() == 1) {
+        return 1;
+    }
+    return std::max(std::min(pool.getNumThreads() * BANDS_PER_THREAD, (int)(rowLength / MIN_STRIP_BYTES)), 1);
+}
+
+// dst = max(dst - amount, 0)
+void subtractBytes(uint8_t *dst, int32_t count, uint8_t amount)
+{
+    int32_t i = 0;
+#if defined(__SSE2__)
+    const __m128i amounts = _mm_set1_epi8((char)amount);
+    for ( ; i + 16 <= count ; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i *)(dst + i));
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_subs_epu8(d, amounts));
+    }
+#endif
+    for ( ; i < count ; i++) {
+        dst[i] = dst[i] > amount ? (uint8_t)(dst[i] - amount) : 0;
+    }
+}
+
+// dst = 3 * nearRow + farRow, a quarter of the way from one row to the next, times 4
+void mixRows(uint16_t *dst, const uint8_t *nearRow, const uint8_t *farRow, int32_t count)
+{
+    int32_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for ( ; i + 16 <= count ; i += 16) {
+        const __m128i n = _mm_loadu_si128((const __m128i *)(nearRow + i));
+        const __m128i f = _mm_loadu_si128((const __m128i *)(farRow + i));
+        __m128i lo = _mm_unpacklo_epi8(n, zero);
+        __m128i hi = _mm_unpackhi_epi8(n, zero);
+        lo = _mm_add_epi16(_mm_add_epi16(lo, _mm_add_epi16(lo, lo)), _mm_unpacklo_epi8(f, zero));
+        hi = _mm_add_epi16(_mm_add_epi16(hi, _mm_add_epi16(hi, hi)), _mm_unpackhi_epi8(f, zero));
+        _mm_storeu_si128((__m128i *)(dst + i), lo);
+        _mm_storeu_si128((__m128i *)(dst + i + 8), hi);
+    }
+#endif
+    for ( ; i < count ; i++) {
+        dst[i] = (uint16_t)(3 * nearRow[i] + farRow[i]);
+    }
+}
+
+// Adds count pixels upsampled from mixed onto dst, the colour bytes only. Pixels
+// 2x and 2x + 1 are 3 / 4 of mixed pixel x and 1 / 4 of the one left / right of it,
+// mixed[-pixelInc] and mixed[coarseCount * pixelInc] hold the edge pixels again.
+// intensity is 64 for 1, the 16 of 3 * mixed + neighbour and the 64 go in one mulhi.
+void upsampleAddRow(uint8_t *dst, const uint16_t *mixed, int32_t count, int32_t coarseCount, int32_t pixelInc,
+                    uint16_t intensity, uint32_t channelMask)
+{
+    int32_t x = 0;
+#if defined(__SSE2__)
+    if (pixelInc == 4) {
+        const __m128i half = _mm_set1_epi16(8);
+        const __m128i intensities = _mm_set1_epi16((short)(intensity << 2));
+        const __m128i mask = _mm_set1_epi32((int32_t)channelMask);
+        // 4 pixels out of mixed pixels x / 2 - 1 to x / 2 + 2
+        for ( ; x + 4 <= count && (x >> 1) + 2 <= coarseCount ; x += 4) {
+            const uint16_t *m = mixed + (x >> 1) * 4;
+            const __m128i centre = _mm_loadu_si128((const __m128i *)m);
+            const __m128i left = _mm_loadu_si128((const __m128i *)(m - 4));
+            const __m128i right = _mm_loadu_si128((const __m128i *)(m + 4));
+            const __m128i centre3 = _mm_add_epi16(centre, _mm_add_epi16(centre, centre));
+            const __m128i even = _mm_mulhi_epu16(_mm_add_epi16(_mm_slli_epi16(_mm_add_epi16(centre3, left), 4), half), intensities);
+            const __m128i odd = _mm_mulhi_epu16(_mm_add_epi16(_mm_slli_epi16(_mm_add_epi16(centre3, right), 4), half), intensities);
+            const __m128i glow = _mm_packus_epi16(_mm_unpacklo_epi64(even, odd), _mm_unpackhi_epi64(even, odd));
+            __m128i d = _mm_loadu_si128((const __m128i *)(dst + x * 4));
+            _mm_storeu_si128((__m128i *)(dst + x * 4), _mm_adds_epu8(d, _mm_and_si128(glow, mask)));
+        }
+    }
+#endif
+    const uint8_t *maskBytes = reinterpret_cast<const uint8_t*>(&channelMask);
+    for ( ; x < count ; x++) {
+        // an odd count has one pixel past the last pair, it goes with the last one
+        const int32_t centre = std::min(x >> 1, coarseCount - 1);
+        const int32_t neighbour = (x & 1) ? centre + 1 : centre - 1;
+        for (int32_t c = 0 ; c < pixelInc ; c++) {
+            const int32_t i = x * pixelInc + c;
+            if (!maskBytes[i & 3]) {
+                continue;
+            }
+            const uint32_t value = (3 * mixed[centre * pixelInc + c] + mixed[neighbour * pixelInc + c]) * 16 + 8;
+            const int32_t glow = (int32_t)((value * (intensity << 2)) >> 16);
+            dst[i] = (uint8_t)std::min(dst[i] + glow, 255);
+        }
+    }
+}
+
+}
+
+Bloom::Timings::Timings()
+    : numLevels(0)
+{
+    std::fill(levelMs, levelMs + MAX_LEVELS, 0.f);
+}
+
+Bloom::Bloom()
+    : mMixedStride(0)
+{
+}
+
+void Bloom::fitLevels(const FrameView &frame)
+{
+    if (frame.hasSameLayout(mLayout) && !mLevels[0].empty()) {
+        return;
+    }
+    mLayout = frame;
+    mLayout.data = NULL;
+    for (int l = 0 ; l < MAX_LEVELS ; l++) {
+        const size_t bytes = (size_t)(frame.width >> (l + 1)) * frame.pixelInc * (frame.height >> (l + 1));
+        std::vector<uint8_t>(bytes, 0).swap(mLevels[l]);
+    }
+}
+
+void Bloom::release()
+{
+    for (int l = 0 ; l < MAX_LEVELS ; l++) {
+        std::vector<uint8_t>().swap(mLevels[l]);
+    }
+    std::vector<uint16_t>().swap(mMixed);
+    mLayout = FrameView();
+    mTimings = Timings();
+}
+
+size_t Bloom::getMemoryBytes() const
+{
+    size_t bytes = mMixed.size() * sizeof(uint16_t);
+    for (int l = 0 ; l < MAX_LEVELS ; l++) {
+        bytes += mLevels[l].size();
+    }
+    return bytes;
+}
+
+void Bloom::upsampleAdd(const FrameView &coarse, uint8_t *fineRow, int32_t fineY, int32_t fineCount,
+                        int band, uint16_t intensityFixed, uint32_t channelMask)
+{
+    // fine row 2y is 3 / 4 coarse row y and 1 / 4 row y - 1, row 2y + 1 the same with row y + 1
+    const int32_t pixelInc = coarse.pixelInc;
+    const int32_t y = std::min(fineY >> 1, coarse.height - 1);
+    const int32_t neighbour = (fineY & 1) ? std::min(y + 1, coarse.height - 1) : std::max(y - 1, 0);
+    const int32_t length = coarse.width * pixelInc;
+    uint16_t *mixed = &mMixed[band * mMixedStride] + pixelInc;
+    mixRows(mixed, coarse.getRow(y), coarse.getRow(neighbour), length);
+    for (int32_t c = 0 ; c < pixelInc ; c++) {
+        mixed[c - pixelInc] = mixed[c];
+        mixed[length + c] = mixed[length - pixelInc + c];
+    }
+    upsampleAddRow(fineRow, mixed, fineCount, coarse.width, pixelInc, intensityFixed, channelMask);
+}
+
+void Bloom::apply(const FrameView &frame, const FrameRect &region, int numLevels, uint8_t threshold,
+                  int radius, float intensity, WorkerPool &pool)
+{
+    fitLevels(frame);
+    const int32_t pixelInc = frame.pixelInc;
+    FrameView levels[MAX_LEVELS];
+    int32_t width = region.getWidth();
+    int32_t height = region.getHeight();
+    int n = 0;
+    for ( ; n < std::min(numLevels, (int)MAX_LEVELS) ; n++) {
+        width >>= 1;
+        height >>= 1;
+        if (width < 1 || height < 1) {
+            break;
+        }
+        levels[n] = FrameView(&mLevels[n][0], width, height, (frame.width >> (n + 1)) * pixelInc,
+                              frame.pixelInc, frame.redOffset, frame.greenOffset, frame.blueOffset);
+    }
+    mTimings.numLevels = n;
+    if (n == 0) {
+        return;
+    }
+    mMixedStride = (size_t)(levels[0].width + 2) * pixelInc;
+    const size_t mixedLength = mMixedStride * getNumBands(pool, region.getHeight());
+    if (mMixed.size() < mixedLength) {
+        mMixed.resize(mixedLength);
+    }
+
+    // down the pyramid, each level a box filtered half of the one above, then blurred
+    for (int l = 0 ; l < n ; l++) {
+        const Clock::time_point start = Clock::now();
+        const FrameView &level = levels[l];
+        const uint8_t *above = l == 0 ? frame.getRow(region.y1) + region.x1 * pixelInc : levels[l - 1].data;
+        const int32_t aboveRowBytes = l == 0 ? frame.rowBytes : levels[l - 1].rowBytes;
+        const int32_t length = level.width * pixelInc;
+        const int numBands = getNumBands(pool, level.height);
+        mBlur.configure(radius, BLUR_PASSES, length, pixelInc, numBands);
+        pool.run(numBands, [&](int band) {
+            const int32_t bandEnd = WorkerPool::getBandStart(band + 1, numBands, level.height);
+            for (int32_t y = WorkerPool::getBandStart(band, numBands, level.height) ; y < bandEnd ; y++) {
+                uint8_t *row = level.getRow(y);
+                downsampleRow(row, above + (size_t)2 * y * aboveRowBytes, aboveRowBytes, level.width, pixelInc, 2);
+                if (l == 0) {
+                    subtractBytes(row, length, threshold);
+                }
+                mBlur.blurRow(band, row, level.width);
+            }
+        });
+        if (mBlur.getRadius() > 0) {
+            const int numStrips = getNumStrips(pool, length);
+            pool.run(numStrips, [&](int strip) {
+                const int32_t stripStart = WorkerPool::getBandStart(strip, numStrips, length) & ~15;
+                const int32_t stripEnd = strip + 1 == numStrips ? length
+                                       : (WorkerPool::getBandStart(strip + 1, numStrips, length) & ~15);
+                mBlur.blurColumns(level, 0, level.height, stripStart, stripEnd);
+            });
+        }
+        mTimings.levelMs[l] = getMsSince(start);
+    }
+
+    // back up, every level adds onto the one above as it is
+    for (int l = n - 1 ; l > 0 ; l--) {
+        const Clock::time_point start = Clock::now();
+        const FrameView &fine = levels[l - 1];
+        const int numBands = getNumBands(pool, fine.height);
+        pool.run(numBands, [&](int band) {
+            const int32_t bandEnd = WorkerPool::getBandStart(band + 1, numBands, fine.height);
+            for (int32_t y = WorkerPool::getBandStart(band, numBands, fine.height) ; y < bandEnd ; y++) {
+                upsampleAdd(levels[l], fine.getRow(y), y, fine.width, band, 64, 0xffffffff);
+            }
+        });
+        mTimings.levelMs[l] += getMsSince(start);
+    }
+
+    // and the glow onto the frame
+    const Clock::time_point start = Clock::now();
+    const uint16_t intensityFixed = (uint16_t)std::min(std::max((int32_t)(intensity * 64.f + 0.5f), 0), 256);
+    const uint32_t channelMask = frame.getChannelMask();
+    const int numBands = getNumBands(pool, region.getHeight());
+    pool.run(numBands, [&](int band) {
+        const int32_t bandEnd = WorkerPool::getBandStart(band + 1, numBands, region.getHeight());
+        for (int32_t y = WorkerPool::getBandStart(band, numBands, region.getHeight()) ; y < bandEnd ; y++) {
+            upsampleAdd(levels[0], frame.getRow(region.y1 + y) + region.x1 * pixelInc, y, region.getWidth(),
+                        band, intensityFixed, channelMask);
+        }
+    });
+    mTimings.levelMs[0] += getMsSince(start);
+}
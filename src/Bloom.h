@@ -0,0 +1,66 @@
+//
+//  Bloom.h
+//  Illuminate
+//
+//  Glow around the bright parts of the display frame. What's over the threshold
+//  goes into a pyramid of half size levels, each level is box blurred (cheap at
+//  that size) and the levels are added back up the pyramid onto the frame. The
+//  levels are allocated once per frame size and layout.
+//
+
+#ifndef Bloom_h
+#define Bloom_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "BoxBlur.h"
+#include "FrameView.h"
+#include "WorkerPool.h"
+
+class Bloom {
+  public:
+    static const int MAX_LEVELS = 6;
+    static const int BLUR_PASSES = 2;
+
+    // time spent on each level in the last apply(): building and blurring it and adding
+    // it onto the level above, level 0 includes adding the glow onto the frame
+    struct Timings {
+        int         numLevels;
+        float       levelMs[MAX_LEVELS];
+
+        Timings();
+    };
+
+    Bloom();
+
+    // Adds the glow of region into frame. Channels over threshold (0-255) light the
+    // pyramid, radius is the blur of every level in its own pixels, so the glow of
+    // each level is twice as wide as the one above. intensity scales the glow, 1 adds
+    // it as it is. Levels that would be smaller than a pixel are left out.
+    void apply(const FrameView &frame, const FrameRect &region, int numLevels, uint8_t threshold,
+               int radius, float intensity, WorkerPool &pool);
+    // memory goes too, the next apply() allocates again
+    void release();
+
+    const Timings& getTimings() const { return mTimings; }
+    size_t getMemoryBytes() const;
+
+  private:
+    // (re)allocates the levels when frame has another size or layout
+    void fitLevels(const FrameView &frame);
+    // adds row fineY of the level above coarse (or of the frame), fineCount pixels,
+    // upsampled from coarse, band picks the scratch row
+    void upsampleAdd(const FrameView &coarse, uint8_t *fineRow, int32_t fineY, int32_t fineCount,
+                     int band, uint16_t intensityFixed, uint32_t channelMask);
+
+    FrameView               mLayout;        // data unused
+    std::vector<uint8_t>    mLevels[MAX_LEVELS];
+    std::vector<uint16_t>   mMixed;         // per band, a coarse row mixed with its neighbour, see upsampleAdd
+    size_t                  mMixedStride;
+    BoxBlur                 mBlur;
+    Timings                 mTimings;
+};
+
+#endif /* Bloom_h */
@@ -0,0 +1,196 @@
+//
+//  BoxBlur.cpp
+//  Illuminate
+//
+
+#include "BoxBlur.h"
+
+#include <algorithm>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// dst[i] = dst[i - pixelInc] + src[i] per channel, wrapping at 16 bits, the pixel before
+// dst holds the sums to carry on from. Only differences of two sums less than 65536
+// apart are used, those come out exact.
+void prefixSums(uint16_t *dst, const uint8_t *src, int32_t length, int32_t pixelInc)
+{
+    int32_t i = 0;
+#if defined(__SSE2__)
+    if (pixelInc == 4) {
+        // two pixels per 8 lanes, add the first into the second then the last sum so far into both
+        const __m128i zero = _mm_setzero_si128();
+        __m128i carry = _mm_loadl_epi64((const __m128i *)(dst - 4));
+        carry = _mm_unpacklo_epi64(carry, carry);
+        for ( ; i + 16 <= length ; i += 16) {
+            const __m128i bytes = _mm_loadu_si128((const __m128i *)(src + i));
+            __m128i lo = _mm_unpacklo_epi8(bytes, zero);
+            __m128i hi = _mm_unpackhi_epi8(bytes, zero);
+            lo = _mm_add_epi16(_mm_add_epi16(lo, _mm_slli_si128(lo, 8)), carry);
+            carry = _mm_unpackhi_epi64(lo, lo);
+            hi = _mm_add_epi16(_mm_add_epi16(hi, _mm_slli_si128(hi, 8)), carry);
+            carry = _mm_unpackhi_epi64(hi, hi);
+            _mm_storeu_si128((__m128i *)(dst + i), lo);
+            _mm_storeu_si128((__m128i *)(dst + i + 8), hi);
+        }
+    }
+#endif
+    for ( ; i < length ; i++) {
+        dst[i] = (uint16_t)(dst[i - pixelInc] + src[i]);
+    }
+}
+
+// dst = (box sum + half) * reciprocal >> 16, box sum = upper - lower. With the
+// reciprocal rounded up that is exact on flat areas and never over 255.
+void boxMeans(uint8_t *dst, const uint16_t *upper, const uint16_t *lower, int32_t length, uint16_t half, uint16_t reciprocal)
+{
+    int32_t i = 0;
+#if defined(__SSE2__)
+    const __m128i halfs = _mm_set1_epi16((short)half);
+    const __m128i reciprocals = _mm_set1_epi16((short)reciprocal);
+    for ( ; i + 16 <= length ; i += 16) {
+        __m128i lo = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(upper + i)), _mm_loadu_si128((const __m128i *)(lower + i)));
+        __m128i hi = _mm_sub_epi16(_mm_loadu_si128((const __m128i *)(upper + i + 8)), _mm_loadu_si128((const __m128i *)(lower + i + 8)));
+        lo = _mm_mulhi_epu16(_mm_add_epi16(lo, halfs), reciprocals);
+        hi = _mm_mulhi_epu16(_mm_add_epi16(hi, halfs), reciprocals);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(lo, hi));
+    }
+#endif
+    for ( ; i < length ; i++) {
+        const uint16_t sum = (uint16_t)(upper[i] - lower[i] + half);
+        dst[i] = (uint8_t)(((uint32_t)sum * reciprocal) >> 16);
+    }
+}
+
+// dst = mean of sums, then the window moves down a row: sums += added - removed
+void columnStep(uint8_t *dst, uint16_t *sums, const uint8_t *added, const uint8_t *removed, int32_t length,
+                uint16_t half, uint16_t reciprocal)
+{
+    int32_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i halfs = _mm_set1_epi16((short)half);
+    const __m128i reciprocals = _mm_set1_epi16((short)reciprocal);
+    for ( ; i + 16 <= length ; i += 16) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(sums + i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(sums + i + 8));
+        const __m128i meanLo = _mm_mulhi_epu16(_mm_add_epi16(lo, halfs), reciprocals);
+        const __m128i meanHi = _mm_mulhi_epu16(_mm_add_epi16(hi, halfs), reciprocals);
+        _mm_storeu_si128((__m128i *)(dst + i), _mm_packus_epi16(meanLo, meanHi));
+        const __m128i add = _mm_loadu_si128((const __m128i *)(added + i));
+        const __m128i remove = _mm_loadu_si128((const __m128i *)(removed + i));
+        lo = _mm_sub_epi16(_mm_add_epi16(lo, _mm_unpacklo_epi8(add, zero)), _mm_unpacklo_epi8(remove, zero));
+        hi = _mm_sub_epi16(_mm_add_epi16(hi, _mm_unpackhi_epi8(add, zero)), _mm_unpackhi_epi8(remove, zero));
+        _mm_storeu_si128((__m128i *)(sums + i), lo);
+        _mm_storeu_si128((__m128i *)(sums + i + 8), hi);
+    }
+#endif
+    for ( ; i < length ; i++) {
+        dst[i] = (uint8_t)(((uint32_t)(sums[i] + half) * reciprocal) >> 16);
+        sums[i] = (uint16_t)(sums[i] + added[i] - removed[i]);
+    }
+}
+
+}
+
+BoxBlur::BoxBlur()
+    : mRadius(0), mPasses(0), mRowLength(0), mPixelInc(4), mHalf(0), mReciprocal(0), mPrefixStride(0)
+{
+}
+
+void BoxBlur::configure(int radius, int passes, int32_t rowLength, int32_t pixelInc, int numBands)
+{
+    mRadius = std::min(std::max(radius, 0), (int)MAX_RADIUS);
+    mPasses = std::min(std::max(passes, 1), (int)MAX_PASSES);
+    mRowLength = rowLength;
+    mPixelInc = pixelInc;
+    const int32_t size = 2 * mRadius + 1;
+    mHalf = (uint16_t)(size / 2);
+    mReciprocal = (uint16_t)((65536 + size - 1) / size);
+    if (mRadius == 0) {
+        return;
+    }
+    mPrefixStride = (size_t)rowLength + (size_t)size * pixelInc;
+    const size_t prefixLength = mPrefixStride * std::max(numBands, 1);
+    if (mPrefix.size() < prefixLength) {
+        mPrefix.resize(prefixLength);
+    }
+    if (mColumnSums.size() < (size_t)rowLength) {
+        mColumnSums.resize(rowLength);
+    }
+    const size_t ringBytes = (size_t)(size + 1) * rowLength;
+    if (mRing.size() < ringBytes) {
+        mRing.resize(ringBytes);
+    }
+}
+
+void BoxBlur::blurRow(int band, uint8_t *row, int32_t count)
+{
+    if (mRadius == 0 || count <= 0) {
+        return;
+    }
+    const int32_t pixelInc = mPixelInc;
+    const int32_t radius = mRadius;
+    const int32_t size = 2 * radius + 1;
+    const int32_t length = count * pixelInc;
+    uint16_t *prefix = &mPrefix[band * mPrefixStride];
+    uint16_t *rowPrefix = prefix + (radius + 1) * pixelInc;
+    const uint8_t *last = row + length - pixelInc;
+    for (int pass = 0 ; pass < mPasses ; pass++) {
+        // as if the row had radius + 1 more of its first pixel before it and radius
+        // more of its last after it, prefix pixel k is up to row pixel k - radius - 1
+        for (int32_t k = 0 ; k <= radius ; k++) {
+            for (int32_t c = 0 ; c < pixelInc ; c++) {
+                prefix[k * pixelInc + c] = (uint16_t)((k + 1) * row[c]);
+            }
+        }
+        prefixSums(rowPrefix, row, length, pixelInc);
+        for (int32_t i = length ; i < length + radius * pixelInc ; i++) {
+            rowPrefix[i] = (uint16_t)(rowPrefix[i - pixelInc] + last[i % pixelInc]);
+        }
+        // pixel x sums pixels x - radius to x + radius, prefix pixels x + 1 to x + size
+        boxMeans(row, prefix + size * pixelInc, prefix, length, mHalf, mReciprocal);
+    }
+}
+
+void BoxBlur::blurColumns(const FrameView &frame, int32_t y1, int32_t y2, int32_t start, int32_t end)
+{
+    const int32_t height = y2 - y1;
+    const int32_t length = end - start;
+    if (mRadius == 0 || height <= 0 || length <= 0) {
+        return;
+    }
+    const int32_t radius = mRadius;
+    const int32_t ringRows = 2 * radius + 2;
+    uint16_t *sums = &mColumnSums[start];
+    for (int pass = 0 ; pass < mPasses ; pass++) {
+        // rows are blurred in place, the ring keeps the ones the window still has to take out
+        for (int32_t j = 0 ; j <= std::min(radius, height - 1) ; j++) {
+            memcpy(&mRing[(size_t)j * mRowLength + start], frame.getRow(y1 + j) + start, length);
+        }
+        // window of row 0: the top row radius + 1 times (rows above repeat it), then rows 1 to radius
+        const uint8_t *top = &mRing[start];
+        for (int32_t i = 0 ; i < length ; i++) {
+            sums[i] = (uint16_t)(top[i] * (radius + 1));
+        }
+        for (int32_t j = 1 ; j <= radius ; j++) {
+            const uint8_t *row = &mRing[(size_t)(std::min(j, height - 1) % ringRows) * mRowLength + start];
+            for (int32_t i = 0 ; i < length ; i++) {
+                sums[i] = (uint16_t)(sums[i] + row[i]);
+            }
+        }
+        for (int32_t y = 0 ; y < height ; y++) {
+            const int32_t added = y + radius + 1;
+            if (added < height) {
+                memcpy(&mRing[(size_t)(added % ringRows) * mRowLength + start], frame.getRow(y1 + added) + start, length);
+            }
+            const uint8_t *addedRow = &mRing[(size_t)(std::min(added, height - 1) % ringRows) * mRowLength + start];
+            const uint8_t *removedRow = &mRing[(size_t)(std::max(y - radius, 0) % ringRows) * mRowLength + start];
+            columnStep(frame.getRow(y1 + y) + start, sums, addedRow, removedRow, length, mHalf, mReciprocal);
+        }
+    }
+}
@@ -0,0 +1,52 @@
+//
+//  BoxBlur.h
+//  Illuminate
+//
+//  Separable box blur of 8 bit frames in place, from running sums so a pixel costs
+//  the same at any radius. Repeating it passes times gets close to a Gaussian (3
+//  passes of radius r is about sigma r). Rows and columns are blurred separately so
+//  the rows can go while they are still in cache from the rest of the row chain.
+//
+
+#ifndef BoxBlur_h
+#define BoxBlur_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "FrameView.h"
+
+class BoxBlur {
+  public:
+    static const int MAX_RADIUS = 64;       // box sums of 255 * (2 * radius + 1) still fit in 16 bits
+    static const int MAX_PASSES = 3;
+
+    BoxBlur();
+
+    // Call before the blur calls of a frame. Rows of up to rowLength bytes, up to
+    // numBands blurRow() calls at a time. Scratch memory only grows.
+    void configure(int radius, int passes, int32_t rowLength, int32_t pixelInc, int numBands);
+    int getRadius() const { return mRadius; }
+    int getPasses() const { return mPasses; }
+
+    // blurs count pixels of row along the row, band keeps concurrent calls apart
+    void blurRow(int band, uint8_t *row, int32_t count);
+    // blurs bytes start to end of rows y1 to y2 of frame down the columns, concurrent
+    // calls need byte ranges that don't overlap
+    void blurColumns(const FrameView &frame, int32_t y1, int32_t y2, int32_t start, int32_t end);
+
+  private:
+    int                     mRadius;
+    int                     mPasses;
+    int32_t                 mRowLength;
+    int32_t                 mPixelInc;
+    uint16_t                mHalf;          // rounding, added to a box sum before * mReciprocal
+    uint16_t                mReciprocal;    // 65536 / box size rounded up, see boxMeans
+    size_t                  mPrefixStride;  // per band in mPrefix
+    std::vector<uint16_t>   mPrefix;        // running sums along the row with its edges repeated, wrapping at 16 bits
+    std::vector<uint16_t>   mColumnSums;    // box sum of each byte of the row
+    std::vector<uint8_t>    mRing;          // the last 2 * radius + 2 rows before blurring
+};
+
+#endif /* BoxBlur_h */
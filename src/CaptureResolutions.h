@@ -0,0 +1,15 @@
+//
+//  CaptureResolutions.h
+//  Illuminate
+//
+//  Capture resolutions offered for every camera, shared by the app and the benchmark.
+//
+
+#ifndef CaptureResolutions_h
+#define CaptureResolutions_h
+
+static const int numCaptureResolutions = 7;
+static const int captureResolutionsWidth[] = {640, 800, 1024, 1280, 1920, 2048, 2560};
+static const int captureResolutionsHeight[] = {480, 600, 768, 720, 1080, 1152, 1440};
+
+#endif /* CaptureResolutions_h */
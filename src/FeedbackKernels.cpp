@@ -0,0 +1,1001 @@
+//
+//  FeedbackKernels.cpp
+//  Illuminate
+//
+
+#include "FeedbackKernels.h"
+
+#include <cmath>
+#include <cstddef>
+#include <cstring>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <cpuid.h>
+#define KERNELS_X86 1
+#endif
+
+#if KERNELS_X86
+// FeedbackKernelsSimd.cpp
+FeedbackRowKernel getFeedbackRowKernelSse2(bool fixedPoint, FeedbackBlendMode blendMode,
+                                           FeedbackTrailMode trailMode, FeedbackMixMode mixMode);
+FeedbackRowKernel getFeedbackRowKernelAvx2(bool fixedPoint, FeedbackBlendMode blendMode,
+                                           FeedbackTrailMode trailMode, FeedbackMixMode mixMode);
+FeedbackRow16Kernel getFeedbackRow16KernelSse2(FeedbackTrailMode trailMode, FeedbackMixMode mixMode);
+FeedbackRow16Kernel getFeedbackRow16KernelAvx2(FeedbackTrailMode trailMode, FeedbackMixMode mixMode);
+FeedbackRow16Kernel getFeedbackRowGainKernelSse2(FeedbackTrailMode trailMode, FeedbackMixMode mixMode);
+FeedbackRow16Kernel getFeedbackRowGainKernelAvx2(FeedbackTrailMode trailMode, FeedbackMixMode mixMode);
+FeedbackRow16Kernel getFeedbackRowLinearKernelSse2(FeedbackTrailMode trailMode, FeedbackMixMode mixMode);
+void trailLayersRowAvx2(uint8_t *const *layers, const TrailLayerRowParams *params, int numLayers, const uint8_t *src,
+                        uint8_t *display, int32_t count, int32_t tintPhase, bool decay);
+
+static KernelIsa queryCpu()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx) || !(edx & bit_SSE2)) {
+        return KERNEL_ISA_SCALAR;
+    }
+    // AVX registers also need to be saved by the OS (OSXSAVE + XCR0 bits 1 and 2)
+    const bool osxsave = (ecx & bit_OSXSAVE) != 0;
+    const bool avx = (ecx & bit_AVX) != 0;
+    if (!osxsave || !avx) {
+        return KERNEL_ISA_SSE2;
+    }
+    unsigned int xcr0Lo, xcr0Hi;
+    __asm__ __volatile__("xgetbv" : "=a"(xcr0Lo), "=d"(xcr0Hi) : "c"(0));
+    if ((xcr0Lo & 6) != 6) {
+        return KERNEL_ISA_SSE2;
+    }
+    if (__get_cpuid_max(0, NULL) < 7) {
+        return KERNEL_ISA_SSE2;
+    }
+    __cpuid_count(7, 0, eax, ebx, ecx, edx);
+    return (ebx & bit_AVX2) ? KERNEL_ISA_AVX2 : KERNEL_ISA_SSE2;
+}
+#else
+static KernelIsa queryCpu()
+{
+    return KERNEL_ISA_SCALAR;
+}
+#endif
+
+KernelIsa detectKernelIsa()
+{
+    static const KernelIsa isa = queryCpu();
+    return isa;
+}
+
+bool isKernelIsaSupported(KernelIsa isa)
+{
+    return isa >= KERNEL_ISA_SCALAR && isa <= detectKernelIsa();
+}
+
+const char* getKernelIsaName(KernelIsa isa)
+{
+    switch (isa) {
+        case KERNEL_ISA_SCALAR: return "scalar";
+        case KERNEL_ISA_SSE2:   return "sse2";
+        case KERNEL_ISA_AVX2:   return "avx2";
+        default:                return "unknown";
+    }
+}
+
+// o and n 0-255, see FeedbackBlendMode
+template <FeedbackBlendMode BLEND>
+static inline uint32_t blendScalar(uint32_t o, uint32_t n, uint32_t weight)
+{
+    switch (BLEND) {
+        case BLEND_MODE_SCREEN: {
+            // o * n / 255 rounded, without a divide
+            const uint32_t product = o * n + 128;
+            return o + n - ((product + (product >> 8)) >> 8);
+        }
+        case BLEND_MODE_ADD:        return o + n > 255 ? 255 : o + n;
+        case BLEND_MODE_DIFFERENCE: return o > n ? o - n : n - o;
+        case BLEND_MODE_AVERAGE:    return (o * (256 - weight) + n * weight) >> 8;
+        default:                    return n > o ? n : o;
+    }
+}
+
+static uint32_t blendScalar(FeedbackBlendMode blendMode, uint32_t o, uint32_t n, uint32_t weight)
+{
+    switch (blendMode) {
+        case BLEND_MODE_SCREEN:     return blendScalar<BLEND_MODE_SCREEN>(o, n, weight);
+        case BLEND_MODE_ADD:        return blendScalar<BLEND_MODE_ADD>(o, n, weight);
+        case BLEND_MODE_DIFFERENCE: return blendScalar<BLEND_MODE_DIFFERENCE>(o, n, weight);
+        case BLEND_MODE_AVERAGE:    return blendScalar<BLEND_MODE_AVERAGE>(o, n, weight);
+        default:                    return blendScalar<BLEND_MODE_LIGHTEN>(o, n, weight);
+    }
+}
+
+void feedbackRowScalar(uint8_t *trail, const uint8_t *src, uint8_t *display,
+                       int32_t count, const FeedbackRowParams &params)
+{
+    const uint8_t *channelMask = reinterpret_cast<const uint8_t*>(&params.channelMask);
+    const float feedback = params.feedback;
+    const float mix = params.newestFrameMix;
+    const float oldMix = 1 - mix;
+    for (int32_t i = 0 ; i < count ; i++) {
+        const uint8_t n = src[i];
+        uint8_t o = trail[i];
+        if (params.blurOn) {
+            if (params.decay) {
+                o = (int)(((float)o) * feedback);
+            }
+            o = (uint8_t)blendScalar(params.blendMode, o, n, params.blendWeightFixed);
+        } else {
+            o = n;
+        }
+        trail[i] = o;
+        display[i] = channelMask[i & 3] ? (uint8_t)((o * oldMix) + (n * mix)) : n;
+    }
+}
+
+void feedbackRowFixedScalar(uint8_t *trail, const uint8_t *src, uint8_t *display,
+                            int32_t count, const FeedbackRowParams &params)
+{
+    const uint8_t *channelMask = reinterpret_cast<const uint8_t*>(&params.channelMask);
+    const uint32_t feedback = params.feedbackFixed;
+    const uint32_t mix = params.newestFrameMixFixed;
+    const uint32_t oldMix = 256 - mix;
+    for (int32_t i = 0 ; i < count ; i++) {
+        const uint32_t n = src[i];
+        uint32_t o = trail[i];
+        if (params.blurOn) {
+            if (params.decay) {
+                o = (o * feedback) >> 16;
+            }
+            o = blendScalar(params.blendMode, o, n, params.blendWeightFixed);
+        } else {
+            o = n;
+        }
+        trail[i] = (uint8_t)o;
+        display[i] = channelMask[i & 3] ? (uint8_t)(((o * oldMix) + (n * mix)) >> 8) : (uint8_t)n;
+    }
+}
+
+template <FeedbackBlendMode BLEND, FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+static void feedbackRowScalar(uint8_t *trail, const uint8_t *src, uint8_t *display,
+                              int32_t count, const FeedbackRowParams &params)
+{
+    const uint8_t *channelMask = reinterpret_cast<const uint8_t*>(&params.channelMask);
+    const float feedback = params.feedback;
+    const float mix = params.newestFrameMix;
+    const float oldMix = 1 - mix;
+    for (int32_t i = 0 ; i < count ; i++) {
+        const uint8_t n = src[i];
+        uint8_t o = n;
+        if (TRAIL != TRAIL_MODE_REPLACE) {
+            o = trail[i];
+            if (TRAIL == TRAIL_MODE_DECAY) {
+                o = (int)(((float)o) * feedback);
+            }
+            o = (uint8_t)blendScalar<BLEND>(o, n, params.blendWeightFixed);
+        }
+        trail[i] = o;
+        if (MIX == MIX_MODE_NEW) {
+            display[i] = n;
+        } else if (MIX == MIX_MODE_TRAIL) {
+            display[i] = channelMask[i & 3] ? o : n;
+        } else {
+            display[i] = channelMask[i & 3] ? (uint8_t)((o * oldMix) + (n * mix)) : n;
+        }
+    }
+}
+
+template <FeedbackBlendMode BLEND, FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+static void feedbackRowFixedScalar(uint8_t *trail, const uint8_t *src, uint8_t *display,
+                                   int32_t count, const FeedbackRowParams &params)
+{
+    const uint8_t *channelMask = reinterpret_cast<const uint8_t*>(&params.channelMask);
+    const uint32_t feedback = params.feedbackFixed;
+    const uint32_t mix = params.newestFrameMixFixed;
+    const uint32_t oldMix = 256 - mix;
+    for (int32_t i = 0 ; i < count ; i++) {
+        const uint32_t n = src[i];
+        uint32_t o = n;
+        if (TRAIL != TRAIL_MODE_REPLACE) {
+            o = trail[i];
+            if (TRAIL == TRAIL_MODE_DECAY) {
+                o = (o * feedback) >> 16;
+            }
+            o = blendScalar<BLEND>(o, n, params.blendWeightFixed);
+        }
+        trail[i] = (uint8_t)o;
+        if (MIX == MIX_MODE_NEW) {
+            display[i] = (uint8_t)n;
+        } else if (MIX == MIX_MODE_TRAIL) {
+            display[i] = (uint8_t)(channelMask[i & 3] ? o : n);
+        } else {
+            display[i] = channelMask[i & 3] ? (uint8_t)(((o * oldMix) + (n * mix)) >> 8) : (uint8_t)n;
+        }
+    }
+}
+
+template <FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+static void feedbackRow16Scalar(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                                const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params)
+{
+    const uint8_t *channelMask = reinterpret_cast<const uint8_t*>(&params.channelMask);
+    const uint32_t feedback = params.feedbackFixed;
+    const uint32_t mix = params.newestFrameMixFixed << 8;
+    const uint32_t oldMix = (256 - params.newestFrameMixFixed) << 8;
+    for (int32_t i = 0 ; i < count ; i++) {
+        const uint32_t n = src[i];
+        const uint32_t n16 = n << 8;
+        uint32_t t = n16;
+        if (TRAIL != TRAIL_MODE_REPLACE) {
+            t = trail[i];
+            if (TRAIL == TRAIL_MODE_DECAY) {
+                t = (t * feedback) >> 16;
+            }
+            t = n16 > t ? n16 : t;
+        }
+        trail[i] = (uint16_t)t;
+        if (MIX == MIX_MODE_NEW) {
+            display[i] = (uint8_t)n;
+            continue;
+        }
+        uint32_t d = t;
+        if (MIX == MIX_MODE_BLEND) {
+            d = ((t * oldMix) >> 16) + ((n16 * mix) >> 16);
+        }
+        d = (d + dither[(ditherPhase + i) % FEEDBACK_DITHER_PERIOD]) >> 8;
+        display[i] = channelMask[i & 3] ? (uint8_t)(d > 255 ? 255 : d) : (uint8_t)n;
+    }
+}
+
+template <FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+static void feedbackRowGainScalar(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                                  const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params)
+{
+    const uint8_t *channelMask = reinterpret_cast<const uint8_t*>(&params.channelMask);
+    const uint32_t gain = params.gainFixed;
+    const uint32_t inverseGain = params.inverseGainFixed;
+    const uint32_t mix = params.newestFrameMixFixed << 8;
+    const uint32_t oldMix = (256 - params.newestFrameMixFixed) << 8;
+    for (int32_t i = 0 ; i < count ; i++) {
+        const uint32_t n = src[i];
+        const uint32_t n16 = n << 8;
+        uint32_t t = n16;
+        if (TRAIL == TRAIL_MODE_REPLACE) {
+            trail[i] = (uint16_t)((n16 * inverseGain) >> 16);
+        } else {
+            t = (trail[i] * gain) >> 8;
+            if (n16 > t) {
+                t = n16;
+                trail[i] = (uint16_t)((n16 * inverseGain) >> 16);
+            }
+        }
+        if (MIX == MIX_MODE_NEW) {
+            display[i] = (uint8_t)n;
+            continue;
+        }
+        uint32_t d = t;
+        if (MIX == MIX_MODE_BLEND) {
+            d = ((t * oldMix) >> 16) + ((n16 * mix) >> 16);
+        }
+        d = (d + dither[(ditherPhase + i) % FEEDBACK_DITHER_PERIOD]) >> 8;
+        display[i] = channelMask[i & 3] ? (uint8_t)(d > 255 ? 255 : d) : (uint8_t)n;
+    }
+}
+
+template <FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+static void feedbackRowLinearScalar(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                                    const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params)
+{
+    const uint8_t *channelMask = reinterpret_cast<const uint8_t*>(&params.channelMask);
+    const uint16_t *toLinear = params.linearLight->toLinear;
+    const uint16_t *fromLinear = params.linearLight->fromLinear;
+    const uint32_t feedback = params.feedbackFixed;
+    const uint32_t mix = params.newestFrameMixFixed << 8;
+    const uint32_t oldMix = (256 - params.newestFrameMixFixed) << 8;
+    for (int32_t i = 0 ; i < count ; i++) {
+        const uint32_t n = src[i];
+        const uint32_t nLinear = toLinear[n];
+        uint32_t t = nLinear;
+        if (TRAIL != TRAIL_MODE_REPLACE) {
+            t = trail[i];
+            if (TRAIL == TRAIL_MODE_DECAY) {
+                t = (t * feedback) >> 16;
+            }
+            t = nLinear > t ? nLinear : t;
+        }
+        trail[i] = (uint16_t)t;
+        if (MIX == MIX_MODE_NEW) {
+            display[i] = (uint8_t)n;
+            continue;
+        }
+        uint32_t d = t;
+        if (MIX == MIX_MODE_BLEND) {
+            d = ((t * oldMix) >> 16) + ((nLinear * mix) >> 16);
+        }
+        d = (fromLinear[d >> LINEAR_LIGHT_SHIFT] + dither[(ditherPhase + i) % FEEDBACK_DITHER_PERIOD]) >> 8;
+        display[i] = channelMask[i & 3] ? (uint8_t)(d > 255 ? 255 : d) : (uint8_t)n;
+    }
+}
+
+static LinearLightTables* buildLinearLightTables()
+{
+    static LinearLightTables tables;
+    for (int v = 0 ; v < 256 ; v++) {
+        const double s = v / 255.0;
+        const double linear = s <= 0.04045 ? s / 12.92 : pow((s + 0.055) / 1.055, 2.4);
+        tables.toLinear[v] = (uint16_t)(linear * 65535.0 + 0.5);
+    }
+    const int size = 65536 >> LINEAR_LIGHT_SHIFT;
+    for (int i = 0 ; i < size ; i++) {
+        // the middle of the values sharing the entry
+        const double linear = (double)((i << LINEAR_LIGHT_SHIFT) + (1 << (LINEAR_LIGHT_SHIFT - 1))) / 65535.0;
+        const double s = linear <= 0.0031308 ? linear * 12.92 : 1.055 * pow(linear, 1.0 / 2.4) - 0.055;
+        const int32_t encoded = (int32_t)(s * 255.0 * 256.0 + 0.5);
+        tables.fromLinear[i] = (uint16_t)(encoded > 255 * 256 ? 255 * 256 : encoded);
+    }
+    // the entry an 8 bit value lands on gives exactly that value back, whatever the dither.
+    // Below 1/32 the codes are 20 or more linear steps apart, never in the same entry.
+    for (int v = 0 ; v < 256 ; v++) {
+        tables.fromLinear[tables.toLinear[v] >> LINEAR_LIGHT_SHIFT] = (uint16_t)(v << 8);
+    }
+    return &tables;
+}
+
+const LinearLightTables& getLinearLightTables()
+{
+    static const LinearLightTables *tables = buildLinearLightTables();
+    return *tables;
+}
+
+FeedbackTrailMode getFeedbackTrailMode(const FeedbackRowParams &params)
+{
+    if (!params.blurOn) {
+        return TRAIL_MODE_REPLACE;
+    }
+    return params.decay ? TRAIL_MODE_DECAY : TRAIL_MODE_LIGHTEN;
+}
+
+FeedbackMixMode getFeedbackMixMode(const FeedbackRowParams &params, bool fixedPoint)
+{
+    if (fixedPoint) {
+        if (params.newestFrameMixFixed == 0) {
+            return MIX_MODE_TRAIL;
+        }
+        return params.newestFrameMixFixed == 256 ? MIX_MODE_NEW : MIX_MODE_BLEND;
+    }
+    // o * 1 + n * 0 is exact in float, so these match the lerp bit for bit
+    if (params.newestFrameMix == 0.f) {
+        return MIX_MODE_TRAIL;
+    }
+    return params.newestFrameMix == 1.f ? MIX_MODE_NEW : MIX_MODE_BLEND;
+}
+
+FeedbackRowKernel getFeedbackRowKernel(KernelIsa isa, bool fixedPoint, FeedbackBlendMode blendMode,
+                                       FeedbackTrailMode trailMode, FeedbackMixMode mixMode)
+{
+    if (!isKernelIsaSupported(isa)) {
+        isa = detectKernelIsa();
+    }
+#if KERNELS_X86
+    switch (isa) {
+        case KERNEL_ISA_AVX2:   return getFeedbackRowKernelAvx2(fixedPoint, blendMode, trailMode, mixMode);
+        case KERNEL_ISA_SSE2:   return getFeedbackRowKernelSse2(fixedPoint, blendMode, trailMode, mixMode);
+        default:                break;
+    }
+#endif
+    static const FeedbackRowKernel kernels[NUM_BLEND_MODES][NUM_TRAIL_MODES][NUM_MIX_MODES] =
+        FEEDBACK_BLEND_KERNEL_TABLES(feedbackRowScalar);
+    static const FeedbackRowKernel fixedKernels[NUM_BLEND_MODES][NUM_TRAIL_MODES][NUM_MIX_MODES] =
+        FEEDBACK_BLEND_KERNEL_TABLES(feedbackRowFixedScalar);
+    return fixedPoint ? fixedKernels[blendMode][trailMode][mixMode] : kernels[blendMode][trailMode][mixMode];
+}
+
+FeedbackRow16Kernel getFeedbackRow16Kernel(KernelIsa isa, FeedbackTrailMode trailMode, FeedbackMixMode mixMode)
+{
+    if (!isKernelIsaSupported(isa)) {
+        isa = detectKernelIsa();
+    }
+#if KERNELS_X86
+    switch (isa) {
+        case KERNEL_ISA_AVX2:   return getFeedbackRow16KernelAvx2(trailMode, mixMode);
+        case KERNEL_ISA_SSE2:   return getFeedbackRow16KernelSse2(trailMode, mixMode);
+        default:                break;
+    }
+#endif
+    static const FeedbackRow16Kernel kernels[NUM_TRAIL_MODES][NUM_MIX_MODES] = FEEDBACK_KERNEL_TABLE(feedbackRow16Scalar);
+    return kernels[trailMode][mixMode];
+}
+
+FeedbackRow16Kernel getFeedbackRowGainKernel(KernelIsa isa, FeedbackTrailMode trailMode, FeedbackMixMode mixMode)
+{
+    if (!isKernelIsaSupported(isa)) {
+        isa = detectKernelIsa();
+    }
+#if KERNELS_X86
+    switch (isa) {
+        case KERNEL_ISA_AVX2:   return getFeedbackRowGainKernelAvx2(trailMode, mixMode);
+        case KERNEL_ISA_SSE2:   return getFeedbackRowGainKernelSse2(trailMode, mixMode);
+        default:                break;
+    }
+#endif
+    static const FeedbackRow16Kernel kernels[NUM_TRAIL_MODES][NUM_MIX_MODES] = FEEDBACK_KERNEL_TABLE(feedbackRowGainScalar);
+    return kernels[trailMode][mixMode];
+}
+
+FeedbackRow16Kernel getFeedbackRowLinearKernel(KernelIsa isa, FeedbackTrailMode trailMode, FeedbackMixMode mixMode)
+{
+    if (!isKernelIsaSupported(isa)) {
+        isa = detectKernelIsa();
+    }
+#if KERNELS_X86
+    // the AVX2 gathers came out slower than the scalar lookups
+    if (isa != KERNEL_ISA_SCALAR) {
+        return getFeedbackRowLinearKernelSse2(trailMode, mixMode);
+    }
+#endif
+    static const FeedbackRow16Kernel kernels[NUM_TRAIL_MODES][NUM_MIX_MODES] = FEEDBACK_KERNEL_TABLE(feedbackRowLinearScalar);
+    return kernels[trailMode][mixMode];
+}
+
+void feedbackRow16Scalar(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                         const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params)
+{
+    // only ever a vector kernel's last few bytes, the table lookup is fine here
+    FeedbackRow16Kernel kernel = getFeedbackRow16Kernel(KERNEL_ISA_SCALAR, getFeedbackTrailMode(params),
+                                                        getFeedbackMixMode(params, true));
+    kernel(trail, src, display, count, dither, ditherPhase, params);
+}
+
+void feedbackRowGainScalar(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                           const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params)
+{
+    FeedbackRow16Kernel kernel = getFeedbackRowGainKernel(KERNEL_ISA_SCALAR, getFeedbackTrailMode(params),
+                                                          getFeedbackMixMode(params, true));
+    kernel(trail, src, display, count, dither, ditherPhase, params);
+}
+
+void feedbackRowLinearScalar(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                             const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params)
+{
+    FeedbackRow16Kernel kernel = getFeedbackRowLinearKernel(KERNEL_ISA_SCALAR, getFeedbackTrailMode(params),
+                                                            getFeedbackMixMode(params, true));
+    kernel(trail, src, display, count, dither, ditherPhase, params);
+}
+
+void maxBytes(uint8_t *dst, const uint8_t *src, int32_t count)
+{
+    int32_t i = 0;
+#if defined(__SSE2__)
+    for ( ; i + 16 <= count ; i += 16) {
+        __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+        __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        _mm_storeu_si128((__m128i*)(dst + i), _mm_max_epu8(d, s));
+    }
+#endif
+    for ( ; i < count ; i++) {
+        dst[i] = src[i] > dst[i] ? src[i] : dst[i];
+    }
+}
+
+#if defined(__SSE2__)
+// 4 byte pixels, 4 output pixels per step
+static int32_t downsampleRow2Sse2(uint8_t *dst, const uint8_t *src, int32_t srcRowBytes, int32_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(2);
+    int32_t x = 0;
+    for ( ; x + 4 <= count ; x += 4) {
+        __m128i sums[2];
+        for (int half = 0 ; half < 2 ; half++) {
+            const uint8_t *s = src + (x * 2 + half * 4) * 4;
+            __m128i row0 = _mm_loadu_si128((const __m128i*)s);
+            __m128i row1 = _mm_loadu_si128((const __m128i*)(s + srcRowBytes));
+            // pixels 0 1 and 2 3 of both rows, then the pixels of each pair added up
+            __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(row0, zero), _mm_unpacklo_epi8(row1, zero));
+            __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(row0, zero), _mm_unpackhi_epi8(row1, zero));
+            __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+            sums[half] = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+        }
+        _mm_storeu_si128((__m128i*)(dst + x * 4), _mm_packus_epi16(sums[0], sums[1]));
+    }
+    return x;
+}
+
+static int32_t downsampleRow4Sse2(uint8_t *dst, const uint8_t *src, int32_t srcRowBytes, int32_t count)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(8);
+    int32_t x = 0;
+    for ( ; x + 4 <= count ; x += 4) {
+        __m128i sums[4];
+        for (int p = 0 ; p < 4 ; p++) {
+            // one output pixel from 4 pixels of 4 rows
+            const uint8_t *s = src + (x + p) * 16;
+            __m128i lo = zero, hi = zero;
+            for (int r = 0 ; r < 4 ; r++) {
+                __m128i row = _mm_loadu_si128((const __m128i*)(s + r * srcRowBytes));
+                lo = _mm_add_epi16(lo, _mm_unpacklo_epi8(row, zero));
+                hi = _mm_add_epi16(hi, _mm_unpackhi_epi8(row, zero));
+            }
+            __m128i sum = _mm_add_epi16(lo, hi);
+            sums[p] = _mm_add_epi16(sum, _mm_srli_si128(sum, 8));
+        }
+        __m128i sum01 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(sums[0], sums[1]), round), 4);
+        __m128i sum23 = _mm_srli_epi16(_mm_add_epi16(_mm_unpacklo_epi64(sums[2], sums[3]), round), 4);
+        _mm_storeu_si128((__m128i*)(dst + x * 4), _mm_packus_epi16(sum01, sum23));
+    }
+    return x;
+}
+#endif
+
+void downsampleRow(uint8_t *dst, const uint8_t *src, int32_t srcRowBytes, int32_t count, int32_t pixelInc, int32_t factor)
+{
+    int32_t x = 0;
+#if defined(__SSE2__)
+    if (pixelInc == 4 && factor == 2) {
+        x = downsampleRow2Sse2(dst, src, srcRowBytes, count);
+    } else if (pixelInc == 4 && factor == 4) {
+        x = downsampleRow4Sse2(dst, src, srcRowBytes, count);
+    }
+#endif
+    const int32_t area = factor * factor;
+    for ( ; x < count ; x++) {
+        for (int32_t c = 0 ; c < pixelInc ; c++) {
+            const uint8_t *s = src + x * factor * pixelInc + c;
+            int32_t sum = 0;
+            for (int32_t r = 0 ; r < factor ; r++) {
+                for (int32_t i = 0 ; i < factor ; i++) {
+                    sum += s[r * srcRowBytes + i * pixelInc];
+                }
+            }
+            dst[x * pixelInc + c] = (uint8_t)((sum + area / 2) / area);
+        }
+    }
+}
+
+void echoRow(uint8_t *display, const uint8_t *const *taps, const uint16_t *weights, int numTaps,
+             int32_t count, uint32_t channelMask)
+{
+    int32_t displayWeight = 256;
+    for (int t = 0 ; t < numTaps ; t++) {
+        displayWeight -= weights[t];
+    }
+    int32_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(128);
+    const __m128i mask = _mm_set1_epi32((int32_t)channelMask);
+    const __m128i displayWeights = _mm_set1_epi16((int16_t)displayWeight);
+    __m128i tapWeights[MAX_ECHO_TAPS];
+    for (int t = 0 ; t < numTaps ; t++) {
+        tapWeights[t] = _mm_set1_epi16((int16_t)weights[t]);
+    }
+    for ( ; i + 16 <= count ; i += 16) {
+        // at most 255 * 256 per lane, fits unsigned 16 bits
+        __m128i d = _mm_loadu_si128((const __m128i*)(display + i));
+        __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), displayWeights);
+        __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), displayWeights);
+        for (int t = 0 ; t < numTaps ; t++) {
+            __m128i tap = _mm_loadu_si128((const __m128i*)(taps[t] + i));
+            lo = _mm_add_epi16(lo, _mm_mullo_epi16(_mm_unpacklo_epi8(tap, zero), tapWeights[t]));
+            hi = _mm_add_epi16(hi, _mm_mullo_epi16(_mm_unpackhi_epi8(tap, zero), tapWeights[t]));
+        }
+        lo = _mm_srli_epi16(_mm_add_epi16(lo, round), 8);
+        hi = _mm_srli_epi16(_mm_add_epi16(hi, round), 8);
+        __m128i echo = _mm_packus_epi16(lo, hi);
+        _mm_storeu_si128((__m128i*)(display + i), _mm_or_si128(_mm_and_si128(mask, echo), _mm_andnot_si128(mask, d)));
+    }
+#endif
+    const uint8_t *maskBytes = reinterpret_cast<const uint8_t*>(&channelMask);
+    for ( ; i < count ; i++) {
+        if (!maskBytes[i & 3]) {
+            continue;
+        }
+        uint32_t sum = display[i] * displayWeight;
+        for (int t = 0 ; t < numTaps ; t++) {
+            sum += taps[t][i] * weights[t];
+        }
+        display[i] = (uint8_t)((sum + 128) >> 8);
+    }
+}
+
+#if defined(__SSE2__)
+// (a * b + 32768) >> 16 per unsigned 16 bit lane, bit 15 of the low half rounds
+static inline __m128i mulhiRound(__m128i a, __m128i b)
+{
+    return _mm_add_epi16(_mm_mulhi_epu16(a, b), _mm_srli_epi16(_mm_mullo_epi16(a, b), 15));
+}
+#endif
+
+void subtractBackgroundRow(uint8_t *row, uint16_t *background, int32_t count, int32_t pixelInc,
+                           uint8_t threshold, uint16_t learnFixed, uint32_t channelMask)
+{
+    int32_t i = 0;
+#if defined(__SSE2__)
+    if (pixelInc == 4) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i round = _mm_set1_epi16(128);
+        const __m128i mask = _mm_set1_epi32((int32_t)channelMask);
+        const __m128i otherBytes = _mm_andnot_si128(mask, _mm_set1_epi8(-1));
+        const __m128i lowByte = _mm_set1_epi32(0xff);
+        const __m128i thresholds = _mm_set1_epi32(threshold);
+        const __m128i learn = _mm_set1_epi16((int16_t)learnFixed);
+        for ( ; i + 16 <= count ; i += 16) {
+            const __m128i n = _mm_loadu_si128((const __m128i*)(row + i));
+            __m128i lo = _mm_loadu_si128((const __m128i*)(background + i));
+            __m128i hi = _mm_loadu_si128((const __m128i*)(background + i + 8));
+            // the biggest colour difference of each pixel into its low byte, then a whole pixel mask
+            const __m128i b = _mm_packus_epi16(_mm_srli_epi16(_mm_adds_epu16(lo, round), 8),
+                                               _mm_srli_epi16(_mm_adds_epu16(hi, round), 8));
+            __m128i diff = _mm_and_si128(_mm_or_si128(_mm_subs_epu8(n, b), _mm_subs_epu8(b, n)), mask);
+            diff = _mm_max_epu8(diff, _mm_srli_epi32(diff, 8));
+            diff = _mm_max_epu8(diff, _mm_srli_epi32(diff, 16));
+            const __m128i foreground = _mm_cmpgt_epi32(_mm_and_si128(diff, lowByte), thresholds);
+            _mm_storeu_si128((__m128i*)(row + i), _mm_and_si128(n, _mm_or_si128(foreground, otherBytes)));
+            // background += round(up * learn) - round(down * learn), one of them is 0
+            const __m128i targetLo = _mm_unpacklo_epi8(zero, n);
+            const __m128i targetHi = _mm_unpackhi_epi8(zero, n);
+            lo = _mm_sub_epi16(_mm_add_epi16(lo, mulhiRound(_mm_subs_epu16(targetLo, lo), learn)),
+                               mulhiRound(_mm_subs_epu16(lo, targetLo), learn));
+            hi = _mm_sub_epi16(_mm_add_epi16(hi, mulhiRound(_mm_subs_epu16(targetHi, hi), learn)),
+                               mulhiRound(_mm_subs_epu16(hi, targetHi), learn));
+            _mm_storeu_si128((__m128i*)(background + i), lo);
+            _mm_storeu_si128((__m128i*)(background + i + 8), hi);
+        }
+    }
+#endif
+    const uint8_t *maskBytes = reinterpret_cast<const uint8_t*>(&channelMask);
+    for ( ; i + pixelInc <= count ; i += pixelInc) {
+        int32_t maxDiff = 0;
+        for (int32_t c = 0 ; c < pixelInc ; c++) {
+            if (maskBytes[(i + c) & 3]) {
+                const int32_t b = (background[i + c] < 65535 - 128 ? background[i + c] + 128 : 65535) >> 8;
+                const int32_t diff = row[i + c] > b ? row[i + c] - b : b - row[i + c];
+                maxDiff = diff > maxDiff ? diff : maxDiff;
+            }
+        }
+        for (int32_t c = 0 ; c < pixelInc ; c++) {
+            const uint32_t target = row[i + c] << 8;
+            const uint32_t b = background[i + c];
+            const uint32_t up = target > b ? target - b : 0;
+            const uint32_t down = b > target ? b - target : 0;
+            background[i + c] = (uint16_t)(b + ((up * learnFixed + 32768) >> 16) - ((down * learnFixed + 32768) >> 16));
+            if (maskBytes[(i + c) & 3] && maxDiff <= threshold) {
+                row[i + c] = 0;
+            }
+        }
+    }
+}
+
+void lumaKeyRow(uint8_t *row, uint8_t *keyState, int32_t count, int32_t pixelInc, const LumaKeyRowParams &params)
+{
+    // weight = min((luma - edge) clamped to 0-knee * slope >> 7, 256), slope is 32768 / knee
+    // rounded up so the top of the knee is a whole 256, edge moves down by the hysteresis
+    // for pixels that were keyed in
+    const int32_t knee = params.kneeWidth > 0 ? params.kneeWidth : 1;
+    const int32_t edge = params.threshold - (knee + 1) / 2;
+    const int32_t slope = (32768 + knee - 1) / knee;
+    int32_t i = 0;
+#if defined(__SSE2__)
+    if (pixelInc == 4) {
+        // a pixel at a time per 32 bit lane for the luma, then per 16 bit pair of lanes
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i lumaWeights = _mm_setr_epi16(params.lumaWeights[0], params.lumaWeights[1], params.lumaWeights[2], params.lumaWeights[3],
+                                                   params.lumaWeights[0], params.lumaWeights[1], params.lumaWeights[2], params.lumaWeights[3]);
+        const __m128i round = _mm_set1_epi32(128);
+        const __m128i edges = _mm_set1_epi16((int16_t)edge);
+        const __m128i hysteresis = _mm_set1_epi16(params.hysteresis);
+        const __m128i keyedIn = _mm_set1_epi16((int16_t)((knee + 1) / 2 - 1));
+        const __m128i knees = _mm_set1_epi16((int16_t)knee);
+        const __m128i slopes = _mm_set1_epi16((int16_t)slope);
+        const __m128i fullWeight = _mm_set1_epi16(256);
+        const uint8_t colourBytes[4] = { (uint8_t)(params.lumaWeights[0] ? 0xff : 0), (uint8_t)(params.lumaWeights[1] ? 0xff : 0),
+                                         (uint8_t)(params.lumaWeights[2] ? 0xff : 0), (uint8_t)(params.lumaWeights[3] ? 0xff : 0) };
+        int32_t colourMask;
+        memcpy(&colourMask, colourBytes, 4);
+        const __m128i mask = _mm_set1_epi32(colourMask);
+        for ( ; i + 16 <= count ; i += 16) {
+            const __m128i n = _mm_loadu_si128((const __m128i*)(row + i));
+            const __m128i lo = _mm_unpacklo_epi8(n, zero);
+            const __m128i hi = _mm_unpackhi_epi8(n, zero);
+            __m128i lumaLo = _mm_madd_epi16(lo, lumaWeights);
+            __m128i lumaHi = _mm_madd_epi16(hi, lumaWeights);
+            lumaLo = _mm_add_epi32(lumaLo, _mm_shuffle_epi32(lumaLo, _MM_SHUFFLE(2, 3, 0, 1)));
+            lumaHi = _mm_add_epi32(lumaHi, _mm_shuffle_epi32(lumaHi, _MM_SHUFFLE(2, 3, 0, 1)));
+            lumaLo = _mm_srli_epi32(_mm_add_epi32(lumaLo, round), 8);
+            lumaHi = _mm_srli_epi32(_mm_add_epi32(lumaHi, round), 8);
+            // pixels 0 0 1 1 2 2 3 3
+            const __m128i luma = _mm_packs_epi32(lumaLo, lumaHi);
+            int32_t stateBytes;
+            memcpy(&stateBytes, keyState + i / 4, 4);
+            __m128i wasIn = _mm_cvtsi32_si128(stateBytes);
+            wasIn = _mm_unpacklo_epi8(wasIn, wasIn);
+            wasIn = _mm_unpacklo_epi8(wasIn, wasIn);
+            const __m128i d = _mm_sub_epi16(luma, _mm_sub_epi16(edges, _mm_and_si128(wasIn, hysteresis)));
+            const __m128i isIn = _mm_cmpgt_epi16(d, keyedIn);
+            stateBytes = _mm_cvtsi128_si32(_mm_packs_epi16(_mm_packs_epi32(isIn, isIn), zero));
+            memcpy(keyState + i / 4, &stateBytes, 4);
+            // at most 32768 + knee - 1, fits unsigned 16 bits
+            __m128i weight = _mm_min_epi16(_mm_max_epi16(d, zero), knees);
+            weight = _mm_min_epi16(_mm_srli_epi16(_mm_mullo_epi16(weight, slopes), 7), fullWeight);
+            const __m128i keyedLo = _mm_srli_epi16(_mm_mullo_epi16(lo, _mm_unpacklo_epi16(weight, weight)), 8);
+            const __m128i keyedHi = _mm_srli_epi16(_mm_mullo_epi16(hi, _mm_unpackhi_epi16(weight, weight)), 8);
+            const __m128i keyed = _mm_packus_epi16(keyedLo, keyedHi);
+            _mm_storeu_si128((__m128i*)(row + i), _mm_or_si128(_mm_and_si128(mask, keyed), _mm_andnot_si128(mask, n)));
+        }
+    }
+#endif
+    for ( ; i + pixelInc <= count ; i += pixelInc) {
+        uint32_t luma = 128;
+        for (int32_t c = 0 ; c < pixelInc ; c++) {
+            luma += row[i + c] * params.lumaWeights[c];
+        }
+        uint8_t &state = keyState[i / pixelInc];
+        const int32_t d = (int32_t)(luma >> 8) - (state ? edge - params.hysteresis : edge);
+        state = d > (knee + 1) / 2 - 1 ? 0xff : 0;
+        int32_t weight = ((d < 0 ? 0 : (d > knee ? knee : d)) * slope) >> 7;
+        weight = weight > 256 ? 256 : weight;
+        for (int32_t c = 0 ; c < pixelInc ; c++) {
+            if (params.lumaWeights[c]) {
+                row[i + c] = (uint8_t)((row[i + c] * weight) >> 8);
+            }
+        }
+    }
+}
+
+// dst = (sum of src bytes * weights + 128) >> 8 per pixel, weights per byte of a pixel
+void lumaRow(uint8_t *dst, const uint8_t *src, int32_t count, int32_t pixelInc, const uint16_t *weights)
+{
+    int32_t x = 0;
+#if defined(__SSE2__)
+    if (pixelInc == 4) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i round = _mm_set1_epi32(128);
+        const __m128i lumaWeights = _mm_setr_epi16(weights[0], weights[1], weights[2], weights[3],
+                                                   weights[0], weights[1], weights[2], weights[3]);
+        for ( ; x + 8 <= count ; x += 8) {
+            __m128i luma[2];
+            for (int half = 0 ; half < 2 ; half++) {
+                const __m128i n = _mm_loadu_si128((const __m128i*)(src + (x + half * 4) * 4));
+                // the two sums of each pixel, then pixels 0 1 2 3 in the 32 bit lanes
+                __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(n, zero), lumaWeights);
+                __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(n, zero), lumaWeights);
+                lo = _mm_shuffle_epi32(_mm_add_epi32(lo, _mm_srli_epi64(lo, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+                hi = _mm_shuffle_epi32(_mm_add_epi32(hi, _mm_srli_epi64(hi, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+                luma[half] = _mm_srli_epi32(_mm_add_epi32(_mm_unpacklo_epi64(lo, hi), round), 8);
+            }
+            const __m128i words = _mm_packs_epi32(luma[0], luma[1]);
+            _mm_storel_epi64((__m128i*)(dst + x), _mm_packus_epi16(words, words));
+        }
+    }
+#endif
+    for ( ; x < count ; x++) {
+        uint32_t luma = 128;
+        for (int32_t c = 0 ; c < pixelInc ; c++) {
+            luma += src[x * pixelInc + c] * weights[c];
+        }
+        dst[x] = (uint8_t)(luma >> 8);
+    }
+}
+
+void halveRow(uint8_t *dst, const uint8_t *src, int32_t stride, int32_t count)
+{
+    int32_t x = 0;
+#if defined(__SSE2__)
+    const __m128i lowBytes = _mm_set1_epi16(0xff);
+    const __m128i two = _mm_set1_epi16(2);
+    for ( ; x + 16 <= count ; x += 16) {
+        // the four samples of 8 blocks summed in 16 bit lanes, rounded once
+        __m128i halves[2];
+        for (int half = 0 ; half < 2 ; half++) {
+            const __m128i top = _mm_loadu_si128((const __m128i*)(src + 2 * x + half * 16));
+            const __m128i bottom = _mm_loadu_si128((const __m128i*)(src + 2 * x + half * 16 + stride));
+            const __m128i sum = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(top, lowBytes), _mm_srli_epi16(top, 8)),
+                                              _mm_add_epi16(_mm_and_si128(bottom, lowBytes), _mm_srli_epi16(bottom, 8)));
+            halves[half] = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+        }
+        _mm_storeu_si128((__m128i*)(dst + x), _mm_packus_epi16(halves[0], halves[1]));
+    }
+#endif
+    for ( ; x < count ; x++) {
+        dst[x] = (uint8_t)((src[2 * x] + src[2 * x + 1] + src[2 * x + stride] + src[2 * x + 1 + stride] + 2) >> 2);
+    }
+}
+
+void gradientMapRow(uint8_t *row, int32_t count, int32_t pixelInc, const uint32_t *table, const uint16_t *weights,
+                    uint32_t channelMask)
+{
+    int32_t x = 0;
+#if defined(__SSE2__)
+    if (pixelInc == 4) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i round = _mm_set1_epi32(128);
+        const __m128i lowByte = _mm_set1_epi32(0xff);
+        const __m128i mask = _mm_set1_epi32((int32_t)channelMask);
+        const uint16_t noWeights[4] = { 0, 0, 0, 0 };
+        const uint16_t *w = weights != NULL ? weights : noWeights;
+        const __m128i lumaWeights = _mm_setr_epi16(w[0], w[1], w[2], w[3], w[0], w[1], w[2], w[3]);
+        uint32_t levels[4];
+        for ( ; x + 4 <= count ; x += 4) {
+            const __m128i n = _mm_loadu_si128((const __m128i*)(row + x * 4));
+            __m128i level;
+            if (weights != NULL) {
+                // pixels 0 1 2 3 in the 32 bit lanes, like lumaRow
+                __m128i lo = _mm_madd_epi16(_mm_unpacklo_epi8(n, zero), lumaWeights);
+                __m128i hi = _mm_madd_epi16(_mm_unpackhi_epi8(n, zero), lumaWeights);
+                lo = _mm_shuffle_epi32(_mm_add_epi32(lo, _mm_srli_epi64(lo, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+                hi = _mm_shuffle_epi32(_mm_add_epi32(hi, _mm_srli_epi64(hi, 32)), _MM_SHUFFLE(3, 1, 2, 0));
+                level = _mm_srli_epi32(_mm_add_epi32(_mm_unpacklo_epi64(lo, hi), round), 8);
+            } else {
+                // the brightest colour byte ends up in the low byte of each pixel
+                level = _mm_and_si128(n, mask);
+                level = _mm_max_epu8(level, _mm_srli_epi32(level, 8));
+                level = _mm_and_si128(_mm_max_epu8(level, _mm_srli_epi32(level, 16)), lowByte);
+            }
+            _mm_storeu_si128((__m128i*)levels, level);
+            const __m128i mapped = _mm_setr_epi32((int32_t)table[levels[0]], (int32_t)table[levels[1]],
+                                                  (int32_t)table[levels[2]], (int32_t)table[levels[3]]);
+            _mm_storeu_si128((__m128i*)(row + x * 4),
+                             _mm_or_si128(_mm_and_si128(mask, mapped), _mm_andnot_si128(mask, n)));
+        }
+    }
+#endif
+    const uint8_t *mask = reinterpret_cast<const uint8_t*>(&channelMask);
+    for ( ; x < count ; x++) {
+        uint8_t *pixel = row + x * pixelInc;
+        uint32_t level = weights != NULL ? 128 : 0;
+        for (int32_t c = 0 ; c < pixelInc ; c++) {
+            if (weights != NULL) {
+                level += pixel[c] * weights[c];
+            } else if (mask[c] && pixel[c] > level) {
+                level = pixel[c];
+            }
+        }
+        const uint8_t *mapped = reinterpret_cast<const uint8_t*>(&table[weights != NULL ? level >> 8 : level]);
+        for (int32_t c = 0 ; c < pixelInc ; c++) {
+            if (mask[c]) {
+                pixel[c] = mapped[c];
+            }
+        }
+    }
+}
+
+void sobelRow(uint8_t *row, const uint8_t *above, const uint8_t *luma, const uint8_t *below, int32_t count,
+              int32_t pixelInc, uint16_t gainFixed, uint32_t channelMask)
+{
+    int32_t x = 0;
+#if defined(__SSE2__)
+    if (pixelInc == 4) {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i gain = _mm_set1_epi16((int16_t)gainFixed);
+        const __m128i mask = _mm_set1_epi32((int32_t)channelMask);
+        for ( ; x + 8 <= count ; x += 8) {
+            // 8 pixels of each of the 3 x 3 taps, 16 bits per lane
+            __m128i taps[3][3];
+            const uint8_t *rows[3] = { above + x, luma + x, below + x };
+            for (int r = 0 ; r < 3 ; r++) {
+                for (int c = 0 ; c < 3 ; c++) {
+                    taps[r][c] = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(rows[r] + c)), zero);
+                }
+            }
+            const __m128i left = _mm_add_epi16(_mm_add_epi16(taps[0][0], taps[2][0]), _mm_slli_epi16(taps[1][0], 1));
+            const __m128i right = _mm_add_epi16(_mm_add_epi16(taps[0][2], taps[2][2]), _mm_slli_epi16(taps[1][2], 1));
+            const __m128i top = _mm_add_epi16(_mm_add_epi16(taps[0][0], taps[0][2]), _mm_slli_epi16(taps[0][1], 1));
+            const __m128i bottom = _mm_add_epi16(_mm_add_epi16(taps[2][0], taps[2][2]), _mm_slli_epi16(taps[2][1], 1));
+            const __m128i gx = _mm_sub_epi16(right, left);
+            const __m128i gy = _mm_sub_epi16(bottom, top);
+            // at most 2040 * 32, fits unsigned 16 bits
+            const __m128i magnitude = _mm_add_epi16(_mm_max_epi16(gx, _mm_sub_epi16(zero, gx)), _mm_max_epi16(gy, _mm_sub_epi16(zero, gy)));
+            const __m128i words = _mm_srli_epi16(_mm_mullo_epi16(magnitude, gain), 5);
+            // each edge byte out to the 4 bytes of its pixel
+            __m128i edges = _mm_packus_epi16(words, words);
+            edges = _mm_unpacklo_epi8(edges, edges);
+            uint8_t *dst = row + x * 4;
+            const __m128i lo = _mm_loadu_si128((const __m128i*)dst);
+            const __m128i hi = _mm_loadu_si128((const __m128i*)(dst + 16));
+            _mm_storeu_si128((__m128i*)dst, _mm_or_si128(_mm_and_si128(mask, _mm_unpacklo_epi16(edges, edges)), _mm_andnot_si128(mask, lo)));
+            _mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(_mm_and_si128(mask, _mm_unpackhi_epi16(edges, edges)), _mm_andnot_si128(mask, hi)));
+        }
+    }
+#endif
+    const uint8_t *maskBytes = reinterpret_cast<const uint8_t*>(&channelMask);
+    for ( ; x < count ; x++) {
+        const int32_t gx = (above[x + 2] + 2 * luma[x + 2] + below[x + 2]) - (above[x] + 2 * luma[x] + below[x]);
+        const int32_t gy = (below[x] + 2 * below[x + 1] + below[x + 2]) - (above[x] + 2 * above[x + 1] + above[x + 2]);
+        const uint32_t edge = (((gx < 0 ? -gx : gx) + (gy < 0 ? -gy : gy)) * gainFixed) >> 5;
+        for (int32_t c = 0 ; c < pixelInc ; c++) {
+            if (maskBytes[(x * pixelInc + c) & 3]) {
+                row[x * pixelInc + c] = (uint8_t)(edge > 255 ? 255 : edge);
+            }
+        }
+    }
+}
+
+void trailLayersRow(uint8_t *const *layers, const TrailLayerRowParams *params, int numLayers, const uint8_t *src,
+                    uint8_t *display, int32_t count, int32_t tintPhase, bool decay)
+{
+    int32_t i = 0;
+#if defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i feedbacks[MAX_TRAIL_LAYERS];
+    __m128i gates[MAX_TRAIL_LAYERS];
+    for (int l = 0 ; l < numLayers ; l++) {
+        feedbacks[l] = _mm_set1_epi16((int16_t)params[l].feedbackFixed);
+        gates[l] = _mm_set1_epi8((char)params[l].gate);
+    }
+    // the period is whole vectors, the index stays below it + 16
+    int32_t tintIndex = tintPhase % FEEDBACK_DITHER_PERIOD;
+    for ( ; i + 16 <= count ; i += 16) {
+        const __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i d = display != NULL ? _mm_loadu_si128((const __m128i*)(display + i)) : zero;
+        for (int l = 0 ; l < numLayers ; l++) {
+            __m128i layer = _mm_loadu_si128((const __m128i*)(layers[l] + i));
+            if (decay) {
+                __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(layer, zero), feedbacks[l]);
+                __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(layer, zero), feedbacks[l]);
+                layer = _mm_packus_epi16(lo, hi);
+            }
+            // src >= gate where max(src, gate) is src
+            const __m128i lit = _mm_cmpeq_epi8(_mm_max_epu8(s, gates[l]), s);
+            layer = _mm_max_epu8(layer, _mm_and_si128(s, lit));
+            _mm_storeu_si128((__m128i*)(layers[l] + i), layer);
+            if (display != NULL) {
+                // (layer << 8) * tint >> 16 in one multiply
+                const uint16_t *tint = params[l].tint + tintIndex;
+                __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(zero, layer), _mm_loadu_si128((const __m128i*)tint));
+                __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(zero, layer), _mm_loadu_si128((const __m128i*)(tint + 8)));
+                d = _mm_max_epu8(d, _mm_packus_epi16(lo, hi));
+            }
+        }
+        if (display != NULL) {
+            _mm_storeu_si128((__m128i*)(display + i), d);
+        }
+        tintIndex = tintIndex + 16 < FEEDBACK_DITHER_PERIOD ? tintIndex + 16 : tintIndex + 16 - FEEDBACK_DITHER_PERIOD;
+    }
+#endif
+    for ( ; i < count ; i++) {
+        const uint8_t s = src[i];
+        const int32_t tintIndex = (tintPhase + i) % FEEDBACK_DITHER_PERIOD;
+        uint8_t d = display != NULL ? display[i] : 0;
+        for (int l = 0 ; l < numLayers ; l++) {
+            uint8_t layer = layers[l][i];
+            if (decay) {
+                layer = (uint8_t)((layer * params[l].feedbackFixed) >> 16);
+            }
+            if (s >= params[l].gate && s > layer) {
+                layer = s;
+            }
+            layers[l][i] = layer;
+            const uint8_t tinted = (uint8_t)((layer * params[l].tint[tintIndex]) >> 8);
+            d = tinted > d ? tinted : d;
+        }
+        if (display != NULL) {
+            display[i] = d;
+        }
+    }
+}
+
+TrailLayersKernel getTrailLayersKernel(KernelIsa isa)
+{
+#if KERNELS_X86
+    if (isa == KERNEL_ISA_AVX2 && isKernelIsaSupported(isa)) {
+        return trailLayersRowAvx2;
+    }
+#endif
+    return trailLayersRow;
+}
+
+void fillDitherRow(uint16_t *dither, int32_t y, uint8_t pixelInc)
+{
+    static const uint8_t bayer[4][4] = {
+        {  0,  8,  2, 10 },
+        { 12,  4, 14,  6 },
+        {  3, 11,  1,  9 },
+        { 15,  7, 13,  5 }
+    };
+    for (int i = 0 ; i < 2 * FEEDBACK_DITHER_PERIOD ; i++) {
+        const int x = (i % FEEDBACK_DITHER_PERIOD) / pixelInc;
+        dither[i] = (uint16_t)(bayer[y & 3][x & 3] * 16 + 8);
+    }
+}
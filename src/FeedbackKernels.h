@@ -0,0 +1,234 @@
+//
+//  FeedbackKernels.h
+//  Illuminate
+//
+//  Per row decay / lighten / mix kernels with scalar, SSE2 and AVX2 versions,
+//  the best one for the CPU is picked once at startup. Every version is a set of
+//  template instantiations, one per trail / mix mode, so the inner loops have no
+//  per pixel flag tests. The instantiation is picked once per frame.
+//
+
+#ifndef FeedbackKernels_h
+#define FeedbackKernels_h
+
+#include <cstdint>
+
+enum KernelIsa {
+    KERNEL_ISA_SCALAR,
+    KERNEL_ISA_SSE2,
+    KERNEL_ISA_AVX2,
+    NUM_KERNEL_ISAS
+};
+
+// best instruction set the CPU and OS support, checked with cpuid on first call
+KernelIsa detectKernelIsa();
+bool isKernelIsaSupported(KernelIsa isa);
+const char* getKernelIsaName(KernelIsa isa);
+
+// Rows are worked on as flat runs of channel bytes. channelMask holds 0xff for every
+// colour byte of a 4 byte group (in memory order), bytes with a 0 mask (alpha,
+// padding) are copied from src to display untouched.
+// The float kernels use feedback / newestFrameMix, the fixed point kernels the
+// integer versions, both are filled in once per frame by FeedbackProcessor.
+// How src goes into the decayed trail o, per channel byte. The 8 bit trail kernels
+// have all of them, the 16 bit and global gain trails only lighten.
+enum FeedbackBlendMode {
+    BLEND_MODE_LIGHTEN,     // max(o, n)
+    BLEND_MODE_SCREEN,      // o + n - o * n / 255, rounded
+    BLEND_MODE_ADD,         // min(o + n, 255)
+    BLEND_MODE_DIFFERENCE,  // |o - n|
+    BLEND_MODE_AVERAGE,     // (o * (256 - blendWeightFixed) + n * blendWeightFixed) >> 8
+    NUM_BLEND_MODES
+};
+
+struct LinearLightTables;
+
+struct FeedbackRowParams {
+    float       feedback;       // per frame multiplier, cube root already applied
+    float       newestFrameMix;
+    uint16_t    feedbackFixed;  // feedback as 0.16 fixed point
+    uint16_t    newestFrameMixFixed; // newestFrameMix scaled to 0-256
+    uint32_t    gainFixed;      // global gain trail: gain as 1.16 fixed point, 65536 is 1
+    uint16_t    inverseGainFixed; // 256 / gain
+    const LinearLightTables *linearLight; // linear light trail only
+    bool        blurOn;
+    bool        decay;          // false on skipped frames (100% feedback) or feedback of 1
+    uint32_t    channelMask;
+    FeedbackBlendMode blendMode;
+    uint16_t    blendWeightFixed; // BLEND_MODE_AVERAGE share of src, 0-256
+};
+
+// trail = blend(decay(trail), src), display = mix(trail, src), count is in bytes
+typedef void (*FeedbackRowKernel)(uint8_t *trail, const uint8_t *src, uint8_t *display,
+                                  int32_t count, const FeedbackRowParams &params);
+
+enum FeedbackTrailMode {
+    TRAIL_MODE_REPLACE,     // blur off, trail = src
+    TRAIL_MODE_LIGHTEN,     // skipped frame, trail = blend(trail, src)
+    TRAIL_MODE_DECAY,       // trail = blend(decay(trail), src)
+    NUM_TRAIL_MODES
+};
+
+// mix of exactly 0 or 1 gives the same bytes as the full lerp, without the math
+enum FeedbackMixMode {
+    MIX_MODE_TRAIL,         // display = trail
+    MIX_MODE_NEW,           // display = src
+    MIX_MODE_BLEND,         // display = lerp(trail, src, mix)
+    NUM_MIX_MODES
+};
+
+FeedbackTrailMode getFeedbackTrailMode(const FeedbackRowParams &params);
+FeedbackMixMode getFeedbackMixMode(const FeedbackRowParams &params, bool fixedPoint);
+
+// fixedPoint picks the integer only kernels: trail = blend((o * feedbackFixed) >> 16, n),
+// display = (o * (256 - mix) + n * mix) >> 8, all in 16 bit lanes
+FeedbackRowKernel getFeedbackRowKernel(KernelIsa isa, bool fixedPoint, FeedbackBlendMode blendMode,
+                                       FeedbackTrailMode trailMode, FeedbackMixMode mixMode);
+
+// table of one kernel template instantiated for every trail / mix mode
+#define FEEDBACK_KERNEL_TABLE(kernel) { \
+    { kernel<TRAIL_MODE_REPLACE, MIX_MODE_TRAIL>, kernel<TRAIL_MODE_REPLACE, MIX_MODE_NEW>, kernel<TRAIL_MODE_REPLACE, MIX_MODE_BLEND> }, \
+    { kernel<TRAIL_MODE_LIGHTEN, MIX_MODE_TRAIL>, kernel<TRAIL_MODE_LIGHTEN, MIX_MODE_NEW>, kernel<TRAIL_MODE_LIGHTEN, MIX_MODE_BLEND> }, \
+    { kernel<TRAIL_MODE_DECAY, MIX_MODE_TRAIL>, kernel<TRAIL_MODE_DECAY, MIX_MODE_NEW>, kernel<TRAIL_MODE_DECAY, MIX_MODE_BLEND> } }
+
+// the same for the 8 bit trail kernels, which also take the blend mode, first
+#define FEEDBACK_BLEND_KERNEL_TABLE(kernel, blend) { \
+    { kernel<blend, TRAIL_MODE_REPLACE, MIX_MODE_TRAIL>, kernel<blend, TRAIL_MODE_REPLACE, MIX_MODE_NEW>, kernel<blend, TRAIL_MODE_REPLACE, MIX_MODE_BLEND> }, \
+    { kernel<blend, TRAIL_MODE_LIGHTEN, MIX_MODE_TRAIL>, kernel<blend, TRAIL_MODE_LIGHTEN, MIX_MODE_NEW>, kernel<blend, TRAIL_MODE_LIGHTEN, MIX_MODE_BLEND> }, \
+    { kernel<blend, TRAIL_MODE_DECAY, MIX_MODE_TRAIL>, kernel<blend, TRAIL_MODE_DECAY, MIX_MODE_NEW>, kernel<blend, TRAIL_MODE_DECAY, MIX_MODE_BLEND> } }
+#define FEEDBACK_BLEND_KERNEL_TABLES(kernel) { \
+    FEEDBACK_BLEND_KERNEL_TABLE(kernel, BLEND_MODE_LIGHTEN), FEEDBACK_BLEND_KERNEL_TABLE(kernel, BLEND_MODE_SCREEN), \
+    FEEDBACK_BLEND_KERNEL_TABLE(kernel, BLEND_MODE_ADD), FEEDBACK_BLEND_KERNEL_TABLE(kernel, BLEND_MODE_DIFFERENCE), \
+    FEEDBACK_BLEND_KERNEL_TABLE(kernel, BLEND_MODE_AVERAGE) }
+
+// High precision trail: 16 bits per channel byte holding the value * 256, decayed
+// with feedbackFixed and lightened against src << 8. The display gets the 16 bit
+// value plus an ordered dither threshold, >> 8, so levels between two 8 bit steps
+// show as a dither pattern instead of a plateau. dither holds the thresholds of one
+// row, 2 * FEEDBACK_DITHER_PERIOD of them, byte i uses dither[(ditherPhase + i) % period].
+// newestFrameMixFixed is the mix like for the fixed point kernels.
+const int FEEDBACK_DITHER_PERIOD = 48; // whole 3 and 4 byte pixels and whole 16 byte vectors
+
+typedef void (*FeedbackRow16Kernel)(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                                    const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params);
+
+FeedbackRow16Kernel getFeedbackRow16Kernel(KernelIsa isa, FeedbackTrailMode trailMode, FeedbackMixMode mixMode);
+
+// Global gain trail: the 16 bit trail is stored relative to a gain shared by the
+// whole frame, trail * 256 = (stored * gainFixed) >> 8, so decay is only a change of
+// gain and the kernels never write the trail for it. Lighten stores
+// (src << 8) * inverseGainFixed >> 16, only in the 16 byte blocks (32 for AVX2) where
+// src is brighter than the trail somewhere, TRAIL_MODE_REPLACE stores everything.
+// Blocks with black colour bytes skip the lighten test, they only read the trail.
+// Lighten and decay are the same kernel. Display output as for the 16 bit trail.
+FeedbackRow16Kernel getFeedbackRowGainKernel(KernelIsa isa, FeedbackTrailMode trailMode, FeedbackMixMode mixMode);
+
+// Linear light trail: the 16 bit trail holds the sRGB decoded value * 65535, src goes
+// in through toLinear and decay, lighten and mix happen on light instead of on the
+// encoded bytes. The display gets fromLinear[value >> LINEAR_LIGHT_SHIFT], the sRGB
+// encoded value * 256, plus the dither threshold, >> 8. Both tables are filled once,
+// an 8 bit value goes through and back unchanged. The SSE2 version (AVX2 uses it too)
+// does the lookups a lane at a time, the rest like the 16 bit trail.
+const int LINEAR_LIGHT_SHIFT = 4;
+struct LinearLightTables {
+    uint16_t    toLinear[256];
+    uint16_t    fromLinear[65536 >> LINEAR_LIGHT_SHIFT];
+};
+const LinearLightTables& getLinearLightTables();
+FeedbackRow16Kernel getFeedbackRowLinearKernel(KernelIsa isa, FeedbackTrailMode trailMode, FeedbackMixMode mixMode);
+
+// dst = max(dst, src) per byte, merges frames waiting for a batched decay
+void maxBytes(uint8_t *dst, const uint8_t *src, int32_t count);
+
+// Box filters factor x factor pixel blocks of src (rows srcRowBytes apart) into count
+// pixels of dst, every byte of a pixel alike. SSE2 for 4 byte pixels and factors 2 and 4.
+void downsampleRow(uint8_t *dst, const uint8_t *src, int32_t srcRowBytes, int32_t count, int32_t pixelInc, int32_t factor);
+
+// display = (display * (256 - sum of weights) + sum of taps[i] * weights[i]) >> 8 for
+// the colour bytes, weights 0-256 adding up to 256 at most. One pass for all taps.
+const int MAX_ECHO_TAPS = 4;
+void echoRow(uint8_t *display, const uint8_t *const *taps, const uint16_t *weights, int numTaps,
+             int32_t count, uint32_t channelMask);
+
+// Background subtraction against a running average, background holds value * 256 per
+// byte. Pixels whose colour bytes all stay within threshold of the background go
+// black in row (other bytes are left alone), then the background moves learnFixed /
+// 65536 of the way to row, rounded. One pass, row is only read once.
+void subtractBackgroundRow(uint8_t *row, uint16_t *background, int32_t count, int32_t pixelInc,
+                           uint8_t threshold, uint16_t learnFixed, uint32_t channelMask);
+
+// Luma key: row bytes are scaled by the weight of their pixel's luma, 0 below the
+// key and 256 above it with a linear knee kneeWidth wide centred on threshold
+// (kneeWidth 0 is a hard key at threshold), bytes with no luma weight are left alone. A pixel
+// that was over the threshold last frame, keyState != 0, stays over it down to
+// threshold - hysteresis. keyState holds a byte per pixel and gets this frame's.
+// The luma is (sum of bytes * lumaWeights + 128) >> 8, lumaWeights per byte of a
+// pixel in memory order, adding up to 256.
+struct LumaKeyRowParams {
+    uint8_t     threshold;
+    uint8_t     kneeWidth;
+    uint8_t     hysteresis;
+    uint16_t    lumaWeights[4];
+};
+void lumaKeyRow(uint8_t *row, uint8_t *keyState, int32_t count, int32_t pixelInc, const LumaKeyRowParams &params);
+
+// dst = (sum of the bytes of each pixel * weights + 128) >> 8, count pixels, weights
+// per byte of a pixel adding up to 256 (see FrameView::getLumaWeights)
+void lumaRow(uint8_t *dst, const uint8_t *src, int32_t count, int32_t pixelInc, const uint16_t *weights);
+
+// dst = (a + b + c + d + 2) >> 2 of each 2 x 2 block of the one byte per pixel plane
+// src, its two rows stride apart, count values
+void halveRow(uint8_t *dst, const uint8_t *src, int32_t stride, int32_t count);
+
+// Sobel edges of count pixels from the luma of the row and the rows above and below
+// it, each count + 2 values with pixel x at x + 1 (the ends repeat the edge pixel).
+// The colour bytes of row get min(((|gx| + |gy|) * gainFixed) >> 5, 255), gainFixed
+// up to 32, the other bytes are left alone.
+void sobelRow(uint8_t *row, const uint8_t *above, const uint8_t *luma, const uint8_t *below, int32_t count,
+              int32_t pixelInc, uint16_t gainFixed, uint32_t channelMask);
+
+// Gradient map: the colour bytes of count pixels of row are replaced by those of
+// table[level], level the luma as for lumaRow, or with weights NULL the brightest
+// colour byte. table holds a pixel per level, bytes in memory order, the other bytes
+// are left alone.
+void gradientMapRow(uint8_t *row, int32_t count, int32_t pixelInc, const uint32_t *table, const uint16_t *weights,
+                    uint32_t channelMask);
+
+// Trail layers on top of the main trail, each with its own decay, gate and tint:
+// layer = max(decay ? (layer * feedbackFixed) >> 16 : layer, src >= gate ? src : 0),
+// display = max(display, (layer * tint) >> 8). All layers go in one pass, src and
+// display are read once however many there are. tint holds 2 * FEEDBACK_DITHER_PERIOD
+// multipliers (0-256, 0 leaves non colour bytes alone), byte i uses
+// tint[(tintPhase + i) % period]. A NULL display only updates the layers.
+// Each layer is still its own 8 bit buffer read and written every frame, so the cost
+// grows by about one trail pass per layer, bandwidth rather than arithmetic.
+const int MAX_TRAIL_LAYERS = 3;
+struct TrailLayerRowParams {
+    uint16_t        feedbackFixed;  // per frame multiplier as 0.16 fixed point
+    uint8_t         gate;
+    const uint16_t  *tint;
+};
+typedef void (*TrailLayersKernel)(uint8_t *const *layers, const TrailLayerRowParams *params, int numLayers,
+                                  const uint8_t *src, uint8_t *display, int32_t count, int32_t tintPhase, bool decay);
+void trailLayersRow(uint8_t *const *layers, const TrailLayerRowParams *params, int numLayers, const uint8_t *src,
+                    uint8_t *display, int32_t count, int32_t tintPhase, bool decay);
+// the AVX2 version of trailLayersRow when isa has it, the layers are mostly arithmetic
+TrailLayersKernel getTrailLayersKernel(KernelIsa isa);
+
+// 4x4 Bayer thresholds (0-255) for row y, 2 * FEEDBACK_DITHER_PERIOD entries
+void fillDitherRow(uint16_t *dither, int32_t y, uint8_t pixelInc);
+
+// generic scalar versions testing the flags per byte, the vector kernels use them
+// for the last few bytes of a row, handle any count
+void feedbackRowScalar(uint8_t *trail, const uint8_t *src, uint8_t *display,
+                       int32_t count, const FeedbackRowParams &params);
+void feedbackRowFixedScalar(uint8_t *trail, const uint8_t *src, uint8_t *display,
+                            int32_t count, const FeedbackRowParams &params);
+void feedbackRow16Scalar(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                         const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params);
+void feedbackRowGainScalar(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                           const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params);
+void feedbackRowLinearScalar(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                             const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params);
+
+#endif /* FeedbackKernels_h */
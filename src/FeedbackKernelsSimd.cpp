@@ -0,0 +1,764 @@
+//
+//  FeedbackKernelsSimd.cpp
+//  Illuminate
+//
+//  SSE2 and AVX2 versions of the feedback row kernels. The float ones do the same
+//  operations in the same order as feedbackRowScalar, so the output is bit
+//  identical: bytes are widened to int32 -> float, multiplied, truncated back.
+//  The fixed point ones stay in 16 bit lanes and match feedbackRowFixedScalar.
+//  BLEND / TRAIL / MIX are compile time constants, the untaken branches drop out.
+//  The 16 bit, global gain and linear light trail kernels match feedbackRow16Scalar,
+//  feedbackRowGainScalar and feedbackRowLinearScalar in the display output.
+//  AVX2 code uses target attributes so the file builds without -mavx2 and the
+//  AVX2 path is only entered after the cpuid check in FeedbackKernels.cpp.
+//
+
+#include "FeedbackKernels.h"
+
+#include <cstddef>
+
+#if defined(__i386__) || defined(__x86_64__)
+
+#include <emmintrin.h>
+#include <immintrin.h>
+
+#define AVX2_TARGET __attribute__((target("avx2")))
+
+// ---- SSE2 ----------------------------------------------------------------
+
+static inline __m128 lo32Sse2(__m128i v16) { return _mm_cvtepi32_ps(_mm_unpacklo_epi16(v16, _mm_setzero_si128())); }
+static inline __m128 hi32Sse2(__m128i v16) { return _mm_cvtepi32_ps(_mm_unpackhi_epi16(v16, _mm_setzero_si128())); }
+
+static inline __m128i packFloatsSse2(__m128 a, __m128 b, __m128 c, __m128 d)
+{
+    __m128i lo = _mm_packs_epi32(_mm_cvttps_epi32(a), _mm_cvttps_epi32(b));
+    __m128i hi = _mm_packs_epi32(_mm_cvttps_epi32(c), _mm_cvttps_epi32(d));
+    return _mm_packus_epi16(lo, hi);
+}
+
+// (int)(o * feedback) for 16 bytes
+static inline __m128i decaySse2(__m128i o, __m128 feedback)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_unpacklo_epi8(o, zero);
+    __m128i hi = _mm_unpackhi_epi8(o, zero);
+    return packFloatsSse2(_mm_mul_ps(lo32Sse2(lo), feedback), _mm_mul_ps(hi32Sse2(lo), feedback),
+                          _mm_mul_ps(lo32Sse2(hi), feedback), _mm_mul_ps(hi32Sse2(hi), feedback));
+}
+
+// (o * (1 - mix)) + (n * mix) for 16 bytes
+static inline __m128i mixSse2(__m128i o, __m128i n, __m128 oldMix, __m128 mix)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i oLo = _mm_unpacklo_epi8(o, zero);
+    __m128i oHi = _mm_unpackhi_epi8(o, zero);
+    __m128i nLo = _mm_unpacklo_epi8(n, zero);
+    __m128i nHi = _mm_unpackhi_epi8(n, zero);
+    return packFloatsSse2(_mm_add_ps(_mm_mul_ps(lo32Sse2(oLo), oldMix), _mm_mul_ps(lo32Sse2(nLo), mix)),
+                          _mm_add_ps(_mm_mul_ps(hi32Sse2(oLo), oldMix), _mm_mul_ps(hi32Sse2(nLo), mix)),
+                          _mm_add_ps(_mm_mul_ps(lo32Sse2(oHi), oldMix), _mm_mul_ps(lo32Sse2(nHi), mix)),
+                          _mm_add_ps(_mm_mul_ps(hi32Sse2(oHi), oldMix), _mm_mul_ps(hi32Sse2(nHi), mix)));
+}
+
+// colour bytes from d, the rest from n
+static inline __m128i selectSse2(__m128i channelMask, __m128i d, __m128i n)
+{
+    return _mm_or_si128(_mm_and_si128(channelMask, d), _mm_andnot_si128(channelMask, n));
+}
+
+// blendScalar on 16 bit lanes holding 0-255, every intermediate fits 16 bits unsigned
+template <FeedbackBlendMode BLEND>
+static inline __m128i blendLanesSse2(__m128i o, __m128i n, __m128i weight, __m128i oldWeight)
+{
+    switch (BLEND) {
+        case BLEND_MODE_SCREEN: {
+            const __m128i product = _mm_add_epi16(_mm_mullo_epi16(o, n), _mm_set1_epi16(128));
+            const __m128i scaled = _mm_srli_epi16(_mm_add_epi16(product, _mm_srli_epi16(product, 8)), 8);
+            return _mm_sub_epi16(_mm_add_epi16(o, n), scaled);
+        }
+        case BLEND_MODE_ADD:        return _mm_min_epi16(_mm_add_epi16(o, n), _mm_set1_epi16(255));
+        case BLEND_MODE_DIFFERENCE: return _mm_max_epi16(_mm_sub_epi16(o, n), _mm_sub_epi16(n, o));
+        case BLEND_MODE_AVERAGE:    return _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(o, oldWeight), _mm_mullo_epi16(n, weight)), 8);
+        default:                    return _mm_max_epi16(o, n);
+    }
+}
+
+// the same on bytes, the modes without a multiply stay 8 bit
+template <FeedbackBlendMode BLEND>
+static inline __m128i blendSse2(__m128i o, __m128i n, __m128i weight, __m128i oldWeight)
+{
+    switch (BLEND) {
+        case BLEND_MODE_LIGHTEN:    return _mm_max_epu8(o, n);
+        case BLEND_MODE_ADD:        return _mm_adds_epu8(o, n);
+        case BLEND_MODE_DIFFERENCE: return _mm_or_si128(_mm_subs_epu8(o, n), _mm_subs_epu8(n, o));
+        default: {
+            const __m128i zero = _mm_setzero_si128();
+            __m128i lo = blendLanesSse2<BLEND>(_mm_unpacklo_epi8(o, zero), _mm_unpacklo_epi8(n, zero), weight, oldWeight);
+            __m128i hi = blendLanesSse2<BLEND>(_mm_unpackhi_epi8(o, zero), _mm_unpackhi_epi8(n, zero), weight, oldWeight);
+            return _mm_packus_epi16(lo, hi);
+        }
+    }
+}
+
+template <FeedbackBlendMode BLEND, FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+static void feedbackRowSse2(uint8_t *trail, const uint8_t *src, uint8_t *display,
+                            int32_t count, const FeedbackRowParams &params)
+{
+    const __m128 feedback = _mm_set1_ps(params.feedback);
+    const __m128 mix = _mm_set1_ps(params.newestFrameMix);
+    const __m128 oldMix = _mm_set1_ps(1 - params.newestFrameMix);
+    const __m128i channelMask = _mm_set1_epi32((int)params.channelMask);
+    const __m128i blendWeight = _mm_set1_epi16((short)params.blendWeightFixed);
+    const __m128i oldBlendWeight = _mm_set1_epi16((short)(256 - params.blendWeightFixed));
+    int32_t i = 0;
+    for ( ; i + 16 <= count ; i += 16) {
+        __m128i n = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i o = n;
+        if (TRAIL != TRAIL_MODE_REPLACE) {
+            o = _mm_loadu_si128((const __m128i*)(trail + i));
+            if (TRAIL == TRAIL_MODE_DECAY) {
+                o = decaySse2(o, feedback);
+            }
+            o = blendSse2<BLEND>(o, n, blendWeight, oldBlendWeight);
+        }
+        _mm_storeu_si128((__m128i*)(trail + i), o);
+        __m128i d = n;
+        if (MIX == MIX_MODE_TRAIL) {
+            d = selectSse2(channelMask, o, n);
+        } else if (MIX == MIX_MODE_BLEND) {
+            d = selectSse2(channelMask, mixSse2(o, n, oldMix, mix), n);
+        }
+        _mm_storeu_si128((__m128i*)(display + i), d);
+    }
+    // the mask repeats every 4 bytes and i is a multiple of 16, so the tail lines up
+    feedbackRowScalar(trail + i, src + i, display + i, count - i, params);
+}
+
+// 8 bytes per 16 bit lane half, mulhi gives (o * feedbackFixed) >> 16 directly
+template <FeedbackBlendMode BLEND, FeedbackTrailMode TRAIL>
+static inline void fixedLanesSse2(__m128i &o, __m128i n, __m128i feedback, __m128i blendWeight, __m128i oldBlendWeight)
+{
+    if (TRAIL == TRAIL_MODE_REPLACE) {
+        o = n;
+        return;
+    }
+    if (TRAIL == TRAIL_MODE_DECAY) {
+        o = _mm_mulhi_epu16(o, feedback);
+    }
+    o = blendLanesSse2<BLEND>(o, n, blendWeight, oldBlendWeight);
+}
+
+template <FeedbackBlendMode BLEND, FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+static void feedbackRowFixedSse2(uint8_t *trail, const uint8_t *src, uint8_t *display,
+                                 int32_t count, const FeedbackRowParams &params)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i feedback = _mm_set1_epi16((short)params.feedbackFixed);
+    const __m128i mix = _mm_set1_epi16((short)params.newestFrameMixFixed);
+    const __m128i oldMix = _mm_set1_epi16((short)(256 - params.newestFrameMixFixed));
+    const __m128i channelMask = _mm_set1_epi32((int)params.channelMask);
+    const __m128i blendWeight = _mm_set1_epi16((short)params.blendWeightFixed);
+    const __m128i oldBlendWeight = _mm_set1_epi16((short)(256 - params.blendWeightFixed));
+    int32_t i = 0;
+    for ( ; i + 16 <= count ; i += 16) {
+        __m128i n = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i o = TRAIL == TRAIL_MODE_REPLACE ? n : _mm_loadu_si128((const __m128i*)(trail + i));
+        __m128i nLo = _mm_unpacklo_epi8(n, zero);
+        __m128i nHi = _mm_unpackhi_epi8(n, zero);
+        __m128i oLo = _mm_unpacklo_epi8(o, zero);
+        __m128i oHi = _mm_unpackhi_epi8(o, zero);
+        fixedLanesSse2<BLEND, TRAIL>(oLo, nLo, feedback, blendWeight, oldBlendWeight);
+        fixedLanesSse2<BLEND, TRAIL>(oHi, nHi, feedback, blendWeight, oldBlendWeight);
+        o = _mm_packus_epi16(oLo, oHi);
+        _mm_storeu_si128((__m128i*)(trail + i), o);
+        __m128i d = n;
+        if (MIX == MIX_MODE_TRAIL) {
+            d = selectSse2(channelMask, o, n);
+        } else if (MIX == MIX_MODE_BLEND) {
+            __m128i dLo = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(oLo, oldMix), _mm_mullo_epi16(nLo, mix)), 8);
+            __m128i dHi = _mm_srli_epi16(_mm_add_epi16(_mm_mullo_epi16(oHi, oldMix), _mm_mullo_epi16(nHi, mix)), 8);
+            d = selectSse2(channelMask, _mm_packus_epi16(dLo, dHi), n);
+        }
+        _mm_storeu_si128((__m128i*)(display + i), d);
+    }
+    feedbackRowFixedScalar(trail + i, src + i, display + i, count - i, params);
+}
+
+FeedbackRowKernel getFeedbackRowKernelSse2(bool fixedPoint, FeedbackBlendMode blendMode,
+                                           FeedbackTrailMode trailMode, FeedbackMixMode mixMode)
+{
+    static const FeedbackRowKernel kernels[NUM_BLEND_MODES][NUM_TRAIL_MODES][NUM_MIX_MODES] =
+        FEEDBACK_BLEND_KERNEL_TABLES(feedbackRowSse2);
+    static const FeedbackRowKernel fixedKernels[NUM_BLEND_MODES][NUM_TRAIL_MODES][NUM_MIX_MODES] =
+        FEEDBACK_BLEND_KERNEL_TABLES(feedbackRowFixedSse2);
+    return fixedPoint ? fixedKernels[blendMode][trailMode][mixMode] : kernels[blendMode][trailMode][mixMode];
+}
+
+// SSE2 has no unsigned 16 bit max, a - b saturating at 0, + b gives it
+static inline __m128i maxU16Sse2(__m128i a, __m128i b)
+{
+    return _mm_adds_epu16(_mm_subs_epu16(a, b), b);
+}
+
+template <FeedbackTrailMode TRAIL>
+static inline __m128i trail16Sse2(const uint16_t *trail, __m128i n16, __m128i feedback)
+{
+    if (TRAIL == TRAIL_MODE_REPLACE) {
+        return n16;
+    }
+    __m128i t = _mm_loadu_si128((const __m128i*)trail);
+    if (TRAIL == TRAIL_MODE_DECAY) {
+        t = _mm_mulhi_epu16(t, feedback);
+    }
+    return maxU16Sse2(t, n16);
+}
+
+template <FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+static void feedbackRow16Sse2(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                              const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i feedback = _mm_set1_epi16((short)params.feedbackFixed);
+    const __m128i mix = _mm_set1_epi16((short)(params.newestFrameMixFixed << 8));
+    const __m128i oldMix = _mm_set1_epi16((short)((256 - params.newestFrameMixFixed) << 8));
+    const __m128i channelMask = _mm_set1_epi32((int)params.channelMask);
+    int32_t phase = ditherPhase;
+    int32_t i = 0;
+    for ( ; i + 16 <= count ; i += 16) {
+        __m128i n = _mm_loadu_si128((const __m128i*)(src + i));
+        // zero as the low byte gives n << 8
+        __m128i nLo = _mm_unpacklo_epi8(zero, n);
+        __m128i nHi = _mm_unpackhi_epi8(zero, n);
+        __m128i tLo = trail16Sse2<TRAIL>(trail + i, nLo, feedback);
+        __m128i tHi = trail16Sse2<TRAIL>(trail + i + 8, nHi, feedback);
+        _mm_storeu_si128((__m128i*)(trail + i), tLo);
+        _mm_storeu_si128((__m128i*)(trail + i + 8), tHi);
+        __m128i d = n;
+        if (MIX != MIX_MODE_NEW) {
+            __m128i dLo = tLo;
+            __m128i dHi = tHi;
+            if (MIX == MIX_MODE_BLEND) {
+                // weights add up to 65536, so the sum stays below 65281
+                dLo = _mm_add_epi16(_mm_mulhi_epu16(tLo, oldMix), _mm_mulhi_epu16(nLo, mix));
+                dHi = _mm_add_epi16(_mm_mulhi_epu16(tHi, oldMix), _mm_mulhi_epu16(nHi, mix));
+            }
+            dLo = _mm_srli_epi16(_mm_adds_epu16(dLo, _mm_loadu_si128((const __m128i*)(dither + phase))), 8);
+            dHi = _mm_srli_epi16(_mm_adds_epu16(dHi, _mm_loadu_si128((const __m128i*)(dither + phase + 8))), 8);
+            d = selectSse2(channelMask, _mm_packus_epi16(dLo, dHi), n);
+        }
+        _mm_storeu_si128((__m128i*)(display + i), d);
+        phase += 16;
+        if (phase >= FEEDBACK_DITHER_PERIOD) {
+            phase -= FEEDBACK_DITHER_PERIOD;
+        }
+    }
+    feedbackRow16Scalar(trail + i, src + i, display + i, count - i, dither, phase, params);
+}
+
+FeedbackRow16Kernel getFeedbackRow16KernelSse2(FeedbackTrailMode trailMode, FeedbackMixMode mixMode)
+{
+    static const FeedbackRow16Kernel kernels[NUM_TRAIL_MODES][NUM_MIX_MODES] = FEEDBACK_KERNEL_TABLE(feedbackRow16Sse2);
+    return kernels[trailMode][mixMode];
+}
+
+// the lookups stay scalar, through the stack, the arithmetic between them is the 16 bit trail's
+template <FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+static void feedbackRowLinearSse2(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                                  const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params)
+{
+    const uint16_t *toLinear = params.linearLight->toLinear;
+    const uint16_t *fromLinear = params.linearLight->fromLinear;
+    const __m128i feedback = _mm_set1_epi16((short)params.feedbackFixed);
+    const __m128i mix = _mm_set1_epi16((short)(params.newestFrameMixFixed << 8));
+    const __m128i oldMix = _mm_set1_epi16((short)((256 - params.newestFrameMixFixed) << 8));
+    const __m128i channelMask = _mm_set1_epi32((int)params.channelMask);
+    uint16_t lanes[16];
+    int32_t phase = ditherPhase;
+    int32_t i = 0;
+    for ( ; i + 16 <= count ; i += 16) {
+        for (int k = 0 ; k < 16 ; k++) {
+            lanes[k] = toLinear[src[i + k]];
+        }
+        __m128i nLo = _mm_loadu_si128((const __m128i*)lanes);
+        __m128i nHi = _mm_loadu_si128((const __m128i*)(lanes + 8));
+        __m128i tLo = trail16Sse2<TRAIL>(trail + i, nLo, feedback);
+        __m128i tHi = trail16Sse2<TRAIL>(trail + i + 8, nHi, feedback);
+        _mm_storeu_si128((__m128i*)(trail + i), tLo);
+        _mm_storeu_si128((__m128i*)(trail + i + 8), tHi);
+        __m128i n = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i d = n;
+        if (MIX != MIX_MODE_NEW) {
+            __m128i dLo = tLo;
+            __m128i dHi = tHi;
+            if (MIX == MIX_MODE_BLEND) {
+                dLo = _mm_add_epi16(_mm_mulhi_epu16(tLo, oldMix), _mm_mulhi_epu16(nLo, mix));
+                dHi = _mm_add_epi16(_mm_mulhi_epu16(tHi, oldMix), _mm_mulhi_epu16(nHi, mix));
+            }
+            _mm_storeu_si128((__m128i*)lanes, _mm_srli_epi16(dLo, LINEAR_LIGHT_SHIFT));
+            _mm_storeu_si128((__m128i*)(lanes + 8), _mm_srli_epi16(dHi, LINEAR_LIGHT_SHIFT));
+            for (int k = 0 ; k < 16 ; k++) {
+                lanes[k] = fromLinear[lanes[k]];
+            }
+            dLo = _mm_srli_epi16(_mm_adds_epu16(_mm_loadu_si128((const __m128i*)lanes),
+                                                _mm_loadu_si128((const __m128i*)(dither + phase))), 8);
+            dHi = _mm_srli_epi16(_mm_adds_epu16(_mm_loadu_si128((const __m128i*)(lanes + 8)),
+                                                _mm_loadu_si128((const __m128i*)(dither + phase + 8))), 8);
+            d = selectSse2(channelMask, _mm_packus_epi16(dLo, dHi), n);
+        }
+        _mm_storeu_si128((__m128i*)(display + i), d);
+        phase += 16;
+        if (phase >= FEEDBACK_DITHER_PERIOD) {
+            phase -= FEEDBACK_DITHER_PERIOD;
+        }
+    }
+    feedbackRowLinearScalar(trail + i, src + i, display + i, count - i, dither, phase, params);
+}
+
+FeedbackRow16Kernel getFeedbackRowLinearKernelSse2(FeedbackTrailMode trailMode, FeedbackMixMode mixMode)
+{
+    static const FeedbackRow16Kernel kernels[NUM_TRAIL_MODES][NUM_MIX_MODES] = FEEDBACK_KERNEL_TABLE(feedbackRowLinearSse2);
+    return kernels[trailMode][mixMode];
+}
+
+// (s * gain) >> 8 as s * (gain >> 8) + ((s * (gain & 255)) >> 8), gainHigh holding
+// gain >> 8 and gainLow (gain & 255) << 8 per lane. Exact while the result fits
+// 16 bits, which the gain makes sure of, and a gain of 1 (65536) comes out as s << 8.
+static inline __m128i gainedSse2(__m128i s, __m128i gainHigh, __m128i gainLow)
+{
+    return _mm_add_epi16(_mm_mullo_epi16(s, gainHigh), _mm_mulhi_epu16(s, gainLow));
+}
+
+template <FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+static void feedbackRowGainSse2(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                                const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i gainHigh = _mm_set1_epi16((short)(params.gainFixed >> 8));
+    const __m128i gainLow = _mm_set1_epi16((short)((params.gainFixed & 255) << 8));
+    const __m128i inverseGain = _mm_set1_epi16((short)params.inverseGainFixed);
+    const __m128i mix = _mm_set1_epi16((short)(params.newestFrameMixFixed << 8));
+    const __m128i oldMix = _mm_set1_epi16((short)((256 - params.newestFrameMixFixed) << 8));
+    const __m128i channelMask = _mm_set1_epi32((int)params.channelMask);
+    int32_t phase = ditherPhase;
+    int32_t i = 0;
+    for ( ; i + 16 <= count ; i += 16) {
+        __m128i n = _mm_loadu_si128((const __m128i*)(src + i));
+        __m128i nLo = _mm_unpacklo_epi8(zero, n);
+        __m128i nHi = _mm_unpackhi_epi8(zero, n);
+        __m128i tLo = nLo;
+        __m128i tHi = nHi;
+        if (TRAIL == TRAIL_MODE_REPLACE) {
+            _mm_storeu_si128((__m128i*)(trail + i), _mm_mulhi_epu16(nLo, inverseGain));
+            _mm_storeu_si128((__m128i*)(trail + i + 8), _mm_mulhi_epu16(nHi, inverseGain));
+        } else {
+            __m128i sLo = _mm_loadu_si128((const __m128i*)(trail + i));
+            __m128i sHi = _mm_loadu_si128((const __m128i*)(trail + i + 8));
+            tLo = gainedSse2(sLo, gainHigh, gainLow);
+            tHi = gainedSse2(sHi, gainHigh, gainLow);
+            // black in every colour byte (keyed / subtracted / dark areas) can't light the trail
+            if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(n, channelMask), zero)) != 0xffff) {
+                // how far src is over the trail, 0 where the trail stays as it is
+                __m128i overLo = _mm_subs_epu16(nLo, tLo);
+                __m128i overHi = _mm_subs_epu16(nHi, tHi);
+                __m128i keepLo = _mm_cmpeq_epi16(overLo, zero);
+                __m128i keepHi = _mm_cmpeq_epi16(overHi, zero);
+                tLo = _mm_add_epi16(tLo, overLo);
+                tHi = _mm_add_epi16(tHi, overHi);
+                // alpha / padding never count, dark or fading areas skip the store
+                __m128i wins = _mm_andnot_si128(_mm_packs_epi16(keepLo, keepHi), channelMask);
+                if (_mm_movemask_epi8(wins) != 0) {
+                    sLo = selectSse2(keepLo, sLo, _mm_mulhi_epu16(nLo, inverseGain));
+                    sHi = selectSse2(keepHi, sHi, _mm_mulhi_epu16(nHi, inverseGain));
+                    _mm_storeu_si128((__m128i*)(trail + i), sLo);
+                    _mm_storeu_si128((__m128i*)(trail + i + 8), sHi);
+                }
+            }
+        }
+        __m128i d = n;
+        if (MIX != MIX_MODE_NEW) {
+            __m128i dLo = tLo;
+            __m128i dHi = tHi;
+            if (MIX == MIX_MODE_BLEND) {
+                dLo = _mm_add_epi16(_mm_mulhi_epu16(tLo, oldMix), _mm_mulhi_epu16(nLo, mix));
+                dHi = _mm_add_epi16(_mm_mulhi_epu16(tHi, oldMix), _mm_mulhi_epu16(nHi, mix));
+            }
+            dLo = _mm_srli_epi16(_mm_adds_epu16(dLo, _mm_loadu_si128((const __m128i*)(dither + phase))), 8);
+            dHi = _mm_srli_epi16(_mm_adds_epu16(dHi, _mm_loadu_si128((const __m128i*)(dither + phase + 8))), 8);
+            d = selectSse2(channelMask, _mm_packus_epi16(dLo, dHi), n);
+        }
+        _mm_storeu_si128((__m128i*)(display + i), d);
+        phase += 16;
+        if (phase >= FEEDBACK_DITHER_PERIOD) {
+            phase -= FEEDBACK_DITHER_PERIOD;
+        }
+    }
+    feedbackRowGainScalar(trail + i, src + i, display + i, count - i, dither, phase, params);
+}
+
+FeedbackRow16Kernel getFeedbackRowGainKernelSse2(FeedbackTrailMode trailMode, FeedbackMixMode mixMode)
+{
+    static const FeedbackRow16Kernel kernels[NUM_TRAIL_MODES][NUM_MIX_MODES] = FEEDBACK_KERNEL_TABLE(feedbackRowGainSse2);
+    return kernels[trailMode][mixMode];
+}
+
+// ---- AVX2 ----------------------------------------------------------------
+// unpack / pack work per 128 bit lane, the pack undoes the unpack order exactly
+
+AVX2_TARGET static inline __m256 lo32Avx2(__m256i v16) { return _mm256_cvtepi32_ps(_mm256_unpacklo_epi16(v16, _mm256_setzero_si256())); }
+AVX2_TARGET static inline __m256 hi32Avx2(__m256i v16) { return _mm256_cvtepi32_ps(_mm256_unpackhi_epi16(v16, _mm256_setzero_si256())); }
+
+AVX2_TARGET static inline __m256i packFloatsAvx2(__m256 a, __m256 b, __m256 c, __m256 d)
+{
+    __m256i lo = _mm256_packs_epi32(_mm256_cvttps_epi32(a), _mm256_cvttps_epi32(b));
+    __m256i hi = _mm256_packs_epi32(_mm256_cvttps_epi32(c), _mm256_cvttps_epi32(d));
+    return _mm256_packus_epi16(lo, hi);
+}
+
+AVX2_TARGET static inline __m256i decayAvx2(__m256i o, __m256 feedback)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i lo = _mm256_unpacklo_epi8(o, zero);
+    __m256i hi = _mm256_unpackhi_epi8(o, zero);
+    return packFloatsAvx2(_mm256_mul_ps(lo32Avx2(lo), feedback), _mm256_mul_ps(hi32Avx2(lo), feedback),
+                          _mm256_mul_ps(lo32Avx2(hi), feedback), _mm256_mul_ps(hi32Avx2(hi), feedback));
+}
+
+AVX2_TARGET static inline __m256i mixAvx2(__m256i o, __m256i n, __m256 oldMix, __m256 mix)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i oLo = _mm256_unpacklo_epi8(o, zero);
+    __m256i oHi = _mm256_unpackhi_epi8(o, zero);
+    __m256i nLo = _mm256_unpacklo_epi8(n, zero);
+    __m256i nHi = _mm256_unpackhi_epi8(n, zero);
+    return packFloatsAvx2(_mm256_add_ps(_mm256_mul_ps(lo32Avx2(oLo), oldMix), _mm256_mul_ps(lo32Avx2(nLo), mix)),
+                          _mm256_add_ps(_mm256_mul_ps(hi32Avx2(oLo), oldMix), _mm256_mul_ps(hi32Avx2(nLo), mix)),
+                          _mm256_add_ps(_mm256_mul_ps(lo32Avx2(oHi), oldMix), _mm256_mul_ps(lo32Avx2(nHi), mix)),
+                          _mm256_add_ps(_mm256_mul_ps(hi32Avx2(oHi), oldMix), _mm256_mul_ps(hi32Avx2(nHi), mix)));
+}
+
+template <FeedbackBlendMode BLEND>
+AVX2_TARGET static inline __m256i blendLanesAvx2(__m256i o, __m256i n, __m256i weight, __m256i oldWeight)
+{
+    switch (BLEND) {
+        case BLEND_MODE_SCREEN: {
+            const __m256i product = _mm256_add_epi16(_mm256_mullo_epi16(o, n), _mm256_set1_epi16(128));
+            const __m256i scaled = _mm256_srli_epi16(_mm256_add_epi16(product, _mm256_srli_epi16(product, 8)), 8);
+            return _mm256_sub_epi16(_mm256_add_epi16(o, n), scaled);
+        }
+        case BLEND_MODE_ADD:        return _mm256_min_epi16(_mm256_add_epi16(o, n), _mm256_set1_epi16(255));
+        case BLEND_MODE_DIFFERENCE: return _mm256_abs_epi16(_mm256_sub_epi16(o, n));
+        case BLEND_MODE_AVERAGE:    return _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(o, oldWeight), _mm256_mullo_epi16(n, weight)), 8);
+        default:                    return _mm256_max_epi16(o, n);
+    }
+}
+
+template <FeedbackBlendMode BLEND>
+AVX2_TARGET static inline __m256i blendAvx2(__m256i o, __m256i n, __m256i weight, __m256i oldWeight)
+{
+    switch (BLEND) {
+        case BLEND_MODE_LIGHTEN:    return _mm256_max_epu8(o, n);
+        case BLEND_MODE_ADD:        return _mm256_adds_epu8(o, n);
+        case BLEND_MODE_DIFFERENCE: return _mm256_or_si256(_mm256_subs_epu8(o, n), _mm256_subs_epu8(n, o));
+        default: {
+            const __m256i zero = _mm256_setzero_si256();
+            __m256i lo = blendLanesAvx2<BLEND>(_mm256_unpacklo_epi8(o, zero), _mm256_unpacklo_epi8(n, zero), weight, oldWeight);
+            __m256i hi = blendLanesAvx2<BLEND>(_mm256_unpackhi_epi8(o, zero), _mm256_unpackhi_epi8(n, zero), weight, oldWeight);
+            return _mm256_packus_epi16(lo, hi);
+        }
+    }
+}
+
+template <FeedbackBlendMode BLEND, FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+AVX2_TARGET static void feedbackRowAvx2(uint8_t *trail, const uint8_t *src, uint8_t *display,
+                                        int32_t count, const FeedbackRowParams &params)
+{
+    const __m256 feedback = _mm256_set1_ps(params.feedback);
+    const __m256 mix = _mm256_set1_ps(params.newestFrameMix);
+    const __m256 oldMix = _mm256_set1_ps(1 - params.newestFrameMix);
+    const __m256i channelMask = _mm256_set1_epi32((int)params.channelMask);
+    const __m256i blendWeight = _mm256_set1_epi16((short)params.blendWeightFixed);
+    const __m256i oldBlendWeight = _mm256_set1_epi16((short)(256 - params.blendWeightFixed));
+    int32_t i = 0;
+    for ( ; i + 32 <= count ; i += 32) {
+        __m256i n = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i o = n;
+        if (TRAIL != TRAIL_MODE_REPLACE) {
+            o = _mm256_loadu_si256((const __m256i*)(trail + i));
+            if (TRAIL == TRAIL_MODE_DECAY) {
+                o = decayAvx2(o, feedback);
+            }
+            o = blendAvx2<BLEND>(o, n, blendWeight, oldBlendWeight);
+        }
+        _mm256_storeu_si256((__m256i*)(trail + i), o);
+        __m256i d = n;
+        if (MIX == MIX_MODE_TRAIL) {
+            d = _mm256_blendv_epi8(n, o, channelMask);
+        } else if (MIX == MIX_MODE_BLEND) {
+            d = _mm256_blendv_epi8(n, mixAvx2(o, n, oldMix, mix), channelMask);
+        }
+        _mm256_storeu_si256((__m256i*)(display + i), d);
+    }
+    feedbackRowSse2<BLEND, TRAIL, MIX>(trail + i, src + i, display + i, count - i, params);
+}
+
+template <FeedbackBlendMode BLEND, FeedbackTrailMode TRAIL>
+AVX2_TARGET static inline void fixedLanesAvx2(__m256i &o, __m256i n, __m256i feedback, __m256i blendWeight, __m256i oldBlendWeight)
+{
+    if (TRAIL == TRAIL_MODE_REPLACE) {
+        o = n;
+        return;
+    }
+    if (TRAIL == TRAIL_MODE_DECAY) {
+        o = _mm256_mulhi_epu16(o, feedback);
+    }
+    o = blendLanesAvx2<BLEND>(o, n, blendWeight, oldBlendWeight);
+}
+
+template <FeedbackBlendMode BLEND, FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+AVX2_TARGET static void feedbackRowFixedAvx2(uint8_t *trail, const uint8_t *src, uint8_t *display,
+                                             int32_t count, const FeedbackRowParams &params)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i feedback = _mm256_set1_epi16((short)params.feedbackFixed);
+    const __m256i mix = _mm256_set1_epi16((short)params.newestFrameMixFixed);
+    const __m256i oldMix = _mm256_set1_epi16((short)(256 - params.newestFrameMixFixed));
+    const __m256i channelMask = _mm256_set1_epi32((int)params.channelMask);
+    const __m256i blendWeight = _mm256_set1_epi16((short)params.blendWeightFixed);
+    const __m256i oldBlendWeight = _mm256_set1_epi16((short)(256 - params.blendWeightFixed));
+    int32_t i = 0;
+    for ( ; i + 32 <= count ; i += 32) {
+        __m256i n = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i o = TRAIL == TRAIL_MODE_REPLACE ? n : _mm256_loadu_si256((const __m256i*)(trail + i));
+        __m256i nLo = _mm256_unpacklo_epi8(n, zero);
+        __m256i nHi = _mm256_unpackhi_epi8(n, zero);
+        __m256i oLo = _mm256_unpacklo_epi8(o, zero);
+        __m256i oHi = _mm256_unpackhi_epi8(o, zero);
+        fixedLanesAvx2<BLEND, TRAIL>(oLo, nLo, feedback, blendWeight, oldBlendWeight);
+        fixedLanesAvx2<BLEND, TRAIL>(oHi, nHi, feedback, blendWeight, oldBlendWeight);
+        o = _mm256_packus_epi16(oLo, oHi);
+        _mm256_storeu_si256((__m256i*)(trail + i), o);
+        __m256i d = n;
+        if (MIX == MIX_MODE_TRAIL) {
+            d = _mm256_blendv_epi8(n, o, channelMask);
+        } else if (MIX == MIX_MODE_BLEND) {
+            __m256i dLo = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(oLo, oldMix), _mm256_mullo_epi16(nLo, mix)), 8);
+            __m256i dHi = _mm256_srli_epi16(_mm256_add_epi16(_mm256_mullo_epi16(oHi, oldMix), _mm256_mullo_epi16(nHi, mix)), 8);
+            d = _mm256_blendv_epi8(n, _mm256_packus_epi16(dLo, dHi), channelMask);
+        }
+        _mm256_storeu_si256((__m256i*)(display + i), d);
+    }
+    feedbackRowFixedSse2<BLEND, TRAIL, MIX>(trail + i, src + i, display + i, count - i, params);
+}
+
+FeedbackRowKernel getFeedbackRowKernelAvx2(bool fixedPoint, FeedbackBlendMode blendMode,
+                                           FeedbackTrailMode trailMode, FeedbackMixMode mixMode)
+{
+    static const FeedbackRowKernel kernels[NUM_BLEND_MODES][NUM_TRAIL_MODES][NUM_MIX_MODES] =
+        FEEDBACK_BLEND_KERNEL_TABLES(feedbackRowAvx2);
+    static const FeedbackRowKernel fixedKernels[NUM_BLEND_MODES][NUM_TRAIL_MODES][NUM_MIX_MODES] =
+        FEEDBACK_BLEND_KERNEL_TABLES(feedbackRowFixedAvx2);
+    return fixedPoint ? fixedKernels[blendMode][trailMode][mixMode] : kernels[blendMode][trailMode][mixMode];
+}
+
+template <FeedbackTrailMode TRAIL>
+AVX2_TARGET static inline __m256i trail16Avx2(__m256i t, __m256i n16, __m256i feedback)
+{
+    if (TRAIL == TRAIL_MODE_REPLACE) {
+        return n16;
+    }
+    if (TRAIL == TRAIL_MODE_DECAY) {
+        t = _mm256_mulhi_epu16(t, feedback);
+    }
+    return _mm256_max_epu16(t, n16);
+}
+
+template <FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+AVX2_TARGET static void feedbackRow16Avx2(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                                          const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i feedback = _mm256_set1_epi16((short)params.feedbackFixed);
+    const __m256i mix = _mm256_set1_epi16((short)(params.newestFrameMixFixed << 8));
+    const __m256i oldMix = _mm256_set1_epi16((short)((256 - params.newestFrameMixFixed) << 8));
+    const __m256i channelMask = _mm256_set1_epi32((int)params.channelMask);
+    int32_t phase = ditherPhase;
+    int32_t i = 0;
+    for ( ; i + 32 <= count ; i += 32) {
+        __m256i n = _mm256_loadu_si256((const __m256i*)(src + i));
+        // unpack works per 128 bit lane: nLo holds bytes 0-7 and 16-23, nHi 8-15 and 24-31
+        __m256i nLo = _mm256_unpacklo_epi8(zero, n);
+        __m256i nHi = _mm256_unpackhi_epi8(zero, n);
+        __m256i tLo = nLo;
+        __m256i tHi = nHi;
+        if (TRAIL != TRAIL_MODE_REPLACE) {
+            // trail bytes 0-15 and 16-31, rearranged into the same lane order
+            __m256i t0 = _mm256_loadu_si256((const __m256i*)(trail + i));
+            __m256i t1 = _mm256_loadu_si256((const __m256i*)(trail + i + 16));
+            tLo = _mm256_permute2x128_si256(t0, t1, 0x20);
+            tHi = _mm256_permute2x128_si256(t0, t1, 0x31);
+        }
+        tLo = trail16Avx2<TRAIL>(tLo, nLo, feedback);
+        tHi = trail16Avx2<TRAIL>(tHi, nHi, feedback);
+        _mm256_storeu_si256((__m256i*)(trail + i), _mm256_permute2x128_si256(tLo, tHi, 0x20));
+        _mm256_storeu_si256((__m256i*)(trail + i + 16), _mm256_permute2x128_si256(tLo, tHi, 0x31));
+        __m256i d = n;
+        if (MIX != MIX_MODE_NEW) {
+            __m256i dLo = tLo;
+            __m256i dHi = tHi;
+            if (MIX == MIX_MODE_BLEND) {
+                dLo = _mm256_add_epi16(_mm256_mulhi_epu16(tLo, oldMix), _mm256_mulhi_epu16(nLo, mix));
+                dHi = _mm256_add_epi16(_mm256_mulhi_epu16(tHi, oldMix), _mm256_mulhi_epu16(nHi, mix));
+            }
+            __m256i th0 = _mm256_loadu_si256((const __m256i*)(dither + phase));
+            __m256i th1 = _mm256_loadu_si256((const __m256i*)(dither + phase + 16));
+            dLo = _mm256_srli_epi16(_mm256_adds_epu16(dLo, _mm256_permute2x128_si256(th0, th1, 0x20)), 8);
+            dHi = _mm256_srli_epi16(_mm256_adds_epu16(dHi, _mm256_permute2x128_si256(th0, th1, 0x31)), 8);
+            d = _mm256_blendv_epi8(n, _mm256_packus_epi16(dLo, dHi), channelMask);
+        }
+        _mm256_storeu_si256((__m256i*)(display + i), d);
+        phase += 32;
+        if (phase >= FEEDBACK_DITHER_PERIOD) {
+            phase -= FEEDBACK_DITHER_PERIOD;
+        }
+    }
+    feedbackRow16Sse2<TRAIL, MIX>(trail + i, src + i, display + i, count - i, dither, phase, params);
+}
+
+FeedbackRow16Kernel getFeedbackRow16KernelAvx2(FeedbackTrailMode trailMode, FeedbackMixMode mixMode)
+{
+    static const FeedbackRow16Kernel kernels[NUM_TRAIL_MODES][NUM_MIX_MODES] = FEEDBACK_KERNEL_TABLE(feedbackRow16Avx2);
+    return kernels[trailMode][mixMode];
+}
+
+AVX2_TARGET static inline __m256i gainedAvx2(__m256i s, __m256i gainHigh, __m256i gainLow)
+{
+    return _mm256_add_epi16(_mm256_mullo_epi16(s, gainHigh), _mm256_mulhi_epu16(s, gainLow));
+}
+
+template <FeedbackTrailMode TRAIL, FeedbackMixMode MIX>
+AVX2_TARGET static void feedbackRowGainAvx2(uint16_t *trail, const uint8_t *src, uint8_t *display, int32_t count,
+                                            const uint16_t *dither, int32_t ditherPhase, const FeedbackRowParams &params)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i gainHigh = _mm256_set1_epi16((short)(params.gainFixed >> 8));
+    const __m256i gainLow = _mm256_set1_epi16((short)((params.gainFixed & 255) << 8));
+    const __m256i inverseGain = _mm256_set1_epi16((short)params.inverseGainFixed);
+    const __m256i mix = _mm256_set1_epi16((short)(params.newestFrameMixFixed << 8));
+    const __m256i oldMix = _mm256_set1_epi16((short)((256 - params.newestFrameMixFixed) << 8));
+    const __m256i channelMask = _mm256_set1_epi32((int)params.channelMask);
+    int32_t phase = ditherPhase;
+    int32_t i = 0;
+    for ( ; i + 32 <= count ; i += 32) {
+        __m256i n = _mm256_loadu_si256((const __m256i*)(src + i));
+        // same lane order as feedbackRow16Avx2
+        __m256i nLo = _mm256_unpacklo_epi8(zero, n);
+        __m256i nHi = _mm256_unpackhi_epi8(zero, n);
+        __m256i tLo = nLo;
+        __m256i tHi = nHi;
+        if (TRAIL == TRAIL_MODE_REPLACE) {
+            __m256i sLo = _mm256_mulhi_epu16(nLo, inverseGain);
+            __m256i sHi = _mm256_mulhi_epu16(nHi, inverseGain);
+            _mm256_storeu_si256((__m256i*)(trail + i), _mm256_permute2x128_si256(sLo, sHi, 0x20));
+            _mm256_storeu_si256((__m256i*)(trail + i + 16), _mm256_permute2x128_si256(sLo, sHi, 0x31));
+        } else {
+            __m256i s0 = _mm256_loadu_si256((const __m256i*)(trail + i));
+            __m256i s1 = _mm256_loadu_si256((const __m256i*)(trail + i + 16));
+            __m256i sLo = _mm256_permute2x128_si256(s0, s1, 0x20);
+            __m256i sHi = _mm256_permute2x128_si256(s0, s1, 0x31);
+            tLo = gainedAvx2(sLo, gainHigh, gainLow);
+            tHi = gainedAvx2(sHi, gainHigh, gainLow);
+            if (!_mm256_testz_si256(n, channelMask)) {
+                __m256i overLo = _mm256_subs_epu16(nLo, tLo);
+                __m256i overHi = _mm256_subs_epu16(nHi, tHi);
+                __m256i keepLo = _mm256_cmpeq_epi16(overLo, zero);
+                __m256i keepHi = _mm256_cmpeq_epi16(overHi, zero);
+                tLo = _mm256_add_epi16(tLo, overLo);
+                tHi = _mm256_add_epi16(tHi, overHi);
+                __m256i wins = _mm256_andnot_si256(_mm256_packs_epi16(keepLo, keepHi), channelMask);
+                if (!_mm256_testz_si256(wins, wins)) {
+                    sLo = _mm256_blendv_epi8(_mm256_mulhi_epu16(nLo, inverseGain), sLo, keepLo);
+                    sHi = _mm256_blendv_epi8(_mm256_mulhi_epu16(nHi, inverseGain), sHi, keepHi);
+                    _mm256_storeu_si256((__m256i*)(trail + i), _mm256_permute2x128_si256(sLo, sHi, 0x20));
+                    _mm256_storeu_si256((__m256i*)(trail + i + 16), _mm256_permute2x128_si256(sLo, sHi, 0x31));
+                }
+            }
+        }
+        __m256i d = n;
+        if (MIX != MIX_MODE_NEW) {
+            __m256i dLo = tLo;
+            __m256i dHi = tHi;
+            if (MIX == MIX_MODE_BLEND) {
+                dLo = _mm256_add_epi16(_mm256_mulhi_epu16(tLo, oldMix), _mm256_mulhi_epu16(nLo, mix));
+                dHi = _mm256_add_epi16(_mm256_mulhi_epu16(tHi, oldMix), _mm256_mulhi_epu16(nHi, mix));
+            }
+            __m256i th0 = _mm256_loadu_si256((const __m256i*)(dither + phase));
+            __m256i th1 = _mm256_loadu_si256((const __m256i*)(dither + phase + 16));
+            dLo = _mm256_srli_epi16(_mm256_adds_epu16(dLo, _mm256_permute2x128_si256(th0, th1, 0x20)), 8);
+            dHi = _mm256_srli_epi16(_mm256_adds_epu16(dHi, _mm256_permute2x128_si256(th0, th1, 0x31)), 8);
+            d = _mm256_blendv_epi8(n, _mm256_packus_epi16(dLo, dHi), channelMask);
+        }
+        _mm256_storeu_si256((__m256i*)(display + i), d);
+        phase += 32;
+        if (phase >= FEEDBACK_DITHER_PERIOD) {
+            phase -= FEEDBACK_DITHER_PERIOD;
+        }
+    }
+    feedbackRowGainSse2<TRAIL, MIX>(trail + i, src + i, display + i, count - i, dither, phase, params);
+}
+
+FeedbackRow16Kernel getFeedbackRowGainKernelAvx2(FeedbackTrailMode trailMode, FeedbackMixMode mixMode)
+{
+    static const FeedbackRow16Kernel kernels[NUM_TRAIL_MODES][NUM_MIX_MODES] = FEEDBACK_KERNEL_TABLE(feedbackRowGainAvx2);
+    return kernels[trailMode][mixMode];
+}
+
+AVX2_TARGET void trailLayersRowAvx2(uint8_t *const *layers, const TrailLayerRowParams *params, int numLayers,
+                                    const uint8_t *src, uint8_t *display, int32_t count, int32_t tintPhase, bool decay)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i feedbacks[MAX_TRAIL_LAYERS];
+    __m256i gates[MAX_TRAIL_LAYERS];
+    for (int l = 0 ; l < numLayers ; l++) {
+        feedbacks[l] = _mm256_set1_epi16((int16_t)params[l].feedbackFixed);
+        gates[l] = _mm256_set1_epi8((char)params[l].gate);
+    }
+    int32_t phase = tintPhase % FEEDBACK_DITHER_PERIOD;
+    int32_t i = 0;
+    for ( ; i + 32 <= count ; i += 32) {
+        const __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+        __m256i d = display != NULL ? _mm256_loadu_si256((const __m256i*)(display + i)) : zero;
+        for (int l = 0 ; l < numLayers ; l++) {
+            __m256i layer = _mm256_loadu_si256((const __m256i*)(layers[l] + i));
+            if (decay) {
+                __m256i lo = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(layer, zero), feedbacks[l]);
+                __m256i hi = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(layer, zero), feedbacks[l]);
+                layer = _mm256_packus_epi16(lo, hi);
+            }
+            const __m256i lit = _mm256_cmpeq_epi8(_mm256_max_epu8(s, gates[l]), s);
+            layer = _mm256_max_epu8(layer, _mm256_and_si256(s, lit));
+            _mm256_storeu_si256((__m256i*)(layers[l] + i), layer);
+            if (display != NULL) {
+                // unpack works per 128 bit lane, so do the tints
+                __m256i t0 = _mm256_loadu_si256((const __m256i*)(params[l].tint + phase));
+                __m256i t1 = _mm256_loadu_si256((const __m256i*)(params[l].tint + phase + 16));
+                __m256i lo = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(zero, layer), _mm256_permute2x128_si256(t0, t1, 0x20));
+                __m256i hi = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(zero, layer), _mm256_permute2x128_si256(t0, t1, 0x31));
+                d = _mm256_max_epu8(d, _mm256_packus_epi16(lo, hi));
+            }
+        }
+        if (display != NULL) {
+            _mm256_storeu_si256((__m256i*)(display + i), d);
+        }
+        phase += 32;
+        if (phase >= FEEDBACK_DITHER_PERIOD) {
+            phase -= FEEDBACK_DITHER_PERIOD;
+        }
+    }
+    uint8_t *rest[MAX_TRAIL_LAYERS];
+    for (int l = 0 ; l < numLayers ; l++) {
+        rest[l] = layers[l] + i;
+    }
+    trailLayersRow(rest, params, numLayers, src + i, display != NULL ? display + i : NULL, count - i, phase, decay);
+}
+
+#endif
@@ -0,0 +1,877 @@
+//
+//  FeedbackProcessor.cpp
+//  Illuminate
+//
+
+#include "FeedbackProcessor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+FeedbackParams::FeedbackParams()
+    : feedback(0.9f), frameSkip(0), blurOn(false), hueModOn(false), huePosition(0.f), newestFrameMix(0.f),
+      integerFeedback(false), highPrecision(false), lazyDecay(false), linearLight(false), batchFrameSkip(false),
+      hueLut(false), hueLutSize(HueLut::DEFAULT_SIZE), numThreads(1), downscale(1),
+      historyDepth(0), historyBudgetMB(512), numEchoTaps(0), displacementDepth(0), displaceColumns(false),
+      numTrailLayers(0), blendMode(BLEND_MODE_LIGHTEN), blendWeight(0.5f),
+      spatialBlurRadius(0), spatialBlurPasses(3), bloomLevels(0), bloomThreshold(0.6f), bloomIntensity(1.f),
+      bloomRadius(4), backgroundSubtraction(false), backgroundThreshold(0.1f), backgroundLearnRate(0.01f),
+      backgroundResets(0), lumaKey(false), lumaKeyThreshold(0.15f), lumaKeyKnee(0.1f), lumaKeyHysteresis(0.05f),
+      motionTrails(false), motionSearch(4), motionAmount(1.f), edgeMode(false), edgeGain(1.f),
+      gradientMap(false), gradientPalette(0), posterizeLevels(0), gradientIntensity(false)
+{
+}
+
+// below this the gain trail can't store a full 255 in 16 bits any more, 256 / gain must fit too
+static const double MIN_TRAIL_GAIN = 1.0 / 255.0;
+
+static inline void rotateHue(uint8_t *pixel, const FrameView &layout, float huePosition)
+{
+    uint8_t &r = pixel[layout.redOffset];
+    uint8_t &g = pixel[layout.greenOffset];
+    uint8_t &b = pixel[layout.blueOffset];
+    float fr = r, fg = g, fb = b;
+    rotateHueExact(fr, fg, fb, huePosition);
+    r = (uint8_t)fr;
+    g = (uint8_t)fg;
+    b = (uint8_t)fb;
+}
+
+// luma of count pixels of src into dst + 1, with the end pixels repeated either side for the Sobel taps
+static inline void edgeLumaRow(uint8_t *dst, const uint8_t *src, int32_t count, int32_t pixelInc, const uint16_t *weights)
+{
+    lumaRow(dst + 1, src, count, pixelInc, weights);
+    dst[0] = dst[1];
+    dst[count + 1] = dst[count];
+}
+
+// Rows y1 to y2 of dst (width pixels of pixelInc values) from the whole frame src, factor times
+// as small box filtered when shrinking, else factor times as big bilinear between the
+// source pixel centres with the edges repeated
+template <typename T>
+static void resampleRows(T *dst, int32_t width, int32_t y1, int32_t y2, const T *src, int32_t srcWidth, int32_t srcHeight,
+                         int32_t pixelInc, int32_t factor, bool shrinking)
+{
+    const size_t stride = (size_t)width * pixelInc;
+    const size_t srcStride = (size_t)srcWidth * pixelInc;
+    if (shrinking) {
+        const uint32_t area = factor * factor;
+        for (int32_t y = y1 ; y < y2 ; y++) {
+            for (int32_t x = 0 ; x < width ; x++) {
+                for (int32_t c = 0 ; c < pixelInc ; c++) {
+                    const T *block = src + (size_t)y * factor * srcStride + (size_t)x * factor * pixelInc + c;
+                    uint32_t sum = area / 2;
+                    for (int32_t j = 0 ; j < factor ; j++) {
+                        for (int32_t i = 0 ; i < factor ; i++) {
+                            sum += block[j * srcStride + i * pixelInc];
+                        }
+                    }
+                    dst[y * stride + x * pixelInc + c] = (T)(sum / area);
+                }
+            }
+        }
+        return;
+    }
+    // pixel x samples the source at (x + 0.5) / factor - 0.5, in 1 / steps
+    const int32_t steps = 2 * factor;
+    for (int32_t y = y1 ; y < y2 ; y++) {
+        const int32_t sy = std::max(2 * y + 1 - factor, 0);
+        const int32_t row0 = std::min(sy / steps, srcHeight - 1);
+        const int32_t row1 = std::min(row0 + 1, srcHeight - 1);
+        const uint32_t fy = sy % steps;
+        for (int32_t x = 0 ; x < width ; x++) {
+            const int32_t sx = std::max(2 * x + 1 - factor, 0);
+            const int32_t column0 = std::min(sx / steps, srcWidth - 1);
+            const int32_t column1 = std::min(column0 + 1, srcWidth - 1);
+            const uint32_t fx = sx % steps;
+            const T *a = src + row0 * srcStride + column0 * pixelInc;
+            const T *b = src + row0 * srcStride + column1 * pixelInc;
+            const T *c = src + row1 * srcStride + column0 * pixelInc;
+            const T *d = src + row1 * srcStride + column1 * pixelInc;
+            for (int32_t i = 0 ; i < pixelInc ; i++) {
+                const uint32_t top = a[i] * (steps - fx) + b[i] * fx;
+                const uint32_t bottom = c[i] * (steps - fx) + d[i] * fx;
+                dst[y * stride + x * pixelInc + i] = (T)((top * (steps - fy) + bottom * fy + steps * steps / 2) / (steps * steps));
+            }
+        }
+    }
+}
+
+// buffer, a whole frame the size of from, resampled in bands to the size of to
+template <typename T>
+static void resampleFrame(std::vector<T> &buffer, const FrameView &from, const FrameView &to, int32_t pixelInc,
+                          int32_t factor, bool shrinking, WorkerPool &pool, int numBands)
+{
+    if (buffer.empty()) {
+        return;
+    }
+    std::vector<T> resampled((size_t)to.width * to.height * pixelInc);
+    pool.run(numBands, [&](int band) {
+        resampleRows(&resampled[0], to.width, WorkerPool::getBandStart(band, numBands, to.height),
+                     WorkerPool::getBandStart(band + 1, numBands, to.height), &buffer[0], from.width, from.height,
+                     pixelInc, factor, shrinking);
+    });
+    buffer.swap(resampled);
+}
+
+FeedbackProcessor::FeedbackProcessor()
+    : mTrailFormat(TRAIL_FORMAT_8BIT), mGain(1.0), mBackgroundResets(0), mRegionFrames(0), mPendingFrames(0),
+      mSkippedFrames(0), mDownscale(1)
+{
+    setKernelIsa(detectKernelIsa());
+}
+
+void FeedbackProcessor::setKernelIsa(KernelIsa isa)
+{
+    mKernelIsa = isKernelIsaSupported(isa) ? isa : detectKernelIsa();
+}
+
+int FeedbackProcessor::getNumBands(int32_t height) const
+{
+    // a few bands per thread so a slow band doesn't hold up the frame
+    const int numThreads = mPool.getNumThreads();
+    if (numThreads == 1) {
+        return 1;
+    }
+    return std::max(std::min(numThreads * BANDS_PER_THREAD, (int)(height / MIN_BAND_ROWS)), 1);
+}
+
+int FeedbackProcessor::getNumStrips(int32_t rowLength) const
+{
+    const int numThreads = mPool.getNumThreads();
+    if (numThreads == 1) {
+        return 1;
+    }
+    return std::max(std::min(numThreads * BANDS_PER_THREAD, (int)(rowLength / MIN_STRIP_BYTES)), 1);
+}
+
+void FeedbackProcessor::reset()
+{
+    mTrail.clear();
+    mTrail16.clear();
+    mTrailView = FrameView();
+    mTrailFormat = TRAIL_FORMAT_8BIT;
+    mPending.clear();
+    mPendingFrames = 0;
+    mHistory.clear();
+    fitLayers(0);
+    mBackground.clear();
+    mKeyState.clear();
+    mAdvected.clear();
+    mMotion.release();
+    mEdgeRows.clear();
+}
+
+void FeedbackProcessor::startTrail(const FrameView &newFrame, const FrameView &display)
+{
+    int32_t rowBytes = newFrame.width * newFrame.pixelInc;
+    mTrail.assign(rowBytes * newFrame.height, 0);
+    mTrailView = FrameView(&mTrail[0], newFrame.width, newFrame.height, rowBytes,
+                           newFrame.pixelInc, newFrame.redOffset, newFrame.greenOffset, newFrame.blueOffset);
+    for (int32_t y = 0 ; y < newFrame.height ; y++) {
+        memcpy(mTrailView.getRow(y), newFrame.getRow(y), rowBytes);
+        memcpy(display.getRow(y), newFrame.getRow(y), rowBytes);
+    }
+    mTrail16.clear();
+    mTrailFormat = TRAIL_FORMAT_8BIT;
+    mPending.resize(mTrail.size());
+    mPendingFrames = 0;
+    fitLayers(0);
+    mRegion = FrameRect(0, 0, newFrame.width, newFrame.height);
+    mDither.resize(4 * 2 * FEEDBACK_DITHER_PERIOD);
+    for (int32_t y = 0 ; y < 4 ; y++) {
+        fillDitherRow(&mDither[y * 2 * FEEDBACK_DITHER_PERIOD], y, newFrame.pixelInc);
+    }
+}
+
+void FeedbackProcessor::rescaleTrail(const FrameView &frame, int downscale, const FeedbackParams &params)
+{
+    const FrameView from = mTrailView;
+    const bool shrinking = downscale > mDownscale;
+    const int32_t factor = shrinking ? downscale / mDownscale : mDownscale / downscale;
+    const int32_t rowBytes = frame.width * frame.pixelInc;
+    const FrameView to(NULL, frame.width, frame.height, rowBytes,
+                       frame.pixelInc, frame.redOffset, frame.greenOffset, frame.blueOffset);
+    const int numBands = getNumBands(frame.height);
+    if (mTrailFormat == TRAIL_FORMAT_8BIT) {
+        resampleFrame(mTrail, from, to, frame.pixelInc, factor, shrinking, mPool, numBands);
+    } else {
+        mTrail.assign((size_t)rowBytes * frame.height, 0);
+        resampleFrame(mTrail16, from, to, frame.pixelInc, factor, shrinking, mPool, numBands);
+    }
+    mTrailView = FrameView(&mTrail[0], frame.width, frame.height, rowBytes,
+                           frame.pixelInc, frame.redOffset, frame.greenOffset, frame.blueOffset);
+    resampleFrame(mPending, from, to, frame.pixelInc, factor, shrinking, mPool, numBands);
+    for (int l = 0 ; l < MAX_TRAIL_LAYERS ; l++) {
+        resampleFrame(mLayers[l], from, to, frame.pixelInc, factor, shrinking, mPool, numBands);
+    }
+    resampleFrame(mBackground, from, to, frame.pixelInc, factor, shrinking, mPool, numBands);
+    resampleFrame(mKeyState, from, to, 1, factor, shrinking, mPool, numBands);
+    // the key kernels only take 0 or 0xff
+    for (size_t i = 0 ; i < mKeyState.size() ; i++) {
+        mKeyState[i] = mKeyState[i] >= 0x80 ? 0xff : 0;
+    }
+    std::vector<uint8_t>().swap(mAdvected);
+
+    // the stored frames go across oldest first, as many as the budget holds at the new size
+    FrameHistory history;
+    history.configure(frame, params.historyDepth, (size_t)std::max(params.historyBudgetMB, 0) << 20);
+    for (int age = std::min(mHistory.getCount(), history.getCapacity()) - 1 ; age >= 0 ; age--) {
+        history.advance();
+        const uint8_t *src = mHistory.getRow(age, 0);
+        uint8_t *dst = history.getRow(0, 0);
+        mPool.run(numBands, [&](int band) {
+            resampleRows(dst, frame.width, WorkerPool::getBandStart(band, numBands, frame.height),
+                         WorkerPool::getBandStart(band + 1, numBands, frame.height), src, from.width, from.height,
+                         (int32_t)frame.pixelInc, factor, shrinking);
+        });
+    }
+    std::swap(mHistory, history);
+
+    // still every pixel the region touched, out to the edge where it reached it
+    if (shrinking) {
+        mRegion = mRegion.scaledDown(factor).clippedTo(frame.width, frame.height);
+    } else {
+        mRegion = FrameRect(mRegion.x1 * factor, mRegion.y1 * factor,
+                            mRegion.x2 == from.width ? frame.width : mRegion.x2 * factor,
+                            mRegion.y2 == from.height ? frame.height : mRegion.y2 * factor);
+    }
+    mDownscale = downscale;
+}
+
+uint32_t FeedbackProcessor::getGainFixed() const
+{
+    return (uint32_t)std::min((int32_t)(mGain * 65536.0 + 0.5), 65536);
+}
+
+void FeedbackProcessor::fitScaledFrame(const FrameView &newFrame, int downscale)
+{
+    const int32_t width = newFrame.width / downscale;
+    const int32_t height = newFrame.height / downscale;
+    FrameView layout(NULL, width, height, width * newFrame.pixelInc,
+                     newFrame.pixelInc, newFrame.redOffset, newFrame.greenOffset, newFrame.blueOffset);
+    if (mScaledView.data != NULL && mScaledView.hasSameLayout(layout)) {
+        return;
+    }
+    mScaled.assign((size_t)layout.rowBytes * height, 0);
+    layout.data = &mScaled[0];
+    mScaledView = layout;
+}
+
+void FeedbackProcessor::downsample(const FrameView &newFrame, int downscale, int32_t y, int32_t x1, int32_t x2)
+{
+    const uint8_t *src = newFrame.getRow(y * downscale) + x1 * downscale * newFrame.pixelInc;
+    downsampleRow(mScaledView.getRow(y) + x1 * newFrame.pixelInc, src, newFrame.rowBytes, x2 - x1, newFrame.pixelInc, downscale);
+}
+
+void FeedbackProcessor::seedTrail(int32_t y, int32_t x1, int32_t x2, const uint8_t *newRow, uint16_t inverseGainFixed)
+{
+    const size_t rowStart = (size_t)y * mTrailView.rowBytes;
+    const int32_t start = x1 * mTrailView.pixelInc;
+    const int32_t end = x2 * mTrailView.pixelInc;
+    if (mTrailFormat == TRAIL_FORMAT_8BIT) {
+        memcpy(&mTrail[rowStart + start], newRow + start, end - start);
+    } else if (mTrailFormat == TRAIL_FORMAT_LINEAR) {
+        const uint16_t *toLinear = getLinearLightTables().toLinear;
+        uint16_t *trailRow = &mTrail16[rowStart];
+        for (int32_t i = start ; i < end ; i++) {
+            trailRow[i] = toLinear[newRow[i]];
+        }
+    } else {
+        uint16_t *trailRow = &mTrail16[rowStart];
+        for (int32_t i = start ; i < end ; i++) {
+            trailRow[i] = mTrailFormat == TRAIL_FORMAT_GAIN
+                        ? (uint16_t)(((uint32_t)newRow[i] << 8) * inverseGainFixed >> 16)
+                        : (uint16_t)(newRow[i] << 8);
+        }
+    }
+    // nothing batched there yet, 0 leaves the trail alone when it is lightened in
+    memset(&mPending[rowStart + start], 0, end - start);
+    for (int l = 0 ; l < MAX_TRAIL_LAYERS && !mLayers[l].empty() ; l++) {
+        memset(&mLayers[l][rowStart + start], 0, end - start);
+    }
+    if (!mBackground.empty()) {
+        seedBackground(y, x1, x2, newRow);
+    }
+    if (!mKeyState.empty()) {
+        memset(&mKeyState[(size_t)y * mTrailView.width + x1], 0, x2 - x1);
+    }
+}
+
+void FeedbackProcessor::seedHistory(int32_t y, int32_t x1, int32_t x2)
+{
+    // the older frames never recorded there, or long ago
+    const int32_t start = x1 * mTrailView.pixelInc;
+    const int32_t length = (x2 - x1) * mTrailView.pixelInc;
+    const uint8_t *newest = mHistory.getRow(0, y) + start;
+    for (int age = 1 ; age < mHistory.getCount() ; age++) {
+        memcpy(mHistory.getRow(age, y) + start, newest, length);
+    }
+}
+
+void FeedbackProcessor::seedBackground(int32_t y, int32_t x1, int32_t x2, const uint8_t *newRow)
+{
+    uint16_t *backgroundRow = &mBackground[(size_t)y * mTrailView.rowBytes];
+    for (int32_t i = x1 * mTrailView.pixelInc ; i < x2 * mTrailView.pixelInc ; i++) {
+        backgroundRow[i] = (uint16_t)(newRow[i] << 8);
+    }
+}
+
+void FeedbackProcessor::fitLayers(int numLayers)
+{
+    for (int l = 0 ; l < MAX_TRAIL_LAYERS ; l++) {
+        if (l >= numLayers) {
+            std::vector<uint8_t>().swap(mLayers[l]);
+        } else if (mLayers[l].size() != mTrail.size()) {
+            // a new layer starts dark and fills up with the frames to come
+            mLayers[l].assign(mTrail.size(), 0);
+        }
+    }
+}
+
+uint8_t* FeedbackProcessor::advectRow(int32_t y, const FrameRect &region, float amount)
+{
+    // each run of a block's pixels comes from where the block was, clamped to the region
+    const int32_t pixelInc = mTrailView.pixelInc;
+    const int32_t blockPixels = MotionField::BLOCK_SIZE * MotionField::PLANE_SCALE;
+    const float scale = MotionField::PLANE_SCALE * amount;
+    const int32_t blockColumns = mMotion.getBlockColumns();
+    const int32_t blockRow = std::min(y / blockPixels, mMotion.getBlockRows() - 1);
+    uint8_t *dst = &mAdvected[(size_t)y * mTrailView.rowBytes];
+    for (int32_t x = region.x1 ; x < region.x2 ; ) {
+        const int32_t blockColumn = std::min(x / blockPixels, blockColumns - 1);
+        const int32_t end = blockColumn == blockColumns - 1 ? region.x2 : std::min((blockColumn + 1) * blockPixels, region.x2);
+        const int8_t *vector = mMotion.getVector(blockColumn, blockRow);
+        const int32_t dx = (int32_t)floorf(vector[0] * scale + 0.5f);
+        const int32_t dy = (int32_t)floorf(vector[1] * scale + 0.5f);
+        const uint8_t *src = mTrailView.getRow(std::min(std::max(y + dy, region.y1), region.y2 - 1));
+        const int32_t x1 = std::min(std::max(x + dx, region.x1), region.x2);
+        const int32_t x2 = std::min(std::max(end + dx, region.x1), region.x2);
+        // pixels from left / right of the region repeat its edge
+        for (int32_t i = x ; i < std::min(x1 - dx, end) ; i++) {
+            memcpy(dst + i * pixelInc, src + region.x1 * pixelInc, pixelInc);
+        }
+        if (x1 < x2) {
+            memcpy(dst + (x1 - dx) * pixelInc, src + x1 * pixelInc, (x2 - x1) * pixelInc);
+        }
+        for (int32_t i = std::max(x2 - dx, x) ; i < end ; i++) {
+            memcpy(dst + i * pixelInc, src + (region.x2 - 1) * pixelInc, pixelInc);
+        }
+        x = end;
+    }
+    return dst + region.x1 * pixelInc;
+}
+
+void FeedbackProcessor::displaceRow(uint8_t *row, int32_t y, const FrameRect &region, int depth, int maxAge, bool columns)
+{
+    // frames the history doesn't have show the oldest one it has
+    const int32_t pixelInc = mTrailView.pixelInc;
+    if (!columns) {
+        const int age = std::min((int)((int64_t)y * depth / mTrailView.height), maxAge);
+        if (age > 0) {
+            memcpy(row + region.x1 * pixelInc, mHistory.getRow(age, y) + region.x1 * pixelInc, region.getWidth() * pixelInc);
+        }
+        return;
+    }
+    // one run per age, column x is (x * depth / width) frames old
+    const int32_t width = mTrailView.width;
+    for (int age = 1 ; age <= maxAge ; age++) {
+        const int32_t x1 = std::max((int32_t)(((int64_t)age * width + depth - 1) / depth), region.x1);
+        const int32_t x2 = age == maxAge ? region.x2
+                         : std::min((int32_t)(((int64_t)(age + 1) * width + depth - 1) / depth), region.x2);
+        if (x1 < x2) {
+            memcpy(row + x1 * pixelInc, mHistory.getRow(age, y) + x1 * pixelInc, (x2 - x1) * pixelInc);
+        }
+    }
+}
+
+void FeedbackProcessor::convertTrail(TrailFormat format)
+{
+    const size_t size = mTrail.size();
+    // through value * 256 in mTrail16 first
+    if (mTrailFormat == TRAIL_FORMAT_8BIT) {
+        mTrail16.resize(size);
+        for (size_t i = 0 ; i < size ; i++) {
+            mTrail16[i] = (uint16_t)(mTrail[i] << 8);
+        }
+    } else if (mTrailFormat == TRAIL_FORMAT_GAIN) {
+        const uint32_t gain = getGainFixed();
+        for (size_t i = 0 ; i < size ; i++) {
+            mTrail16[i] = (uint16_t)((mTrail16[i] * gain) >> 8);
+        }
+    } else if (mTrailFormat == TRAIL_FORMAT_LINEAR) {
+        const uint16_t *fromLinear = getLinearLightTables().fromLinear;
+        for (size_t i = 0 ; i < size ; i++) {
+            mTrail16[i] = fromLinear[mTrail16[i] >> LINEAR_LIGHT_SHIFT];
+        }
+    }
+    if (format == TRAIL_FORMAT_8BIT) {
+        for (size_t i = 0 ; i < size ; i++) {
+            mTrail[i] = (uint8_t)(mTrail16[i] >> 8);
+        }
+        mTrail16.clear();
+    } else if (format == TRAIL_FORMAT_GAIN) {
+        for (size_t i = 0 ; i < size ; i++) {
+            mTrail16[i] = (uint16_t)((mTrail16[i] + 128) >> 8);
+        }
+        mGain = 1.0;
+    } else if (format == TRAIL_FORMAT_LINEAR) {
+        // the levels between two 8 bit steps go, they are dithered away on display anyway
+        const uint16_t *toLinear = getLinearLightTables().toLinear;
+        for (size_t i = 0 ; i < size ; i++) {
+            mTrail16[i] = toLinear[std::min((mTrail16[i] + 128) >> 8, 255)];
+        }
+    }
+    mTrailFormat = format;
+}
+
+void FeedbackProcessor::renormaliseGain(int32_t height)
+{
+    // the stored values become plain 8 bit values again, the one place this format rounds
+    const uint32_t gain = getGainFixed();
+    const int32_t rowLength = mTrailView.rowBytes;
+    const int numBands = getNumBands(height);
+    mPool.run(numBands, [&](int band) {
+        const int32_t bandEnd = WorkerPool::getBandStart(band + 1, numBands, height);
+        for (int32_t y = WorkerPool::getBandStart(band, numBands, height) ; y < bandEnd ; y++) {
+            uint16_t *row = &mTrail16[(size_t)y * rowLength];
+            for (int32_t i = 0 ; i < rowLength ; i++) {
+                row[i] = (uint16_t)((row[i] * gain + 32768) >> 16);
+            }
+        }
+    });
+    mGain = 1.0;
+}
+
+bool FeedbackProcessor::process(const FrameView &newFrame, const FrameView &display, const FeedbackParams &params)
+{
+    if (++mSkippedFrames >= params.frameSkip) {
+        mSkippedFrames = 0;
+    }
+    // the effect runs on frame, newFrame itself or a scaled down copy of it
+    const int downscale = std::max(params.downscale, 1);
+    FrameView frame = newFrame;
+    if (downscale > 1) {
+        fitScaledFrame(newFrame, downscale);
+        frame = mScaledView;
+    }
+    mPool.setNumThreads(params.numThreads);
+    // a new processing scale for the same capture (the governor stepping it) carries
+    // on with everything resampled, only anything else starts over
+    const FrameView trailSource(NULL, newFrame.width / mDownscale, newFrame.height / mDownscale, 0,
+                                frame.pixelInc, frame.redOffset, frame.greenOffset, frame.blueOffset);
+    if (hasTrail() && downscale != mDownscale && mTrailView.hasSameLayout(trailSource)) {
+        rescaleTrail(frame, downscale, params);
+    }
+    if (!hasTrail() || !mTrailView.hasSameLayout(frame)) {
+        for (int32_t y = 0 ; downscale > 1 && y < frame.height ; y++) {
+            downsample(newFrame, downscale, y, 0, frame.width);
+        }
+        startTrail(frame, display);
+        mDownscale = downscale;
+        mHistory.clear();
+        if (params.motionTrails) {
+            // the frame the next one is matched against
+            mMotion.estimate(newFrame, downscale, params.motionSearch, mPool);
+        }
+        return true;
+    }
+    const TrailFormat trailFormat = params.linearLight ? TRAIL_FORMAT_LINEAR
+                                  : params.lazyDecay ? TRAIL_FORMAT_GAIN
+                                  : (params.highPrecision ? TRAIL_FORMAT_16BIT : TRAIL_FORMAT_8BIT);
+    if (trailFormat != mTrailFormat) {
+        convertTrail(trailFormat);
+    }
+    const bool fixedPoint = params.integerFeedback || mTrailFormat != TRAIL_FORMAT_8BIT;
+
+    FeedbackRowParams rowParams = FeedbackRowParams();
+    // feedback, using curve as applied to input number
+    rowParams.feedback = powf(params.feedback, 1.f / 3.f); // cube root, more values closer to 1.f
+    rowParams.newestFrameMix = params.newestFrameMix;
+    rowParams.blurOn = params.blurOn;
+    rowParams.decay = mSkippedFrames == 0 && rowParams.feedback != 1.f; // 100% feedback on skipped frames
+    rowParams.channelMask = frame.getChannelMask();
+    // the 16 bit trails only lighten
+    rowParams.blendMode = mTrailFormat == TRAIL_FORMAT_8BIT ? params.blendMode : BLEND_MODE_LIGHTEN;
+    rowParams.blendWeightFixed = (uint16_t)std::min(std::max((int32_t)(params.blendWeight * 256.f + 0.5f), 0), 256);
+    rowParams.linearLight = &getLinearLightTables();
+    if (fixedPoint) {
+        const int32_t feedbackFixed = (int32_t)(rowParams.feedback * 65536.f + 0.5f);
+        if (feedbackFixed >= 65536) {
+            rowParams.decay = false;
+        }
+        rowParams.feedbackFixed = (uint16_t)std::min(std::max(feedbackFixed, 0), 65535);
+        rowParams.newestFrameMixFixed = (uint16_t)std::min(std::max((int32_t)(params.newestFrameMix * 256.f + 0.5f), 0), 256);
+    }
+
+    // Batched frame skip: the skipped frames of a window only go into mPending, the
+    // last frame of the window (the one that decays) lightens them into the trail
+    // first. That is one merge and one decay per window instead of a full pass per frame.
+    // (only the same as every frame for lighten, max merges in any order)
+    const bool batching = params.batchFrameSkip && params.blurOn && params.frameSkip > 1
+                        && rowParams.blendMode == BLEND_MODE_LIGHTEN;
+    const bool merging = batching && mSkippedFrames != 0;
+    const bool flushing = !merging && mPendingFrames > 0;
+    FeedbackRowParams flushParams = rowParams;
+    // the vector kernels' tails go by the flags, keep them in line with TRAIL_MODE_LIGHTEN
+    // and MIX_MODE_NEW, the layers lighten in pending after the trail
+    flushParams.decay = false;
+    flushParams.blendMode = BLEND_MODE_LIGHTEN;
+    flushParams.newestFrameMix = 1.f;
+    flushParams.newestFrameMixFixed = 256;
+
+    if (mTrailFormat == TRAIL_FORMAT_GAIN) {
+        if (!params.blurOn) {
+            // every stored value gets rewritten this frame
+            mGain = 1.0;
+        } else if (rowParams.decay && mGain * rowParams.feedback < MIN_TRAIL_GAIN) {
+            renormaliseGain(frame.height);
+        }
+        // pending frames are lightened in (and new trail seeded) at the gain from before this frame's decay
+        flushParams.gainFixed = getGainFixed();
+        flushParams.inverseGainFixed = (uint16_t)std::min((int32_t)(256.0 / mGain + 0.5), 65535);
+        if (params.blurOn && rowParams.decay) {
+            mGain *= rowParams.feedback;
+        }
+        rowParams.gainFixed = getGainFixed();
+        rowParams.inverseGainFixed = (uint16_t)std::min((int32_t)(256.0 / mGain + 0.5), 65535);
+    }
+    // flags are fixed for the frame, pick the kernel built for exactly this combination
+    const FeedbackTrailMode trailMode = getFeedbackTrailMode(rowParams);
+    const FeedbackMixMode mixMode = getFeedbackMixMode(rowParams, fixedPoint);
+    const FeedbackRowKernel rowKernel = getFeedbackRowKernel(mKernelIsa, params.integerFeedback, rowParams.blendMode,
+                                                             trailMode, mixMode);
+    const FeedbackRow16Kernel row16Kernel = mTrailFormat == TRAIL_FORMAT_LINEAR
+                                          ? getFeedbackRowLinearKernel(mKernelIsa, trailMode, mixMode)
+                                          : mTrailFormat == TRAIL_FORMAT_GAIN
+                                          ? getFeedbackRowGainKernel(mKernelIsa, trailMode, mixMode)
+                                          : getFeedbackRow16Kernel(mKernelIsa, trailMode, mixMode);
+    // the pending frames arrived before this frame's decay, the same lighten the
+    // skipped frames would have done: trail = max(trail, pending), with MIX_MODE_NEW
+    // pending is its own display and stays as it is
+    const FeedbackRowKernel flushKernel = getFeedbackRowKernel(mKernelIsa, params.integerFeedback, BLEND_MODE_LIGHTEN,
+                                                               TRAIL_MODE_LIGHTEN, MIX_MODE_NEW);
+    const FeedbackRow16Kernel flush16Kernel = mTrailFormat == TRAIL_FORMAT_LINEAR
+                                            ? getFeedbackRowLinearKernel(mKernelIsa, TRAIL_MODE_LIGHTEN, MIX_MODE_NEW)
+                                            : mTrailFormat == TRAIL_FORMAT_GAIN
+                                            ? getFeedbackRowGainKernel(mKernelIsa, TRAIL_MODE_LIGHTEN, MIX_MODE_NEW)
+                                            : getFeedbackRow16Kernel(mKernelIsa, TRAIL_MODE_LIGHTEN, MIX_MODE_NEW);
+    const int32_t rowLength = frame.width * frame.pixelInc;
+    const FrameRect region = (downscale > 1 ? params.region.scaledDown(downscale) : params.region).clippedTo(frame.width, frame.height);
+    const FrameRect &oldRegion = mRegion;
+    const int32_t regionStart = region.x1 * frame.pixelInc;
+    const int32_t regionLength = region.getWidth() * frame.pixelInc;
+    const int32_t ditherPhase = regionStart % FEEDBACK_DITHER_PERIOD;
+    const bool hueLut = params.hueModOn && params.hueLut;
+    const bool hueExact = params.hueModOn && !params.hueLut;
+    if (hueLut) {
+        mHueLut.setSize(params.hueLutSize);
+        mHueLut.update(params.huePosition);
+    }
+
+    // trail layers, lit only while the trail is
+    const int numLayers = params.blurOn ? std::min(std::max(params.numTrailLayers, 0), MAX_TRAIL_LAYERS) : 0;
+    const bool layerDecay = mSkippedFrames == 0;
+    const TrailLayersKernel layersKernel = getTrailLayersKernel(mKernelIsa);
+    fitLayers(numLayers);
+    TrailLayerRowParams layerParams[MAX_TRAIL_LAYERS];
+    mLayerTints.resize(MAX_TRAIL_LAYERS * 2 * FEEDBACK_DITHER_PERIOD);
+    for (int l = 0 ; l < numLayers ; l++) {
+        const TrailLayer &layer = params.trailLayers[l];
+        // the same curve as the main trail
+        const int32_t feedbackFixed = (int32_t)(powf(std::min(std::max(layer.feedback, 0.f), 1.f), 1.f / 3.f) * 65536.f + 0.5f);
+        layerParams[l].feedbackFixed = (uint16_t)std::min(feedbackFixed, 65535);
+        layerParams[l].gate = (uint8_t)std::min(std::max((int32_t)(layer.gate * 255.f + 0.5f), 0), 255);
+        const float tints[3] = { layer.tintRed, layer.tintGreen, layer.tintBlue };
+        const uint8_t offsets[3] = { frame.redOffset, frame.greenOffset, frame.blueOffset };
+        uint16_t *tint = &mLayerTints[l * 2 * FEEDBACK_DITHER_PERIOD];
+        for (int i = 0 ; i < 2 * FEEDBACK_DITHER_PERIOD ; i++) {
+            const int channel = (i % FEEDBACK_DITHER_PERIOD) % frame.pixelInc;
+            tint[i] = 0;
+            for (int c = 0 ; c < 3 ; c++) {
+                if (channel == offsets[c]) {
+                    tint[i] = (uint16_t)std::min(std::max((int32_t)(tints[c] * 256.f + 0.5f), 0), 256);
+                }
+            }
+        }
+        layerParams[l].tint = tint;
+    }
+
+    // this frame goes into the history, the echo taps and the time displacement read older ones
+    mHistory.configure(frame, params.historyDepth, (size_t)std::max(params.historyBudgetMB, 0) << 20);
+    mHistory.advance();
+    const bool recording = mHistory.getCapacity() > 0;
+    // where the region grew the older frames only hold this one, the time displacement
+    // doesn't go further back than the region has been this size
+    if (region.x1 < oldRegion.x1 || region.y1 < oldRegion.y1 || region.x2 > oldRegion.x2 || region.y2 > oldRegion.y2) {
+        mRegionFrames = 0;
+    }
+    mRegionFrames = std::min(mRegionFrames + 1, mHistory.getCount());
+    const int displacementAge = std::min(params.displacementDepth, mRegionFrames) - 1;
+    const bool displacing = params.displacementDepth > 1 && displacementAge > 0;
+    int numEchoTaps = 0;
+    int echoAges[MAX_ECHO_TAPS];
+    uint16_t echoWeights[MAX_ECHO_TAPS];
+    int32_t echoWeightSum = 0;
+    for (int t = 0 ; t < std::min(params.numEchoTaps, MAX_ECHO_TAPS) ; t++) {
+        const EchoTap &tap = params.echoTaps[t];
+        const int32_t weight = std::min((int32_t)(std::min(std::max(tap.weight, 0.f), 1.f) * 256.f + 0.5f), 256 - echoWeightSum);
+        if (tap.age < 1 || tap.age >= mHistory.getCount() || weight == 0) {
+            continue;
+        }
+        echoAges[numEchoTaps] = tap.age;
+        echoWeights[numEchoTaps++] = (uint16_t)weight;
+        echoWeightSum += weight;
+    }
+
+    // the background is learnt from scratch when asked to, or when it doesn't fit the frame
+    bool learningBackground = false;
+    if (!params.backgroundSubtraction) {
+        std::vector<uint16_t>().swap(mBackground);
+    } else if (mBackground.size() != mTrail.size() || params.backgroundResets != mBackgroundResets) {
+        mBackground.resize(mTrail.size());
+        mBackgroundResets = params.backgroundResets;
+        learningBackground = true;
+    }
+    const uint8_t backgroundThreshold = (uint8_t)std::min(std::max((int32_t)(params.backgroundThreshold * 255.f + 0.5f), 0), 255);
+    const uint16_t backgroundLearnFixed = (uint16_t)std::min(std::max((int32_t)(params.backgroundLearnRate * 65536.f + 0.5f), 0), 65535);
+
+    // luma key
+    LumaKeyRowParams keyParams;
+    if (!params.lumaKey) {
+        std::vector<uint8_t>().swap(mKeyState);
+    } else {
+        if (mKeyState.size() != (size_t)frame.width * frame.height) {
+            mKeyState.assign((size_t)frame.width * frame.height, 0);
+        }
+        keyParams.threshold = (uint8_t)std::min(std::max((int32_t)(params.lumaKeyThreshold * 255.f + 0.5f), 0), 255);
+        keyParams.kneeWidth = (uint8_t)std::min(std::max((int32_t)(params.lumaKeyKnee * 255.f + 0.5f), 0), 255);
+        keyParams.hysteresis = (uint8_t)std::min(std::max((int32_t)(params.lumaKeyHysteresis * 255.f + 0.5f), 0), 255);
+        frame.getLumaWeights(keyParams.lumaWeights);
+    }
+
+    // motion of the whole frame before the band loop changes it, the trail moves along
+    // it while the rows go through (into mAdvected, the trail rows stay as they were
+    // for the other bands to read)
+    if (!params.motionTrails) {
+        mMotion.release();
+        std::vector<uint8_t>().swap(mAdvected);
+    } else {
+        mMotion.estimate(newFrame, downscale, params.motionSearch, mPool);
+    }
+    const bool advecting = params.motionTrails && params.blurOn && mTrailFormat == TRAIL_FORMAT_8BIT && !merging
+                         && mMotion.getBlockRows() > 0 && region.x1 == oldRegion.x1 && region.y1 == oldRegion.y1
+                         && region.x2 == oldRegion.x2 && region.y2 == oldRegion.y2;
+    if (advecting && mAdvected.size() != mTrail.size()) {
+        mAdvected.resize(mTrail.size());
+    }
+    const float motionAmount = std::min(std::max(params.motionAmount, 0.f), 2.f);
+
+    // gradient map, the palette goes into the table in this frame's layout
+    if (params.gradientMap) {
+        const GradientMap &palettes = params.gradientPalettes ? *params.gradientPalettes : mBuiltInPalettes;
+        palettes.fillTable(mGradientTable, params.gradientPalette, params.posterizeLevels, frame);
+    }
+
+    // rows are independent, each band runs the whole per row chain
+    const int numBands = getNumBands(region.getHeight());
+
+    // Sobel edges from a rolling window of 3 luma rows per band. The rows just outside
+    // a band belong to another one, which changes them in place, so their luma is
+    // taken from the frame as it came in before the bands start.
+    const bool edges = params.edgeMode && !region.isEmpty();
+    const size_t edgeStride = (size_t)frame.width + 2;
+    const size_t edgeBandBytes = 5 * edgeStride + rowLength;
+    const uint16_t edgeGainFixed = (uint16_t)std::min(std::max((int32_t)(params.edgeGain * 8.f + 0.5f), 0), 32);
+    uint16_t lumaWeights[4];
+    frame.getLumaWeights(lumaWeights);
+    if (!edges) {
+        std::vector<uint8_t>().swap(mEdgeRows);
+    } else {
+        if (mEdgeRows.size() < edgeBandBytes * numBands) {
+            mEdgeRows.resize(edgeBandBytes * numBands);
+        }
+        mPool.run(numBands, [&](int band) {
+            uint8_t *edgeRows = &mEdgeRows[band * edgeBandBytes];
+            const int32_t bandStart = region.y1 + WorkerPool::getBandStart(band, numBands, region.getHeight());
+            const int32_t bandEnd = region.y1 + WorkerPool::getBandStart(band + 1, numBands, region.getHeight());
+            const int32_t outside[2] = { std::max(bandStart - 1, 0), std::min(bandEnd, frame.height - 1) };
+            for (int i = 0 ; i < 2 ; i++) {
+                const uint8_t *src = newFrame.getRow(outside[i]) + regionStart;
+                if (downscale > 1) {
+                    uint8_t *scratch = edgeRows + 5 * edgeStride;
+                    downsampleRow(scratch, newFrame.getRow(outside[i] * downscale) + regionStart * downscale,
+                                  newFrame.rowBytes, region.getWidth(), frame.pixelInc, downscale);
+                    src = scratch;
+                }
+                edgeLumaRow(edgeRows + (3 + i) * edgeStride, src, region.getWidth(), frame.pixelInc, lumaWeights);
+            }
+        });
+    }
+    const int blurRadius = params.blurOn && mTrailFormat == TRAIL_FORMAT_8BIT && !merging
+                         ? params.spatialBlurRadius / downscale : 0;
+    mBlur.configure(blurRadius, params.spatialBlurPasses, rowLength, frame.pixelInc, numBands);
+    const bool blurring = mBlur.getRadius() > 0;
+    mPool.run(numBands, [&](int band) {
+        const int32_t bandStart = region.y1 + WorkerPool::getBandStart(band, numBands, region.getHeight());
+        const int32_t bandEnd = region.y1 + WorkerPool::getBandStart(band + 1, numBands, region.getHeight());
+        uint8_t *edgeRows = edges ? &mEdgeRows[band * edgeBandBytes] : NULL;
+        for (int32_t y = bandStart ; y < bandEnd ; y++) {
+            // the edges need the next row as it came in, scaled down one row ahead
+            if (downscale > 1 && (!edges || y == bandStart)) {
+                downsample(newFrame, downscale, y, region.x1, region.x2);
+            }
+            if (downscale > 1 && edges && y + 1 < bandEnd) {
+                downsample(newFrame, downscale, y + 1, region.x1, region.x2);
+            }
+            uint8_t *newRow = frame.getRow(y);
+            if (edges) {
+                uint8_t *luma = edgeRows + (y % 3) * edgeStride;
+                if (y == bandStart) {
+                    edgeLumaRow(luma, newRow + regionStart, region.getWidth(), frame.pixelInc, lumaWeights);
+                }
+                const uint8_t *above = y == bandStart ? edgeRows + 3 * edgeStride : edgeRows + ((y - 1) % 3) * edgeStride;
+                const uint8_t *below = edgeRows + 4 * edgeStride;
+                if (y + 1 < bandEnd) {
+                    uint8_t *next = edgeRows + ((y + 1) % 3) * edgeStride;
+                    edgeLumaRow(next, frame.getRow(y + 1) + regionStart, region.getWidth(), frame.pixelInc, lumaWeights);
+                    below = next;
+                }
+                sobelRow(newRow + regionStart, above, luma, below, region.getWidth(), frame.pixelInc,
+                         edgeGainFixed, rowParams.channelMask);
+            }
+            if (hueLut) {
+                mHueLut.apply(newRow + regionStart, region.getWidth(), frame.pixelInc,
+                              frame.redOffset, frame.greenOffset, frame.blueOffset);
+            } else if (hueExact) {
+                uint8_t *newPixel = newRow + regionStart;
+                for (int32_t x = region.x1 ; x < region.x2 ; x++) {
+                    rotateHue(newPixel, frame, params.huePosition);
+                    newPixel += frame.pixelInc;
+                }
+            }
+            // parts of the region that weren't processed last frame, x1 / x2 pairs
+            int32_t seeds[4];
+            int numSeeds = 0;
+            if (y < oldRegion.y1 || y >= oldRegion.y2) {
+                seeds[numSeeds++] = region.x1;
+                seeds[numSeeds++] = region.x2;
+            } else {
+                if (region.x1 < oldRegion.x1) {
+                    seeds[numSeeds++] = region.x1;
+                    seeds[numSeeds++] = std::min(region.x2, oldRegion.x1);
+                }
+                if (region.x2 > oldRegion.x2) {
+                    seeds[numSeeds++] = std::max(region.x1, oldRegion.x2);
+                    seeds[numSeeds++] = region.x2;
+                }
+            }
+            if (recording) {
+                memcpy(mHistory.getRow(0, y) + regionStart, newRow + regionStart, regionLength);
+                for (int i = 0 ; i < numSeeds ; i += 2) {
+                    seedHistory(y, seeds[i], seeds[i + 1]);
+                }
+            }
+            // Whole runs of a row come from one past frame, the same row of it, so a
+            // band reads each frame's rows in order instead of gathering pixel by pixel.
+            if (displacing) {
+                displaceRow(newRow, y, region, params.displacementDepth, displacementAge, params.displaceColumns);
+            }
+            for (int i = 0 ; i < numSeeds ; i += 2) {
+                seedTrail(y, seeds[i], seeds[i + 1], newRow, flushParams.inverseGainFixed);
+            }
+            if (params.backgroundSubtraction) {
+                if (learningBackground) {
+                    seedBackground(y, region.x1, region.x2, newRow);
+                }
+                subtractBackgroundRow(newRow + regionStart, &mBackground[(size_t)y * rowLength] + regionStart, regionLength,
+                                      frame.pixelInc, backgroundThreshold, backgroundLearnFixed, rowParams.channelMask);
+            }
+            if (params.lumaKey) {
+                lumaKeyRow(newRow + regionStart, &mKeyState[(size_t)y * frame.width + region.x1], regionLength,
+                           frame.pixelInc, keyParams);
+            }
+            uint8_t *pendingRow = &mPending[(size_t)y * rowLength] + regionStart;
+            newRow += regionStart;
+            if (merging) {
+                if (mPendingFrames == 0) {
+                    memcpy(pendingRow, newRow, regionLength);
+                } else {
+                    maxBytes(pendingRow, newRow, regionLength);
+                }
+                continue;
+            }
+            uint8_t *displayRow = display.getRow(y) + regionStart;
+            if (mTrailFormat != TRAIL_FORMAT_8BIT) {
+                uint16_t *trailRow = &mTrail16[(size_t)y * rowLength] + regionStart;
+                const uint16_t *dither = &mDither[(y & 3) * 2 * FEEDBACK_DITHER_PERIOD];
+                if (flushing) {
+                    flush16Kernel(trailRow, pendingRow, pendingRow, regionLength, dither, ditherPhase, flushParams);
+                }
+                row16Kernel(trailRow, newRow, displayRow, regionLength, dither, ditherPhase, rowParams);
+            } else {
+                uint8_t *trailRow = advecting ? advectRow(y, region, motionAmount) : mTrailView.getRow(y) + regionStart;
+                if (flushing) {
+                    flushKernel(trailRow, pendingRow, pendingRow, regionLength, flushParams);
+                }
+                rowKernel(trailRow, newRow, displayRow, regionLength, rowParams);
+                if (blurring) {
+                    // the rows while they are in cache, the columns once every row is done
+                    mBlur.blurRow(band, trailRow, region.getWidth());
+                }
+            }
+            if (numLayers > 0) {
+                // all layers in one go, against the display row the trail just wrote
+                uint8_t *layerRows[MAX_TRAIL_LAYERS];
+                for (int l = 0 ; l < numLayers ; l++) {
+                    layerRows[l] = &mLayers[l][(size_t)y * rowLength] + regionStart;
+                }
+                if (flushing) {
+                    layersKernel(layerRows, layerParams, numLayers, pendingRow, NULL, regionLength, ditherPhase, false);
+                }
+                layersKernel(layerRows, layerParams, numLayers, newRow, displayRow, regionLength, ditherPhase, layerDecay);
+            }
+            if (numEchoTaps > 0) {
+                // while the display row is still in cache
+                const uint8_t *taps[MAX_ECHO_TAPS];
+                for (int t = 0 ; t < numEchoTaps ; t++) {
+                    taps[t] = mHistory.getRow(echoAges[t], y) + regionStart;
+                }
+                echoRow(displayRow, taps, echoWeights, numEchoTaps, regionLength, rowParams.channelMask);
+            }
+            if (params.gradientMap) {
+                gradientMapRow(displayRow, region.getWidth(), frame.pixelInc, mGradientTable,
+                               params.gradientIntensity ? NULL : lumaWeights, rowParams.channelMask);
+            }
+        }
+    });
+    if (advecting) {
+        // outside the region mAdvected is stale, the trail is there too
+        mTrail.swap(mAdvected);
+        mTrailView.data = &mTrail[0];
+    }
+    if (blurring) {
+        // strips of whole columns, 16 byte aligned so only the last one has a scalar tail
+        const int numStrips = getNumStrips(regionLength);
+        mPool.run(numStrips, [&](int strip) {
+            const int32_t start = WorkerPool::getBandStart(strip, numStrips, regionLength) & ~15;
+            const int32_t end = strip + 1 == numStrips ? regionLength
+                              : (WorkerPool::getBandStart(strip + 1, numStrips, regionLength) & ~15);
+            mBlur.blurColumns(mTrailView, region.y1, region.y2, regionStart + start, regionStart + end);
+        });
+    }
+    if (params.bloomLevels <= 0) {
+        mBloom.release();
+    } else if (!merging) {
+        const uint8_t threshold = (uint8_t)std::min(std::max((int32_t)(params.bloomThreshold * 255.f + 0.5f), 0), 255);
+        mBloom.apply(display, region, params.bloomLevels, threshold, params.bloomRadius, params.bloomIntensity, mPool);
+    }
+    mRegion = region;
+    if (merging) {
+        mPendingFrames++;
+        return false;
+    }
+    mPendingFrames = 0;
+    return true;
+}
@@ -0,0 +1,257 @@
+//
+//  FeedbackProcessor.h
+//  Illuminate
+//
+//  Feedback / lighten / hue rotation / newest frame mix effect, independent of
+//  the app window and capture so it can be profiled and run headless.
+//
+
+#ifndef FeedbackProcessor_h
+#define FeedbackProcessor_h
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "Bloom.h"
+#include "BoxBlur.h"
+#include "FeedbackKernels.h"
+#include "FrameHistory.h"
+#include "FrameView.h"
+#include "GradientMap.h"
+#include "HueLut.h"
+#include "MotionField.h"
+#include "WorkerPool.h"
+
+// past frame blended into display, see FeedbackParams::echoTaps
+struct EchoTap {
+    int         age;                // frames back, 1 is the frame before this one
+    float       weight;             // share of the output, 0-1
+
+    EchoTap() : age(1), weight(0.f) {}
+};
+
+// extra trail over the main one, see FeedbackParams::trailLayers
+struct TrailLayer {
+    float       feedback;           // like FeedbackParams::feedback
+    float       gate;               // 0-1, darker new frame channels don't light the layer
+    float       tintRed;            // 0-1, the layer shows this much of its light
+    float       tintGreen;
+    float       tintBlue;
+
+    TrailLayer() : feedback(0.98f), gate(0.f), tintRed(0.5f), tintGreen(0.5f), tintBlue(0.5f) {}
+};
+
+// Effect parameters, sampled once per frame from the app controls
+struct FeedbackParams {
+    float       feedback;
+    int         frameSkip;
+    bool        blurOn;
+    bool        hueModOn;
+    float       huePosition;
+    float       newestFrameMix;
+    bool        integerFeedback;    // 8/16 bit fixed point kernels instead of float
+    bool        highPrecision;      // 16 bit trail with dithered output, for feedback close to 1
+    bool        lazyDecay;          // 16 bit trail relative to a global gain, decay never touches the trail
+    bool        linearLight;        // 16 bit trail in linear light, over highPrecision and lazyDecay, see process()
+    bool        batchFrameSkip;     // skipped frames only merged into a pending buffer, see process()
+    bool        hueLut;             // hue rotation through the HueLut cube instead of exact HSV
+    int         hueLutSize;         // grid points per axis of that cube
+    FrameRect   region;             // only this part of the frame is processed, see process()
+    int         numThreads;         // band threads including the caller, 0 = one per hardware thread
+    int         downscale;          // 1, 2 or 4, the effect runs on a box filtered copy 1 / downscale the size
+    int         historyDepth;       // past frames kept for the echo, 0 keeps none
+    int         historyBudgetMB;    // the history keeps fewer frames rather than use more memory
+    int         numEchoTaps;        // up to MAX_ECHO_TAPS, taps older than the history are left out
+    EchoTap     echoTaps[MAX_ECHO_TAPS];
+    int         displacementDepth;  // time displacement, rows go from the newest frame to depth - 1 frames back, 0 or 1 is off
+    bool        displaceColumns;    // across the columns instead, left newest
+    int         numTrailLayers;     // up to MAX_TRAIL_LAYERS, only while blurOn
+    TrailLayer  trailLayers[MAX_TRAIL_LAYERS];
+    FeedbackBlendMode blendMode;    // how the new frame goes into the 8 bit trail, the 16 bit trails lighten
+    float       blendWeight;        // BLEND_MODE_AVERAGE share of the new frame
+    int         spatialBlurRadius;  // box blur of the 8 bit trail, in newFrame pixels up to BoxBlur::MAX_RADIUS, 0 is off
+    int         spatialBlurPasses;  // box blurs in a row, 3 is close to a Gaussian
+    int         bloomLevels;        // glow pyramid levels, up to Bloom::MAX_LEVELS, 0 is off
+    float       bloomThreshold;     // 0-1, only channels brighter than this glow
+    float       bloomIntensity;     // 0-4, 1 adds the glow as it is
+    int         bloomRadius;        // blur of every level, in pixels of that level
+    bool        backgroundSubtraction; // only what differs from the learnt background lights the trail
+    float       backgroundThreshold;   // 0-1, pixels closer to the background than this go black
+    float       backgroundLearnRate;   // 0-1, share of each frame that goes into the background
+    int         backgroundResets;      // changing it learns the background again from the next frame
+    bool        lumaKey;            // only pixels brighter than the key light the trail
+    float       lumaKeyThreshold;   // 0-1
+    float       lumaKeyKnee;        // 0-1, width of the fade in around the threshold, 0 is a hard key
+    float       lumaKeyHysteresis;  // 0-1, a pixel keyed in last frame stays in down to threshold - hysteresis
+    bool        motionTrails;       // the 8 bit trail moves along with the motion of the frame
+    int         motionSearch;       // farthest motion looked for, in MotionField plane pixels up to MotionField::MAX_SEARCH
+    float       motionAmount;       // 0-2, share of the motion the trail moves by
+    bool        edgeMode;           // only the edges of the new frame, grey, go on from here
+    float       edgeGain;           // 0-4, 1 takes the Sobel magnitude / 4
+    bool        gradientMap;        // display coloured by a palette instead of its own colours
+    std::shared_ptr<const GradientMap> gradientPalettes; // NULL is the built in ones
+    int         gradientPalette;    // index into gradientPalettes, wraps around
+    int         posterizeLevels;    // 2 up to GradientMap::MAX_POSTERIZE_LEVELS steps into the palette, 0 is off
+    bool        gradientIntensity;  // by the brightest colour byte instead of the luma
+
+    FeedbackParams();
+
+    // width or height of the display frame for a newFrame width or height
+    int32_t getDisplaySize(int32_t newFrameSize) const { return downscale > 1 ? newFrameSize / downscale : newFrameSize; }
+};
+
+class FeedbackProcessor {
+  public:
+    FeedbackProcessor();
+
+    // forget the trail, the next frame processed starts a new one
+    void reset();
+    bool hasTrail() const { return !mTrail.empty(); }
+
+    // Runs the effect for one captured frame. newFrame is modified in place when hue
+    // rotation is on and downscale is 1. display must have the same layout as newFrame,
+    // its size given by params.getDisplaySize(), and receives the frame to show. The
+    // first frame after a reset (or a size / layout change) is copied through unchanged
+    // and becomes the start of the trail. A downscale change keeps the trail, the layers
+    // and the history, box filtered down or bilinear up to the new size.
+    // With batchFrameSkip (and frameSkip > 1, blur on, lighten) the frames of a skip window are
+    // only max-merged into a pending buffer and display isn't touched. The last frame of
+    // the window applies the window's decay and the pending frames to the trail in one
+    // go, the trail comes out the same as processing every frame.
+    // With linearLight the trail decays and lightens, and display mixes the new frame
+    // in, on linear light values decoded from sRGB, so fades darken the way a light
+    // dimming does instead of crushing the shadows and shifting the colours.
+    // With trail layers each layer is decayed / lightened like the trail and the
+    // brightest of the trail and the tinted layers goes to display.
+    // With backgroundSubtraction pixels close to a running average of the frames go
+    // black before the trail sees them (newFrame is modified in place then too), the
+    // history keeps them as they were. The first frame is all background.
+    // With edgeMode the new frame is replaced by the Sobel edges of its luma (as it
+    // came in, before hue rotation) first thing, so only outlines light the trail.
+    // With lumaKey pixels darker than the key fade to black the same way, so camera
+    // noise in the dark doesn't build up in the trail.
+    // With motionTrails block motion vectors between newFrame and the frame before it
+    // move the 8 bit trail along before the new frame goes in, so trails smear in the
+    // direction things move. Not while the region changes, the layers stay where they are.
+    // With spatialBlurRadius the 8 bit trail is box blurred once this frame's light is
+    // in, so it softens frame after frame. Display only sees that from the next frame on.
+    // With gradientMap each display pixel takes the palette colour of its luma (or
+    // brightest colour byte, the trail's intensity when display is the trail), after
+    // the echo taps so they are coloured too. The palette table is filled per frame,
+    // 256 entries, and looked up per pixel.
+    // With bloomLevels the glow of display is added onto it after everything else.
+    // Every frame goes into the history, the echo taps are blended over display last.
+    // With displacementDepth > 1 each row (or column) of the frame is swapped for the
+    // same row of an older frame out of the history before the trail sees it, so
+    // newFrame is modified in place then too. It reaches no further back than the
+    // frames recorded since the region last grew.
+    // Only params.region (in newFrame pixels) is processed, display and the trail outside it are left as they
+    // were. Trail the region newly takes in (the camera moved) starts again from newFrame
+    // instead of showing what was left there when it dropped out, and so do the
+    // history frames the echo taps and the time displacement read there.
+    // Returns false when display wasn't written.
+    bool process(const FrameView &newFrame, const FrameView &display, const FeedbackParams &params);
+
+    // 8 bit trail, only up to date while highPrecision, lazyDecay and linearLight are off, and only inside getRegion()
+    const FrameView& getTrail() const { return mTrailView; }
+
+    // defaults to the best kernels for this CPU, the benchmark forces others to compare
+    void setKernelIsa(KernelIsa isa);
+    KernelIsa getKernelIsa() const { return mKernelIsa; }
+
+    // part of the frame the last process() call worked on
+    const FrameRect& getRegion() const { return mRegion; }
+
+    // past frames as processed (scaled, hue rotated), for the memory use
+    const FrameHistory& getHistory() const { return mHistory; }
+
+    // glow pyramid, for the per level timings and the memory use
+    const Bloom& getBloom() const { return mBloom; }
+
+    // motion vectors of the last frame, for the timing and the memory use
+    const MotionField& getMotion() const { return mMotion; }
+
+    // cube size and background building for the hueLut path
+    HueLut& getHueLut() { return mHueLut; }
+
+    // threads running the frame in horizontal bands, set from FeedbackParams::numThreads.
+    // process() returns once every band is done.
+    int getNumThreads() const { return mPool.getNumThreads(); }
+
+  private:
+    static const int BANDS_PER_THREAD = 4;
+    static const int MIN_BAND_ROWS = 8;
+    static const int MIN_STRIP_BYTES = 64;
+
+    enum TrailFormat {
+        TRAIL_FORMAT_8BIT,      // mTrail
+        TRAIL_FORMAT_16BIT,     // mTrail16, value * 256
+        TRAIL_FORMAT_GAIN,      // mTrail16, value / mGain
+        TRAIL_FORMAT_LINEAR     // mTrail16, sRGB decoded value * 65535
+    };
+
+    int getNumBands(int32_t height) const;
+    // vertical strips for the column passes of the blur
+    int getNumStrips(int32_t rowLength) const;
+    void startTrail(const FrameView &newFrame, const FrameView &display);
+    // resamples the trail, layers, history and the other per pixel state from mDownscale to
+    // downscale, frame being the size they go to
+    void rescaleTrail(const FrameView &frame, int downscale, const FeedbackParams &params);
+    // moves the trail between the 8 bit and the 16 bit buffer / formats
+    void convertTrail(TrailFormat format);
+    // folds mGain back into the stored values once it gets too small to store new light
+    void renormaliseGain(int32_t height);
+    // 1.16, so a gain of 1 reads a stored 255 back as 255 << 8
+    uint32_t getGainFixed() const;
+    // (re)allocates mScaled for a newFrame of this size and layout
+    void fitScaledFrame(const FrameView &newFrame, int downscale);
+    // box filters newFrame into pixels x1 to x2 of mScaled row y
+    void downsample(const FrameView &newFrame, int downscale, int32_t y, int32_t x1, int32_t x2);
+    // restarts the trail from newRow for the pixels x1 to x2 of row y
+    void seedTrail(int32_t y, int32_t x1, int32_t x2, const uint8_t *newRow, uint16_t inverseGainFixed);
+    // the pixels x1 to x2 of row y of every older history frame become those of the newest
+    void seedHistory(int32_t y, int32_t x1, int32_t x2);
+    // starts the background of the pixels x1 to x2 of row y as newRow
+    void seedBackground(int32_t y, int32_t x1, int32_t x2, const uint8_t *newRow);
+    // zeroed mLayers up to numLayers, the others freed
+    void fitLayers(int numLayers);
+    // row y of the trail moved along the motion vectors, the region part of it into mAdvected
+    uint8_t* advectRow(int32_t y, const FrameRect &region, float amount);
+    // copies the parts of row y inside region that are older than this frame in from the history,
+    // up to maxAge frames back
+    void displaceRow(uint8_t *row, int32_t y, const FrameRect &region, int depth, int maxAge, bool columns);
+
+    std::vector<uint8_t>    mTrail;
+    FrameView               mTrailView;
+    std::vector<uint16_t>   mTrail16;       // same layout as mTrail
+    TrailFormat             mTrailFormat;
+    double                  mGain;          // TRAIL_FORMAT_GAIN, decays every frame instead of the trail
+    std::vector<uint16_t>   mDither;        // 4 rows of dither thresholds, see fillDitherRow
+    std::vector<uint8_t>    mPending;       // max of the frames batched since the last decay
+    std::vector<uint8_t>    mScaled;        // newFrame scaled down when downscale > 1
+    std::vector<uint8_t>    mLayers[MAX_TRAIL_LAYERS]; // same layout as mTrail, empty when not in use
+    std::vector<uint16_t>   mLayerTints;    // 2 * FEEDBACK_DITHER_PERIOD per layer
+    std::vector<uint16_t>   mBackground;    // same layout as mTrail, value * 256, empty when not in use
+    int                     mBackgroundResets;
+    std::vector<uint8_t>    mKeyState;      // a byte per pixel, 0xff where the luma key let the pixel in last frame
+    std::vector<uint8_t>    mAdvected;      // same layout as mTrail, the trail moved along the motion, swapped in
+    std::vector<uint8_t>    mEdgeRows;      // per band, 3 rolling luma rows, the rows above and below the band and a scratch row
+    MotionField             mMotion;
+    FrameHistory            mHistory;
+    int                     mRegionFrames;  // history frames recorded since the region last grew
+    BoxBlur                 mBlur;
+    Bloom                   mBloom;
+    FrameView               mScaledView;
+    int                     mPendingFrames;
+    int                     mSkippedFrames;
+    FrameRect               mRegion;        // trail outside this is stale
+    int                     mDownscale;     // the trail's, of the capture it started from
+    HueLut                  mHueLut;
+    GradientMap             mBuiltInPalettes;
+    uint32_t                mGradientTable[GradientMap::LEVELS]; // this frame's palette in the frame layout
+    WorkerPool              mPool;
+    KernelIsa               mKernelIsa;
+};
+
+#endif /* FeedbackProcessor_h */
@@ -0,0 +1,45 @@
+//
+//  FrameHistory.cpp
+//  Illuminate
+//
+
+#include "FrameHistory.h"
+
+#include <algorithm>
+
+FrameHistory::FrameHistory()
+    : mFrameBytes(0), mDepth(0), mBudgetBytes(0), mCapacity(0), mCount(0), mNewest(0)
+{
+}
+
+void FrameHistory::configure(const FrameView &frame, int depth, size_t budgetBytes)
+{
+    if (frame.hasSameLayout(mLayout) && depth == mDepth && budgetBytes == mBudgetBytes) {
+        return;
+    }
+    mLayout = frame;
+    mLayout.data = NULL;
+    mLayout.rowBytes = frame.width * frame.pixelInc;
+    mFrameBytes = (size_t)mLayout.rowBytes * frame.height;
+    mDepth = depth;
+    mBudgetBytes = budgetBytes;
+    mCapacity = mFrameBytes > 0 ? (int)std::min((size_t)std::max(depth, 0), budgetBytes / mFrameBytes) : 0;
+    // a new vector rather than resize(), so shrinking gives the memory back too
+    std::vector<uint8_t>(mFrameBytes * mCapacity).swap(mBuffer);
+    clear();
+}
+
+void FrameHistory::clear()
+{
+    mCount = 0;
+    mNewest = 0;
+}
+
+void FrameHistory::advance()
+{
+    if (mCapacity == 0) {
+        return;
+    }
+    mNewest = mNewest + 1 < mCapacity ? mNewest + 1 : 0;
+    mCount = std::min(mCount + 1, mCapacity);
+}
@@ -0,0 +1,57 @@
+//
+//  FrameHistory.h
+//  Illuminate
+//
+//  Ring of past frames for the echo and time displacement looks. The memory is
+//  allocated once for a frame size / depth / budget and reused, a new frame only
+//  moves the ring on. Frames are looked up by age, 0 being the newest.
+//
+
+#ifndef FrameHistory_h
+#define FrameHistory_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "FrameView.h"
+
+class FrameHistory {
+  public:
+    FrameHistory();
+
+    // Keeps up to depth frames with the layout of frame, fewer when they don't fit in
+    // budgetBytes. Only reallocates (and forgets the stored frames) when one of them changed.
+    void configure(const FrameView &frame, int depth, size_t budgetBytes);
+    // forget the stored frames, the memory stays
+    void clear();
+
+    int getCapacity() const { return mCapacity; }
+    // frames stored so far, up to the capacity
+    int getCount() const { return mCount; }
+    size_t getMemoryBytes() const { return mBuffer.size(); }
+
+    // makes the oldest frame (or an unused one) the newest, age 0, for the caller to fill
+    void advance();
+    // row y of the frame age frames old, age < getCount()
+    uint8_t* getRow(int age, int32_t y)
+    {
+        int slot = mNewest - age;
+        if (slot < 0) {
+            slot += mCapacity;
+        }
+        return &mBuffer[(size_t)slot * mFrameBytes + (size_t)y * mLayout.rowBytes];
+    }
+
+  private:
+    std::vector<uint8_t>    mBuffer;
+    FrameView               mLayout;        // data unused
+    size_t                  mFrameBytes;
+    int                     mDepth;
+    size_t                  mBudgetBytes;
+    int                     mCapacity;
+    int                     mCount;
+    int                     mNewest;
+};
+
+#endif /* FrameHistory_h */
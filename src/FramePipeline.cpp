@@ -0,0 +1,174 @@
+//
+//  FramePipeline.cpp
+//  Illuminate
+//
+
+#include "FramePipeline.h"
+
+#include <utility>
+
+FramePipeline::FramePipeline()
+    : mProcessor(NULL), mBack(0), mReady(1), mFront(2), mFresh(false), mQuit(false),
+      mLatencyMs(0.f), mEffectMs(0.f), mDroppedFrames(0), mHistoryFrames(0), mHistoryBytes(0), mMotionMs(0.f)
+{
+}
+
+FramePipeline::~FramePipeline()
+{
+    stop();
+}
+
+void FramePipeline::start(FeedbackProcessor *processor)
+{
+    stop();
+    mProcessor = processor;
+    mQuit = false;
+    mFresh = false;
+    mPending = Input();
+    mDroppedFrames = 0;
+    mThread = std::thread(&FramePipeline::effectLoop, this);
+}
+
+void FramePipeline::stop()
+{
+    if (!mThread.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQuit = true;
+        mCondition.notify_all();
+    }
+    mThread.join();
+    mPending = Input();
+    mFresh = false;
+    mProcessor = NULL;
+}
+
+void FramePipeline::submit(const FrameView &frame, const std::shared_ptr<void> &frameOwner, const FeedbackParams &params)
+{
+    Input input;
+    input.frame = frame;
+    input.owner = frameOwner;
+    input.params = params;
+    input.submitTime = Clock::now();
+    input.valid = true;
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mPending.valid) {
+        mDroppedFrames++;
+    }
+    // the replaced frame's owner is released here, outside the effect thread
+    std::swap(mPending, input);
+    mCondition.notify_all();
+}
+
+bool FramePipeline::acquireLatest(FrameView &display)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mFresh) {
+        return false;
+    }
+    std::swap(mFront, mReady);
+    mFresh = false;
+    const Slot &front = mSlots[mFront];
+    mLatencyMs = std::chrono::duration<float, std::milli>(Clock::now() - front.submitTime).count();
+    display = front.view;
+    return true;
+}
+
+float FramePipeline::getLatencyMs() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mLatencyMs;
+}
+
+float FramePipeline::getEffectMs() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mEffectMs;
+}
+
+uint64_t FramePipeline::getDroppedFrames() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mDroppedFrames;
+}
+
+int FramePipeline::getHistoryFrames() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mHistoryFrames;
+}
+
+size_t FramePipeline::getHistoryBytes() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mHistoryBytes;
+}
+
+Bloom::Timings FramePipeline::getBloomTimings() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mBloomTimings;
+}
+
+float FramePipeline::getMotionMs() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mMotionMs;
+}
+
+void FramePipeline::fitSlot(Slot &slot, const FrameView &frame, const FeedbackParams &params)
+{
+    const int32_t width = params.getDisplaySize(frame.width);
+    const int32_t height = params.getDisplaySize(frame.height);
+    FrameView layout(NULL, width, height, width * frame.pixelInc,
+                     frame.pixelInc, frame.redOffset, frame.greenOffset, frame.blueOffset);
+    if (slot.view.data != NULL && slot.view.hasSameLayout(layout)) {
+        return;
+    }
+    slot.buffer.assign((size_t)layout.rowBytes * height, 0);
+    layout.data = &slot.buffer[0];
+    slot.view = layout;
+}
+
+void FramePipeline::effectLoop()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        mCondition.wait(lock, [this]{ return mQuit || mPending.valid; });
+        if (mQuit) {
+            return;
+        }
+        Input input;
+        std::swap(input, mPending);
+        // the back slot is only touched here until it is swapped into mReady
+        Slot &back = mSlots[mBack];
+        lock.unlock();
+
+        // a slot only ever changes size here, the front slot the renderer holds keeps its buffer
+        fitSlot(back, input.frame, input.params);
+        const Clock::time_point start = Clock::now();
+        const bool written = mProcessor->process(input.frame, back.view, input.params);
+        const float effectMs = std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+        back.submitTime = input.submitTime;
+        const int historyFrames = mProcessor->getHistory().getCapacity();
+        const size_t historyBytes = mProcessor->getHistory().getMemoryBytes();
+        const Bloom::Timings bloomTimings = mProcessor->getBloom().getTimings();
+        const float motionMs = mProcessor->getMotion().getEstimateMs();
+        input = Input();
+
+        lock.lock();
+        // batched skip frames leave the back slot as it was, nothing new to show
+        if (written) {
+            std::swap(mBack, mReady);
+            mFresh = true;
+        }
+        mEffectMs = effectMs;
+        mHistoryFrames = historyFrames;
+        mHistoryBytes = historyBytes;
+        mBloomTimings = bloomTimings;
+        mMotionMs = motionMs;
+    }
+}
@@ -0,0 +1,105 @@
+//
+//  FramePipeline.h
+//  Illuminate
+//
+//  Runs FeedbackProcessor on its own thread so the render loop doesn't wait for
+//  the effect. Captured frames are handed in with submit(), finished frames are
+//  picked up with acquireLatest(). Finished frames go through a triple buffer: the
+//  effect thread writes one, one holds the newest finished frame and the render
+//  thread owns the one it is uploading, so neither side ever waits on the other.
+//  Only one captured frame can wait for the effect, a newer one replaces it, which
+//  caps the added latency at one frame.
+//
+
+#ifndef FramePipeline_h
+#define FramePipeline_h
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "FeedbackProcessor.h"
+
+class FramePipeline {
+  public:
+    FramePipeline();
+    ~FramePipeline();
+
+    // processor is only used from the effect thread until stop() returns
+    void start(FeedbackProcessor *processor);
+    void stop();
+    bool isRunning() const { return mThread.joinable(); }
+
+    // Capture stage. frame must stay valid until the effect thread is done with it,
+    // frameOwner is held for that long (the capture surface, for example). A frame
+    // still waiting from an earlier submit is dropped.
+    void submit(const FrameView &frame, const std::shared_ptr<void> &frameOwner, const FeedbackParams &params);
+
+    // Render stage. Swaps in the newest finished frame and returns true, or returns
+    // false when nothing finished since the last call. display stays valid until the
+    // next call.
+    bool acquireLatest(FrameView &display);
+
+    // submit to acquire time of the last acquired frame, and effect time per frame
+    float getLatencyMs() const;
+    float getEffectMs() const;
+    // captured frames replaced before the effect got to them
+    uint64_t getDroppedFrames() const;
+    // the processor's frame history after the last frame, see FeedbackProcessor::getHistory
+    int getHistoryFrames() const;
+    size_t getHistoryBytes() const;
+    // the processor's glow timings for the last frame, see FeedbackProcessor::getBloom
+    Bloom::Timings getBloomTimings() const;
+    // the processor's motion estimate time for the last frame, see FeedbackProcessor::getMotion
+    float getMotionMs() const;
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Slot {
+        std::vector<uint8_t>    buffer;
+        FrameView               view;
+        Clock::time_point       submitTime;
+    };
+
+    struct Input {
+        FrameView               frame;
+        std::shared_ptr<void>   owner;
+        FeedbackParams          params;
+        Clock::time_point       submitTime;
+        bool                    valid;
+
+        Input() : valid(false) {}
+    };
+
+    // display size for frame, see FeedbackParams::getDisplaySize
+    static void fitSlot(Slot &slot, const FrameView &frame, const FeedbackParams &params);
+    void effectLoop();
+
+    FeedbackProcessor       *mProcessor;
+    Slot                    mSlots[3];
+    int                     mBack;      // effect thread
+    int                     mReady;     // newest finished frame, swapped under mMutex
+    int                     mFront;     // render thread
+    bool                    mFresh;     // mReady holds a frame not acquired yet
+    Input                   mPending;
+
+    std::thread             mThread;
+    mutable std::mutex      mMutex;
+    std::condition_variable mCondition;
+    bool                    mQuit;
+
+    float                   mLatencyMs;
+    float                   mEffectMs;
+    uint64_t                mDroppedFrames;
+    int                     mHistoryFrames;
+    size_t                  mHistoryBytes;
+    Bloom::Timings          mBloomTimings;
+    float                   mMotionMs;
+};
+
+#endif /* FramePipeline_h */
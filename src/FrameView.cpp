@@ -0,0 +1,71 @@
+//
+//  FrameView.cpp
+//  Illuminate
+//
+
+#include "FrameView.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+
+FrameView::FrameView()
+    : data(NULL), width(0), height(0), rowBytes(0), pixelInc(0), redOffset(0), greenOffset(0), blueOffset(0)
+{
+}
+
+FrameView::FrameView(uint8_t *data, int32_t width, int32_t height, int32_t rowBytes,
+                     uint8_t pixelInc, uint8_t redOffset, uint8_t greenOffset, uint8_t blueOffset)
+    : data(data), width(width), height(height), rowBytes(rowBytes),
+      pixelInc(pixelInc), redOffset(redOffset), greenOffset(greenOffset), blueOffset(blueOffset)
+{
+}
+
+bool FrameView::hasSameLayout(const FrameView &other) const
+{
+    return width == other.width && height == other.height && pixelInc == other.pixelInc
+        && redOffset == other.redOffset && greenOffset == other.greenOffset && blueOffset == other.blueOffset;
+}
+
+uint32_t FrameView::getChannelMask() const
+{
+    if (pixelInc != 4) {
+        return 0xffffffffu;
+    }
+    uint32_t mask = 0;
+    uint8_t *maskBytes = reinterpret_cast<uint8_t*>(&mask);
+    maskBytes[redOffset] = maskBytes[greenOffset] = maskBytes[blueOffset] = 0xff;
+    return mask;
+}
+
+void FrameView::getLumaWeights(uint16_t *weights) const
+{
+    for (int c = 0 ; c < 4 ; c++) {
+        weights[c] = c == redOffset ? 77 : (c == greenOffset ? 150 : (c == blueOffset ? 29 : 0));
+    }
+}
+
+FrameRect::FrameRect()
+    : x1(0), y1(0), x2(std::numeric_limits<int32_t>::max()), y2(std::numeric_limits<int32_t>::max())
+{
+}
+
+FrameRect::FrameRect(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+    : x1(x1), y1(y1), x2(x2), y2(y2)
+{
+}
+
+FrameRect FrameRect::clippedTo(int32_t width, int32_t height) const
+{
+    FrameRect clipped(std::max(x1, 0), std::max(y1, 0), std::min(x2, width), std::min(y2, height));
+    if (clipped.isEmpty()) {
+        return FrameRect(0, 0, 0, 0);
+    }
+    return clipped;
+}
+
+FrameRect FrameRect::scaledDown(int32_t factor) const
+{
+    // rounded outwards, x2 / y2 can be the open ended default
+    return FrameRect(x1 / factor, y1 / factor, x2 / factor + (x2 % factor != 0 ? 1 : 0), y2 / factor + (y2 % factor != 0 ? 1 : 0));
+}
@@ -0,0 +1,58 @@
+//
+//  FrameView.h
+//  Illuminate
+//
+//  Layout descriptions the engine passes frames around with, no ownership.
+//
+
+#ifndef FrameView_h
+#define FrameView_h
+
+#include <cstdint>
+
+// View onto an interleaved 8 bit frame, same layout description as ci::Surface8u,
+// so pixelInc is 3 or 4. Channels other than r, g and b (alpha, padding) are passed
+// through from the new frame to the display frame.
+struct FrameView {
+    uint8_t     *data;
+    int32_t     width;
+    int32_t     height;
+    int32_t     rowBytes;
+    uint8_t     pixelInc;
+    uint8_t     redOffset;
+    uint8_t     greenOffset;
+    uint8_t     blueOffset;
+
+    FrameView();
+    FrameView(uint8_t *data, int32_t width, int32_t height, int32_t rowBytes,
+              uint8_t pixelInc, uint8_t redOffset, uint8_t greenOffset, uint8_t blueOffset);
+
+    uint8_t* getRow(int32_t y) const { return data + (y * rowBytes); }
+    bool hasSameLayout(const FrameView &other) const;
+    // 0xff for each colour byte of a 4 byte group, see FeedbackRowParams
+    uint32_t getChannelMask() const;
+    // Rec. 601 luma weights for each byte of a pixel in memory order, 0 for the non
+    // colour bytes, adding up to 256
+    void getLumaWeights(uint16_t *weights) const;
+};
+
+// Pixel rectangle of a frame, x2 / y2 exclusive. The default covers any frame size,
+// users clip it to the frame they work on.
+struct FrameRect {
+    int32_t     x1;
+    int32_t     y1;
+    int32_t     x2;
+    int32_t     y2;
+
+    FrameRect();
+    FrameRect(int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+
+    int32_t getWidth() const { return x2 - x1; }
+    int32_t getHeight() const { return y2 - y1; }
+    bool isEmpty() const { return x2 <= x1 || y2 <= y1; }
+    FrameRect clippedTo(int32_t width, int32_t height) const;
+    // covers every pixel of a frame scaled down by factor this covers part of
+    FrameRect scaledDown(int32_t factor) const;
+};
+
+#endif /* FrameView_h */
@@ -0,0 +1,132 @@
+//
+//  GradientMap.cpp
+//  Illuminate
+//
+
+#include "GradientMap.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace {
+
+// name and stops of the palettes there without a file
+const char *const BUILT_IN_PALETTES[] = {
+    "heat 000000 500000 c02000 ff9000 ffe040 ffffff",
+    "ice 000000 001840 0060a0 40c0ff c0f0ff ffffff",
+    "duotone 1a1046 ff8c69",
+    "neon 000000 400080 ff00c0 00ffff ffffff",
+    "grey 000000 ffffff"
+};
+
+bool parseHexColour(const std::string &text, uint8_t *rgb)
+{
+    if (text.size() != 6) {
+        return false;
+    }
+    char *end = NULL;
+    const unsigned long value = strtoul(text.c_str(), &end, 16);
+    if (end != text.c_str() + 6) {
+        return false;
+    }
+    rgb[0] = (uint8_t)(value >> 16);
+    rgb[1] = (uint8_t)(value >> 8);
+    rgb[2] = (uint8_t)value;
+    return true;
+}
+
+}
+
+GradientMap::GradientMap()
+{
+    for (size_t p = 0 ; p < sizeof(BUILT_IN_PALETTES) / sizeof(BUILT_IN_PALETTES[0]) ; p++) {
+        std::istringstream line(BUILT_IN_PALETTES[p]);
+        std::string name, stop;
+        std::vector<std::string> stops;
+        line >> name;
+        while (line >> stop) {
+            stops.push_back(stop);
+        }
+        mPalettes.push_back(Palette());
+        build(mPalettes.back(), name, stops);
+    }
+}
+
+bool GradientMap::loadFile(const std::string &path)
+{
+    std::ifstream file(path.c_str());
+    std::vector<Palette> loaded;
+    std::string text;
+    while (std::getline(file, text)) {
+        std::istringstream line(text);
+        std::string name, stop;
+        std::vector<std::string> stops;
+        if (!(line >> name) || name[0] == '#') {
+            continue;
+        }
+        while (line >> stop) {
+            stops.push_back(stop);
+        }
+        Palette palette;
+        if (build(palette, name, stops)) {
+            loaded.push_back(palette);
+        }
+    }
+    if (loaded.empty()) {
+        return false;
+    }
+    mPalettes.insert(mPalettes.end(), loaded.begin(), loaded.end());
+    return true;
+}
+
+bool GradientMap::build(Palette &palette, const std::string &name, const std::vector<std::string> &stops)
+{
+    if (stops.size() < 2) {
+        return false;
+    }
+    std::vector<uint8_t> colours(stops.size() * 3);
+    for (size_t s = 0 ; s < stops.size() ; s++) {
+        if (!parseHexColour(stops[s], &colours[s * 3])) {
+            return false;
+        }
+    }
+    palette.name = name;
+    // straight lines between the stops, level 0 is the first and LEVELS - 1 the last
+    const int32_t spans = (int32_t)stops.size() - 1;
+    for (int32_t level = 0 ; level < LEVELS ; level++) {
+        // position in 1 / (LEVELS - 1) steps of a span
+        const int32_t position = level * spans;
+        const int32_t span = position / (LEVELS - 1) < spans ? position / (LEVELS - 1) : spans - 1;
+        const int32_t weight = position - span * (LEVELS - 1);
+        const uint8_t *from = &colours[span * 3];
+        const uint8_t *to = &colours[(span + 1) * 3];
+        for (int c = 0 ; c < 3 ; c++) {
+            palette.colours[level][c] = (uint8_t)((from[c] * (LEVELS - 1 - weight) + to[c] * weight + (LEVELS - 1) / 2) / (LEVELS - 1));
+        }
+    }
+    return true;
+}
+
+int GradientMap::wrap(int palette) const
+{
+    const int count = getNumPalettes();
+    const int index = palette % count;
+    return index < 0 ? index + count : index;
+}
+
+void GradientMap::fillTable(uint32_t *table, int palette, int posterizeLevels, const FrameView &frame) const
+{
+    const Palette &colours = mPalettes[wrap(palette)];
+    const bool posterize = posterizeLevels > 1 && posterizeLevels < MAX_POSTERIZE_LEVELS;
+    for (int32_t level = 0 ; level < LEVELS ; level++) {
+        // the steps are even over the levels and take in both ends
+        const int32_t source = posterize ? (level * posterizeLevels >> 8) * (LEVELS - 1) / (posterizeLevels - 1) : level;
+        uint8_t pixel[4] = { 0, 0, 0, 0 };
+        pixel[frame.redOffset] = colours.colours[source][0];
+        pixel[frame.greenOffset] = colours.colours[source][1];
+        pixel[frame.blueOffset] = colours.colours[source][2];
+        memcpy(&table[level], pixel, 4);
+    }
+}
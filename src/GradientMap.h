@@ -0,0 +1,57 @@
+//
+//  GradientMap.h
+//  Illuminate
+//
+//  Palettes for colourising the output by brightness, a heat map or a duotone say,
+//  instead of rotating its hue. Each palette is built into a 256 level RGB table
+//  when it is loaded, so a frame only fills the table of one palette in its pixel
+//  layout and the rows look their colours up from that.
+//
+
+#ifndef GradientMap_h
+#define GradientMap_h
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "FrameView.h"
+
+class GradientMap {
+  public:
+    static const int LEVELS = 256;
+    static const int MAX_POSTERIZE_LEVELS = LEVELS;
+
+    // starts with the built in palettes
+    GradientMap();
+
+    // Adds the palettes of a text file after the ones there already. One palette a
+    // line: a name, then two or more colour stops as rrggbb hex spread evenly from
+    // black to white, for example "heat 000000 800000 ff8000 ffff00 ffffff". Blank
+    // lines and lines starting with # are skipped. Returns false when the file holds
+    // no palette, nothing is added then.
+    bool loadFile(const std::string &path);
+
+    int getNumPalettes() const { return (int)mPalettes.size(); }
+    // index wraps around, so any int picks a palette
+    const std::string& getName(int palette) const { return mPalettes[wrap(palette)].name; }
+
+    // Pixel of each level of palette in the layout of frame, the bytes in memory order
+    // of a 32 bit value per level. posterizeLevels from 2 to MAX_POSTERIZE_LEVELS
+    // groups the levels into that many even steps first, 0 or 1 keeps them all.
+    void fillTable(uint32_t *table, int palette, int posterizeLevels, const FrameView &frame) const;
+
+  private:
+    struct Palette {
+        std::string     name;
+        uint8_t         colours[LEVELS][3];     // r, g, b
+    };
+
+    // palette from its stops, false when there are fewer than two or one isn't rrggbb
+    static bool build(Palette &palette, const std::string &name, const std::vector<std::string> &stops);
+    int wrap(int palette) const;
+
+    std::vector<Palette>    mPalettes;
+};
+
+#endif /* GradientMap_h */
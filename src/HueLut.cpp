@@ -0,0 +1,302 @@
+//
+//  HueLut.cpp
+//  Illuminate
+//
+
+#include "HueLut.h"
+
+#include <algorithm>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+// entries are value << ENTRY_SHIFT, 255 << ENTRY_SHIFT still fits an int16_t
+const int ENTRY_SHIFT = 6;
+// a pixel's position in a grid cell goes from 0 to 1 << WEIGHT_SHIFT
+const int WEIGHT_SHIFT = 8;
+// The result is truncated like the exact path's, but the max and min channels come
+// out as whole values there and a hair below them from the rounded entries. A 32nd
+// of a step on top before truncating puts them back.
+const int32_t TRUNCATE_BIAS = 1 << (ENTRY_SHIFT + WEIGHT_SHIFT - 5);
+
+// Position of byte value v along an axis in 1 / 256 grid steps is ((v << 8) * scale) >> 16,
+// v * (size - 1) * 256 / 255 to within a 256th of a step and 255 exactly on the last
+// grid point. 16 bits, so _mm_mulhi_epu16 does the same.
+inline int32_t getGridScale(int size)
+{
+    return (size - 1) * 257 + 1;
+}
+
+// Tetrahedral interpolation of one pixel. The cell around it splits into 6 tetrahedra
+// along its diagonal, the one the pixel is in has the lower and upper grid points of
+// the cell as two corners, one step along the axis of the largest weight as the
+// third and the cell's upper point less one step along the axis of the smallest
+// weight as the fourth. Ties don't matter, the corners they pick get no weight.
+inline void rotatePixel(uint8_t *pixel, const int16_t *entries, int32_t scale, int32_t maxCell,
+                        const int32_t *strides, uint8_t redOffset, uint8_t greenOffset, uint8_t blueOffset)
+{
+    const uint8_t values[3] = { pixel[redOffset], pixel[greenOffset], pixel[blueOffset] };
+    int32_t w[3];
+    int32_t base = 0;
+    for (int axis = 0 ; axis < 3 ; axis++) {
+        const int32_t position = (int32_t)(((uint32_t)values[axis] << 8) * (uint32_t)scale >> 16);
+        const int32_t cell = (position >> WEIGHT_SHIFT) < maxCell ? (position >> WEIGHT_SHIFT) : maxCell;
+        w[axis] = position - (cell << WEIGHT_SHIFT);
+        base += cell * strides[axis];
+    }
+    const int32_t high = w[0] > w[1] ? (w[0] > w[2] ? w[0] : w[2]) : (w[1] > w[2] ? w[1] : w[2]);
+    const int32_t low = w[0] < w[1] ? (w[0] < w[2] ? w[0] : w[2]) : (w[1] < w[2] ? w[1] : w[2]);
+    const int32_t middle = w[0] + w[1] + w[2] - high - low;
+    const int32_t diagonal = strides[0] + strides[1] + strides[2];
+    const int32_t first = w[0] == high ? strides[0] : (w[1] == high ? strides[1] : strides[2]);
+    const int32_t last = w[2] == low ? strides[2] : (w[1] == low ? strides[1] : strides[0]);
+    const int16_t *c0 = entries + base;
+    const int16_t *c1 = c0 + first;
+    const int16_t *c2 = c0 + diagonal - last;
+    const int16_t *c3 = c0 + diagonal;
+    uint8_t rgb[3];
+    for (int c = 0 ; c < 3 ; c++) {
+        const int32_t sum = TRUNCATE_BIAS + c0[c] * ((1 << WEIGHT_SHIFT) - high) + c1[c] * (high - middle)
+                            + c2[c] * (middle - low) + c3[c] * low;
+        rgb[c] = (uint8_t)(sum >> (ENTRY_SHIFT + WEIGHT_SHIFT));
+    }
+    pixel[redOffset] = rgb[0];
+    pixel[greenOffset] = rgb[1];
+    pixel[blueOffset] = rgb[2];
+}
+
+}
+
+HueLut::HueLut()
+    : mFront(0), mSize(DEFAULT_SIZE), mAsync(false), mBuilding(false), mBuilt(false), mQuit(false),
+      mRequestedSize(DEFAULT_SIZE), mRequestedHue(0.f)
+{
+}
+
+HueLut::~HueLut()
+{
+    stopBuilder();
+}
+
+void HueLut::setSize(int size)
+{
+    mSize = std::min(std::max(size, (int)MIN_SIZE), (int)MAX_SIZE);
+}
+
+void HueLut::setAsync(bool async)
+{
+    if (async == mAsync) {
+        return;
+    }
+    if (async) {
+        startBuilder();
+    } else {
+        stopBuilder();
+    }
+    mAsync = async;
+}
+
+void HueLut::build(Table &table, int size, float huePosition)
+{
+    table.entries.resize(size * size * size * 4);
+    const float step = 255.f / (size - 1);
+    const float entryScale = (float)(1 << ENTRY_SHIFT);
+    int16_t *entry = &table.entries[0];
+    for (int b = 0 ; b < size ; b++) {
+        for (int g = 0 ; g < size ; g++) {
+            for (int r = 0 ; r < size ; r++) {
+                float rgb[3] = { r * step, g * step, b * step };
+                rotateHueExact(rgb[0], rgb[1], rgb[2], huePosition);
+                for (int c = 0 ; c < 3 ; c++) {
+                    entry[c] = (int16_t)(std::min(std::max(rgb[c], 0.f), 255.f) * entryScale + 0.5f);
+                }
+                entry[3] = 0;
+                entry += 4;
+            }
+        }
+    }
+    table.size = size;
+    table.huePosition = huePosition;
+    table.valid = true;
+}
+
+void HueLut::update(float huePosition)
+{
+    if (!mAsync) {
+        Table &table = mTables[mFront];
+        if (!table.valid || table.size != mSize || table.huePosition != huePosition) {
+            build(table, mSize, huePosition);
+        }
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(mMutex);
+    if (mBuilt) {
+        mFront = 1 - mFront;
+        mBuilt = false;
+    }
+    const Table &front = mTables[mFront];
+    if ((!front.valid || front.size != mSize || front.huePosition != huePosition) && !mBuilding) {
+        mRequestedSize = mSize;
+        mRequestedHue = huePosition;
+        mBuilding = true;
+        mCondition.notify_all();
+    }
+    if (!front.valid) {
+        // nothing to apply yet, this first build has to be waited for
+        mCondition.wait(lock, [this]{ return mBuilt; });
+        mFront = 1 - mFront;
+        mBuilt = false;
+    }
+}
+
+void HueLut::startBuilder()
+{
+    mQuit = false;
+    mBuilding = false;
+    mBuilt = false;
+    mBuilder = std::thread(&HueLut::builderLoop, this);
+}
+
+void HueLut::stopBuilder()
+{
+    if (!mBuilder.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQuit = true;
+        mCondition.notify_all();
+    }
+    mBuilder.join();
+    if (mBuilt) {
+        mFront = 1 - mFront;
+        mBuilt = false;
+    }
+    mBuilding = false;
+}
+
+void HueLut::builderLoop()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        mCondition.wait(lock, [this]{ return mQuit || (mBuilding && !mBuilt); });
+        if (mQuit) {
+            return;
+        }
+        // the back table is only touched here until mBuilt hands it over
+        Table &back = mTables[1 - mFront];
+        const int size = mRequestedSize;
+        const float huePosition = mRequestedHue;
+        lock.unlock();
+        build(back, size, huePosition);
+        lock.lock();
+        mBuilding = false;
+        mBuilt = true;
+        mCondition.notify_all();
+    }
+}
+
+void HueLut::apply(uint8_t *pixels, int32_t count, uint8_t pixelInc,
+                   uint8_t redOffset, uint8_t greenOffset, uint8_t blueOffset) const
+{
+    const Table &table = mTables[mFront];
+    const int16_t *entries = &table.entries[0];
+    const int32_t scale = getGridScale(table.size);
+    const int32_t maxCell = table.size - 2;
+    // grid offsets, in entries, to the +r / +g / +b neighbours
+    const int32_t strides[3] = { 4, table.size * 4, table.size * table.size * 4 };
+
+    int32_t i = 0;
+#if defined(__SSE2__)
+    if (pixelInc == 4) {
+        // 8 pixels at a time: cells, weights and tetrahedra in 16 bit lanes, then the 4
+        // corners of each pixel fetched and summed with _mm_madd_epi16
+        const int32_t diagonal = strides[0] + strides[1] + strides[2];
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i lowByte = _mm_set1_epi32(0xff);
+        const __m128i gridScale = _mm_set1_epi16((int16_t)scale);
+        const __m128i lastCell = _mm_set1_epi16((int16_t)maxCell);
+        const __m128i full = _mm_set1_epi16(1 << WEIGHT_SHIFT);
+        const __m128i bias = _mm_set1_epi32(TRUNCATE_BIAS);
+        const __m128i axisStrides[3] = { _mm_set1_epi16((int16_t)strides[0]), _mm_set1_epi16((int16_t)strides[1]),
+                                         _mm_set1_epi16((int16_t)strides[2]) };
+        const __m128i diagonalStride = _mm_set1_epi16((int16_t)diagonal);
+        const __m128i strideRG = _mm_set1_epi32(strides[0] | (strides[1] << 16));
+        const __m128i strideB = _mm_set1_epi32(strides[2]);
+        const __m128i shifts[3] = { _mm_cvtsi32_si128(redOffset * 8), _mm_cvtsi32_si128(greenOffset * 8),
+                                    _mm_cvtsi32_si128(blueOffset * 8) };
+        const __m128i keep = _mm_set1_epi32((int32_t)~((0xffu << (redOffset * 8)) | (0xffu << (greenOffset * 8)) |
+                                                       (0xffu << (blueOffset * 8))));
+        for ( ; i + 8 <= count ; i += 8, pixels += 32) {
+            const __m128i n[2] = { _mm_loadu_si128((const __m128i*)pixels), _mm_loadu_si128((const __m128i*)(pixels + 16)) };
+            __m128i cells[3], w[3];
+            for (int axis = 0 ; axis < 3 ; axis++) {
+                const __m128i values = _mm_packs_epi32(_mm_and_si128(_mm_srl_epi32(n[0], shifts[axis]), lowByte),
+                                                       _mm_and_si128(_mm_srl_epi32(n[1], shifts[axis]), lowByte));
+                const __m128i position = _mm_mulhi_epu16(_mm_slli_epi16(values, 8), gridScale);
+                cells[axis] = _mm_min_epi16(_mm_srli_epi16(position, WEIGHT_SHIFT), lastCell);
+                w[axis] = _mm_sub_epi16(position, _mm_slli_epi16(cells[axis], WEIGHT_SHIFT));
+            }
+            const __m128i high = _mm_max_epi16(_mm_max_epi16(w[0], w[1]), w[2]);
+            const __m128i low = _mm_min_epi16(_mm_min_epi16(w[0], w[1]), w[2]);
+            const __m128i middle = _mm_sub_epi16(_mm_add_epi16(_mm_add_epi16(w[0], w[1]), w[2]), _mm_add_epi16(high, low));
+            // the first match wins a tie, like the scalar version
+            const __m128i redHigh = _mm_cmpeq_epi16(w[0], high);
+            const __m128i greenHigh = _mm_andnot_si128(redHigh, _mm_cmpeq_epi16(w[1], high));
+            const __m128i first = _mm_or_si128(_mm_or_si128(_mm_and_si128(redHigh, axisStrides[0]), _mm_and_si128(greenHigh, axisStrides[1])),
+                                               _mm_andnot_si128(_mm_or_si128(redHigh, greenHigh), axisStrides[2]));
+            const __m128i blueLow = _mm_cmpeq_epi16(w[2], low);
+            const __m128i greenLow = _mm_andnot_si128(blueLow, _mm_cmpeq_epi16(w[1], low));
+            const __m128i last = _mm_or_si128(_mm_or_si128(_mm_and_si128(blueLow, axisStrides[2]), _mm_and_si128(greenLow, axisStrides[1])),
+                                              _mm_andnot_si128(_mm_or_si128(blueLow, greenLow), axisStrides[0]));
+            const __m128i w0 = _mm_sub_epi16(full, high);
+            const __m128i w1 = _mm_sub_epi16(high, middle);
+            const __m128i w2 = _mm_sub_epi16(middle, low);
+
+            int32_t bases[8], weights01[8], weights23[8];
+            int16_t seconds[8], thirds[8];
+            const __m128i redGreen[2] = { _mm_unpacklo_epi16(cells[0], cells[1]), _mm_unpackhi_epi16(cells[0], cells[1]) };
+            const __m128i blue[2] = { _mm_unpacklo_epi16(cells[2], zero), _mm_unpackhi_epi16(cells[2], zero) };
+            for (int half = 0 ; half < 2 ; half++) {
+                _mm_storeu_si128((__m128i*)(bases + half * 4),
+                                 _mm_add_epi32(_mm_madd_epi16(redGreen[half], strideRG), _mm_madd_epi16(blue[half], strideB)));
+            }
+            _mm_storeu_si128((__m128i*)seconds, first);
+            _mm_storeu_si128((__m128i*)thirds, _mm_sub_epi16(diagonalStride, last));
+            _mm_storeu_si128((__m128i*)weights01, _mm_unpacklo_epi16(w0, w1));
+            _mm_storeu_si128((__m128i*)(weights01 + 4), _mm_unpackhi_epi16(w0, w1));
+            _mm_storeu_si128((__m128i*)weights23, _mm_unpacklo_epi16(w2, low));
+            _mm_storeu_si128((__m128i*)(weights23 + 4), _mm_unpackhi_epi16(w2, low));
+
+            __m128i sums[8];
+            for (int p = 0 ; p < 8 ; p++) {
+                const int16_t *c0 = entries + bases[p];
+                const __m128i c01 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)c0),
+                                                       _mm_loadl_epi64((const __m128i*)(c0 + seconds[p])));
+                const __m128i c23 = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i*)(c0 + thirds[p])),
+                                                       _mm_loadl_epi64((const __m128i*)(c0 + diagonal)));
+                const __m128i sum = _mm_add_epi32(_mm_madd_epi16(c01, _mm_set1_epi32(weights01[p])),
+                                                  _mm_madd_epi16(c23, _mm_set1_epi32(weights23[p])));
+                sums[p] = _mm_srli_epi32(_mm_add_epi32(sum, bias), ENTRY_SHIFT + WEIGHT_SHIFT);
+            }
+            // r g b of 4 pixels in the low 3 bytes of each 32 bit lane, moved to their offsets
+            for (int half = 0 ; half < 2 ; half++) {
+                const __m128i rgb = _mm_packus_epi16(_mm_packs_epi32(sums[half * 4], sums[half * 4 + 1]),
+                                                     _mm_packs_epi32(sums[half * 4 + 2], sums[half * 4 + 3]));
+                __m128i out = _mm_and_si128(n[half], keep);
+                for (int c = 0 ; c < 3 ; c++) {
+                    out = _mm_or_si128(out, _mm_sll_epi32(_mm_and_si128(_mm_srli_epi32(rgb, c * 8), lowByte), shifts[c]));
+                }
+                _mm_storeu_si128((__m128i*)(pixels + half * 16), out);
+            }
+        }
+    }
+#endif
+    for ( ; i < count ; i++, pixels += pixelInc) {
+        rotatePixel(pixels, entries, scale, maxCell, strides, redOffset, greenOffset, blueOffset);
+    }
+}
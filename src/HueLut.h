@@ -0,0 +1,133 @@
+//
+//  HueLut.h
+//  Illuminate
+//
+//  RGB -> RGB lookup cube holding the hue rotation for one hue position, so the
+//  per pixel rgbToHSV / hsvToRGB round trip becomes a tetrahedral lookup of 4 of
+//  the 8 corners around the pixel, in 16 bit fixed point. The cube is only rebuilt
+//  when the hue position (or size) changes, optionally on its own background thread.
+//
+
+#ifndef HueLut_h
+#define HueLut_h
+
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Exact hue rotation, same math as ci::rgbToHSV / ci::hsvToRGB with the hue shift
+// the app has always applied. Values stay in 0-255, hue and saturation don't care
+// about the scale and value is the max channel.
+inline void rotateHueExact(float &r, float &g, float &b, float huePosition)
+{
+    float max = (r > g) ? ((r > b) ? r : b) : ((g > b) ? g : b);
+    float min = (r < g) ? ((r < b) ? r : b) : ((g < b) ? g : b);
+    float range = max - min;
+    float v = max;
+    float s = 0;
+    float h = 0;
+    if (max != 0) {
+        s = range / max;
+    }
+    if (s != 0) {
+        float hh;
+        if (r == max) {
+            hh = (g - b) / range;
+        } else if (g == max) {
+            hh = 2 + (b - r) / range;
+        } else {
+            hh = 4 + (r - g) / range;
+        }
+        h = hh / 6.0f;
+        if (h < 0.0f) {
+            h += 1.0f;
+        }
+    }
+
+    h += huePosition;
+    if (h > 1.f) {
+        h -= 1.f;
+    } else if (h < 0.f) {
+        h += 1.f;
+    }
+
+    r = g = b = 0.0f;
+    if (h == 1) {
+        h = 0;
+    } else {
+        h *= 6;
+    }
+    int i = static_cast<int>(floorf(h));
+    float f = h - i;
+    float p = v * (1 - s);
+    float q = v * (1 - (s * f));
+    float t = v * (1 - (s * (1 - f)));
+    switch (i) {
+        case 0: r = v; g = t; b = p; break;
+        case 1: r = q; g = v; b = p; break;
+        case 2: r = p; g = v; b = t; break;
+        case 3: r = p; g = q; b = v; break;
+        case 4: r = t; g = p; b = v; break;
+        case 5: r = v; g = p; b = q; break;
+    }
+}
+
+class HueLut {
+  public:
+    static const int MIN_SIZE = 2;
+    static const int MAX_SIZE = 65;
+    static const int DEFAULT_SIZE = 33;
+
+    HueLut();
+    ~HueLut();
+
+    // grid points per axis, takes effect on the next update()
+    void setSize(int size);
+    int getSize() const { return mSize; }
+    // build on a background thread, the previous cube stays in use until the new one is done
+    void setAsync(bool async);
+    bool isAsync() const { return mAsync; }
+
+    // call once per frame before apply(), rebuilds if huePosition or the size changed
+    void update(float huePosition);
+    // hue position of the cube apply() uses right now
+    float getAppliedHuePosition() const { return mTables[mFront].huePosition; }
+
+    // rotates the r, g, b bytes of count pixels in place, the same bytes with and without SSE2
+    void apply(uint8_t *pixels, int32_t count, uint8_t pixelInc,
+               uint8_t redOffset, uint8_t greenOffset, uint8_t blueOffset) const;
+
+  private:
+    struct Table {
+        std::vector<int16_t> entries;   // r, g, b, pad in 1 / 64 steps per grid point, r varies fastest
+        int                 size;
+        float               huePosition;
+        bool                valid;
+
+        Table() : size(0), huePosition(0.f), valid(false) {}
+    };
+
+    static void build(Table &table, int size, float huePosition);
+    void startBuilder();
+    void stopBuilder();
+    void builderLoop();
+
+    Table                   mTables[2];
+    int                     mFront;
+    int                     mSize;
+    bool                    mAsync;
+
+    std::thread             mBuilder;
+    std::mutex              mMutex;
+    std::condition_variable mCondition;
+    bool                    mBuilding;
+    bool                    mBuilt;
+    bool                    mQuit;
+    int                     mRequestedSize;
+    float                   mRequestedHue;
+};
+
+#endif /* HueLut_h */
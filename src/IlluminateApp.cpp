@@ -10,10 +10,16 @@
 #include "OscBundle.h"
 #include "OscListener.h"
 #include "OscMessage.h"
+#include "OscSender.h"
 #include "XmlSettings.h"
 #include "fileDialog.h"
+#include "CaptureResolutions.h"
+#include "FeedbackProcessor.h"
+#include "FramePipeline.h"
+#include "QualityGovernor.h"
 
-#define OSC_PORT    8000
+#define OSC_PORT        8000
+#define OSC_REPLY_PORT  9000    // on the host the last message came from
 
 using namespace ci;
 using namespace ci::app;
@@ -32,6 +38,12 @@ class IlluminateApp : public AppNative {
     
     const float ZOOM = 300, ML2R = -675, MT2B = -500, SKEW = 0, FEEDBACK = 0.9, HUE_ROT_SPD_FACTOR = 0.01f, NEW_FRAME_MIX = 0.f;
     const int FRAME_SKIP = 0;
+    // capture pixels processed around the visible part, covers texture filtering and
+    // the camera moving while a pipelined frame is on its way
+    const int VISIBLE_REGION_MARGIN = 16;
+    // share of the frame time the governor gives the effect, the rest is upload and
+    // draw. Pipelined the effect has its own thread and nearly the whole frame.
+    const float EFFECT_BUDGET_SHARE = 0.6f, PIPELINED_EFFECT_BUDGET_SHARE = 0.9f;
     
     // setup our functions/methods
     void prepareSettings(Settings *settings);
@@ -52,8 +64,10 @@ class IlluminateApp : public AppNative {
     
     bool                mCameraActive;
     CaptureRef	        mCapture;
-    Surface             mImgSurface;
+    FeedbackProcessor   mProcessor;
+    FramePipeline       mPipeline;
     Surface             mDisplaySurface;
+    SurfaceChannelOrder mCaptureChannelOrder;
     gl::Texture         imgTexture;
     
     params::InterfaceGl	mParams;
@@ -72,10 +86,70 @@ class IlluminateApp : public AppNative {
     
     float               mFeedback;
     int                 mFrameSkip;
-    int                 mSkippedFrames;
     bool                mBlurOn;
+    bool                mIntegerFeedback;
+    bool                mHighPrecision;
+    bool                mLazyDecay;
+    bool                mLinearLight;       // trail decays in linear light, over the two above
+    bool                mBatchFrameSkip;
+    int                 mBlendMode;         // FeedbackBlendMode
+    float               mBlendWeight;
+    int                 mSpatialBlurRadius;
+    int                 mSpatialBlurPasses;
+    int                 mNumThreads;
+    bool                mPipelined;
+    float               mPipelineLatencyMs;
+    float               mEffectMs;
+    int                 mDroppedFrames;
+    bool                mVisibleRegionOnly;
+    int                 mProcessingScale;   // 0 full, 1 half, 2 quarter capture resolution
+    FrameRect           mVisibleRegion;
+    float               mProcessedAreaPercent;
+    QualityGovernor     mGovernor;
+    bool                mGovernorOn;
+    int                 mQualityLevel;
+    int                 mCapturedFrames;
+    int                 mHistoryDepth;
+    int                 mHistoryBudgetMB;
+    int                 mEchoTaps;          // past frames blended in, mEchoSpacing frames apart
+    int                 mEchoSpacing;
+    float               mEchoMix;           // output share of all taps together
+    int                 mHistoryFrames;
+    float               mHistoryMB;
+    int                 mDisplacementDepth;     // time displacement over this many frames, 0 off
+    int                 mDisplacementDirection; // 0 rows, 1 columns
+    int                 mTrailLayers;       // trails over the main one, each with its own length, gate and tint
+    float               mLayerFeedback[MAX_TRAIL_LAYERS];
+    float               mLayerGate[MAX_TRAIL_LAYERS];
+    Color               mLayerTint[MAX_TRAIL_LAYERS];
+    int                 mBloomLevels;       // glow pyramid levels, 0 off
+    float               mBloomThreshold;
+    float               mBloomIntensity;
+    int                 mBloomRadius;
+    float               mBloomLevelMs[Bloom::MAX_LEVELS];
+    bool                mBackgroundOn;      // only what differs from the learnt background feeds the trail
+    float               mBackgroundThreshold;
+    float               mBackgroundLearnRate;
+    int                 mBackgroundResets;  // bumped to learn the background again
+    bool                mLumaKeyOn;         // only what's brighter than the key feeds the trail
+    float               mLumaKeyThreshold;
+    float               mLumaKeyKnee;
+    float               mLumaKeyHysteresis;
+    bool                mMotionTrailsOn;    // the trail moves along with what moves in the frame
+    int                 mMotionSearch;
+    float               mMotionAmount;
+    float               mMotionMs;
+    bool                mEdgeModeOn;        // outline trails, only the edges of the frame go in
+    float               mEdgeGain;
+    bool                mGradientMapOn;     // output coloured from a palette by its brightness, in place of its hue
+    std::shared_ptr<const GradientMap> mGradientPalettes;  // built in ones and any loaded after
+    int                 mGradientPalette;
+    std::string         mGradientPaletteName;
+    int                 mPosterizeLevels;   // 0 keeps every level
+    bool                mGradientIntensity; // by the brightest colour rather than luma
     
     bool                mHueModOn;
+    bool                mHueLutOn;
     float               mHueRotSpeed;
     float               mHuePosition;
     float               mHueCenter;
@@ -88,6 +162,8 @@ class IlluminateApp : public AppNative {
     float               mNewestFrameMix;
     
     osc::Listener       listener;
+    osc::Sender         mOscSender;
+    std::string         mOscReplyHost;
     
     cinder::Area        mDrawArea;
     Rectf               mDrawAreaScreen;
@@ -106,8 +182,29 @@ class IlluminateApp : public AppNative {
     void setupSettings();
     void loadSettings();
     void saveSettings();
+    // adds the palettes of a file chosen in a dialog to the gradient map ones
+    void loadPalettes();
+    
+    // the controls as they are, before the governor lowers anything
+    FeedbackParams getFeedbackParams() const;
+    // part of the capture the current camera transform puts on screen, plus the margin
+    FrameRect getVisibleRegion() const;
+    // feeds one processed frame's effect time to the governor
+    void governQuality(float effectMs);
+    // shows the frame history's memory use, logged when it changes
+    void reportHistory(int frames, size_t bytes);
+    // shows the glow's time per pyramid level
+    void reportBloom(const Bloom::Timings &timings);
+    // logs the governor's last decision and sends the state to the OSC controller
+    void reportQuality();
 };
 
+static FrameView frameViewOf(Surface &surface)
+{
+    return FrameView(surface.getData(), surface.getWidth(), surface.getHeight(), surface.getRowBytes(),
+                     surface.getPixelInc(), surface.getRedOffset(), surface.getGreenOffset(), surface.getBlueOffset());
+}
+
 void IlluminateApp::setupSettings() {
     mSettings.addParam("zoom", &mCameraDistance);
     mSettings.addParam("movel2r", &mMoveL2R);
@@ -116,7 +213,56 @@ void IlluminateApp::setupSettings() {
     mSettings.addParam("feedback", &mFeedback);
     mSettings.addParam("frameskip", &mFrameSkip);
     mSettings.addParam("bluron", &mBlurOn);
+    mSettings.addParam("integerfeedback", &mIntegerFeedback);
+    mSettings.addParam("highprecision", &mHighPrecision);
+    mSettings.addParam("lazydecay", &mLazyDecay);
+    mSettings.addParam("linearlight", &mLinearLight);
+    mSettings.addParam("batchframeskip", &mBatchFrameSkip);
+    mSettings.addParam("blendmode", &mBlendMode);
+    mSettings.addParam("blendweight", &mBlendWeight);
+    mSettings.addParam("spatialblurradius", &mSpatialBlurRadius);
+    mSettings.addParam("spatialblurpasses", &mSpatialBlurPasses);
+    mSettings.addParam("threads", &mNumThreads);
+    mSettings.addParam("pipelined", &mPipelined);
+    mSettings.addParam("visibleregiononly", &mVisibleRegionOnly);
+    mSettings.addParam("processingscale", &mProcessingScale);
+    mSettings.addParam("governor", &mGovernorOn);
+    mSettings.addParam("historydepth", &mHistoryDepth);
+    mSettings.addParam("historybudgetmb", &mHistoryBudgetMB);
+    mSettings.addParam("echotaps", &mEchoTaps);
+    mSettings.addParam("echospacing", &mEchoSpacing);
+    mSettings.addParam("echomix", &mEchoMix);
+    mSettings.addParam("displacementdepth", &mDisplacementDepth);
+    mSettings.addParam("displacementdirection", &mDisplacementDirection);
+    mSettings.addParam("traillayers", &mTrailLayers);
+    for (int l = 0 ; l < MAX_TRAIL_LAYERS ; l++) {
+        const std::string layer = "layer" + toString(l + 1);
+        mSettings.addParam(layer + "feedback", &mLayerFeedback[l]);
+        mSettings.addParam(layer + "gate", &mLayerGate[l]);
+        mSettings.addParam(layer + "tint", &mLayerTint[l]);
+    }
+    mSettings.addParam("bloomlevels", &mBloomLevels);
+    mSettings.addParam("bloomthreshold", &mBloomThreshold);
+    mSettings.addParam("bloomintensity", &mBloomIntensity);
+    mSettings.addParam("bloomradius", &mBloomRadius);
+    mSettings.addParam("background", &mBackgroundOn);
+    mSettings.addParam("backgroundthreshold", &mBackgroundThreshold);
+    mSettings.addParam("backgroundlearnrate", &mBackgroundLearnRate);
+    mSettings.addParam("lumakey", &mLumaKeyOn);
+    mSettings.addParam("lumakeythreshold", &mLumaKeyThreshold);
+    mSettings.addParam("lumakeyknee", &mLumaKeyKnee);
+    mSettings.addParam("lumakeyhysteresis", &mLumaKeyHysteresis);
+    mSettings.addParam("motiontrails", &mMotionTrailsOn);
+    mSettings.addParam("motionsearch", &mMotionSearch);
+    mSettings.addParam("motionamount", &mMotionAmount);
+    mSettings.addParam("edgemode", &mEdgeModeOn);
+    mSettings.addParam("edgegain", &mEdgeGain);
+    mSettings.addParam("gradientmap", &mGradientMapOn);
+    mSettings.addParam("gradientpalette", &mGradientPalette);
+    mSettings.addParam("posterizelevels", &mPosterizeLevels);
+    mSettings.addParam("gradientintensity", &mGradientIntensity);
     mSettings.addParam("huemodon", &mHueModOn);
+    mSettings.addParam("huelut", &mHueLutOn);
     mSettings.addParam("huecenter", &mHueCenter);
     mSettings.addParam("huewidth", &mHueWidth);
     mSettings.addParam("huerotspeed", &mHueRotSpeed);
@@ -139,6 +285,19 @@ void IlluminateApp::saveSettings() {
     }
 }
 
+void IlluminateApp::loadPalettes() {
+    string filename = openFileDialog(NULL);
+    
+    // a copy, a frame still being processed keeps the palettes it started with
+    std::shared_ptr<GradientMap> palettes(new GradientMap(*mGradientPalettes));
+    if (!filename.empty() && palettes->loadFile(filename)) {
+        mGradientPalettes = palettes;
+        console() << "loaded palettes from file " << filename << ", " << palettes->getNumPalettes() << " palettes" << endl;
+    } else {
+        console() << "error loading palettes from file " << filename << endl;
+    }
+}
+
 void IlluminateApp::loadSettings() {
     string filename = openFileDialog(NULL);
     
@@ -190,10 +349,6 @@ void IlluminateApp::setup()
 {
     setupSettings();
     
-    int numCaptureResolutions = 7;
-    int captureResolutionsWidth[] = {640, 800, 1024, 1280, 1920, 2048, 2560};
-    int captureResolutionsHeight[] = {480, 600, 768, 720, 1080, 1152, 1440};
-    
     mCaptureInfos = vector<CaptureInfo>();
     
     mCaptureInfo = CaptureInfo();
@@ -232,12 +387,76 @@ void IlluminateApp::setup()
     
     mFeedback = FEEDBACK;
     mFrameSkip = FRAME_SKIP;
-    mSkippedFrames = 0;
+    mIntegerFeedback = false;
+    mHighPrecision = false;
+    mLazyDecay = false;
+    mLinearLight = false;
+    mBatchFrameSkip = false;
+    mBlendMode = BLEND_MODE_LIGHTEN;
+    mBlendWeight = 0.5f;
+    mSpatialBlurRadius = 0;
+    mSpatialBlurPasses = 3;
+    mNumThreads = 0; // one per core
+    mPipelined = false;
+    mPipelineLatencyMs = 0.f;
+    mEffectMs = 0.f;
+    mDroppedFrames = 0;
+    mVisibleRegionOnly = true;
+    mProcessingScale = 0;
+    mGovernorOn = false;
+    mQualityLevel = 0;
+    mCapturedFrames = 0;
+    mHistoryDepth = 0;
+    mHistoryBudgetMB = 512;
+    mEchoTaps = 0;
+    mEchoSpacing = 4;
+    mEchoMix = 0.5f;
+    mHistoryFrames = 0;
+    mHistoryMB = 0.f;
+    mDisplacementDepth = 0;
+    mDisplacementDirection = 0;
+    mTrailLayers = 0;
+    // each layer longer and dimmer than the one before
+    const float layerFeedbacks[MAX_TRAIL_LAYERS] = { 0.97f, 0.99f, 0.997f };
+    const float layerTints[MAX_TRAIL_LAYERS] = { 0.6f, 0.4f, 0.25f };
+    for (int l = 0 ; l < MAX_TRAIL_LAYERS ; l++) {
+        mLayerFeedback[l] = layerFeedbacks[l];
+        mLayerGate[l] = 0.f;
+        mLayerTint[l] = Color(layerTints[l], layerTints[l], layerTints[l]);
+    }
+    mBloomLevels = 0;
+    mBloomThreshold = 0.6f;
+    mBloomIntensity = 1.f;
+    mBloomRadius = 4;
+    std::fill(mBloomLevelMs, mBloomLevelMs + Bloom::MAX_LEVELS, 0.f);
+    mBackgroundOn = false;
+    mBackgroundThreshold = 0.1f;
+    mBackgroundLearnRate = 0.01f;
+    mBackgroundResets = 0;
+    mLumaKeyOn = false;
+    mLumaKeyThreshold = 0.15f;
+    mLumaKeyKnee = 0.1f;
+    mLumaKeyHysteresis = 0.05f;
+    mMotionTrailsOn = false;
+    mMotionSearch = 4;
+    mMotionAmount = 1.f;
+    mMotionMs = 0.f;
+    mEdgeModeOn = false;
+    mEdgeGain = 1.f;
+    mGradientMapOn = false;
+    mGradientPalettes.reset(new GradientMap());
+    mGradientPalette = 0;
+    mGradientPaletteName = mGradientPalettes->getName(mGradientPalette);
+    mPosterizeLevels = 0;
+    mGradientIntensity = false;
+    mProcessedAreaPercent = 100.f;
     
     mFlipHorz = true;
     mFlipVert = false;
     
     mHueModOn = false;
+    mHueLutOn = true;
+    mProcessor.getHueLut().setAsync(true);
     mHueRotSpeed = 0.f;
     mHuePosition = 0.f;
     mHueCenter = 0.f;
@@ -256,8 +475,74 @@ void IlluminateApp::setup()
     mParams.addParam( "Skew", &mSkew, "min=-85.0 max=85.0 step=1.0 keyIncr=r keyDecr=f" );
     mParams.addParam( "Feedback", &mFeedback, "min=0.000001 max=1.0 step=0.001 keyIncr=t keyDecr=g" );
     mParams.addParam( "Frame Skip", &mFrameSkip, "min=0 max=20 step=1 keyIncr=y keyDecr=h" );
+    mParams.addParam( "Batch skipped frames", &mBatchFrameSkip, "" );
+    const std::string blendModeNames[] = { "Lighten", "Screen", "Add", "Difference", "Average" };
+    mParams.addParam( "Trail blend", vector<string>(blendModeNames, blendModeNames + NUM_BLEND_MODES), &mBlendMode );
+    mParams.addParam( "Trail blend weight", &mBlendWeight, "min=0.00 max=1.0 step=0.01" );
     mParams.addParam( "Blur active", &mBlurOn, "" );
+    mParams.addParam( "Trail blur radius", &mSpatialBlurRadius, "min=0 max=64 step=1" );
+    mParams.addParam( "Trail blur passes", &mSpatialBlurPasses, "min=1 max=3 step=1" );
+    mParams.addParam( "Integer feedback", &mIntegerFeedback, "" );
+    mParams.addParam( "16 bit trail", &mHighPrecision, "" );
+    mParams.addParam( "Global gain decay", &mLazyDecay, "" );
+    mParams.addParam( "Linear light trail", &mLinearLight, "" );
+    mParams.addParam( "Worker threads (0 auto)", &mNumThreads, "min=0 max=32 step=1" );
+    mParams.addParam( "Pipelined effect", &mPipelined, "" );
+    mParams.addParam( "Effect ms", &mEffectMs, "", true );
+    mParams.addParam( "Pipeline latency ms", &mPipelineLatencyMs, "", true );
+    mParams.addParam( "Pipeline dropped frames", &mDroppedFrames, "", true );
+    mParams.addParam( "Process visible area only", &mVisibleRegionOnly, "" );
+    const std::string processingScaleNames[] = { "1", "1/2", "1/4" };
+    mParams.addParam( "Processing scale", vector<string>(processingScaleNames, processingScaleNames + 3), &mProcessingScale );
+    mParams.addParam( "Processed area %", &mProcessedAreaPercent, "", true );
+    mParams.addParam( "Quality governor", &mGovernorOn, "" );
+    mParams.addParam( "Quality level", &mQualityLevel, "", true );
+    mParams.addParam( "History depth", &mHistoryDepth, "min=0 max=240 step=1" );
+    mParams.addParam( "History budget MB", &mHistoryBudgetMB, "min=0 max=8192 step=64" );
+    mParams.addParam( "Echo taps", &mEchoTaps, "min=0 max=4 step=1" );
+    mParams.addParam( "Echo spacing", &mEchoSpacing, "min=1 max=60 step=1" );
+    mParams.addParam( "Echo mix", &mEchoMix, "min=0.00 max=1.0 step=0.01" );
+    mParams.addParam( "Time displacement depth", &mDisplacementDepth, "min=0 max=240 step=1" );
+    const std::string displacementDirectionNames[] = { "Rows", "Columns" };
+    mParams.addParam( "Time displacement", vector<string>(displacementDirectionNames, displacementDirectionNames + 2), &mDisplacementDirection );
+    mParams.addParam( "Trail layers", &mTrailLayers, "min=0 max=" + toString(MAX_TRAIL_LAYERS) + " step=1" );
+    for (int l = 0 ; l < MAX_TRAIL_LAYERS ; l++) {
+        const std::string layer = "Layer " + toString(l + 1);
+        mParams.addParam( layer + " feedback", &mLayerFeedback[l], "min=0.00 max=1.0 step=0.001" );
+        mParams.addParam( layer + " gate", &mLayerGate[l], "min=0.00 max=1.0 step=0.01" );
+        mParams.addParam( layer + " tint", &mLayerTint[l] );
+    }
+    mParams.addParam( "Bloom levels", &mBloomLevels, "min=0 max=" + toString(Bloom::MAX_LEVELS) + " step=1" );
+    mParams.addParam( "Bloom threshold", &mBloomThreshold, "min=0.00 max=1.0 step=0.01" );
+    mParams.addParam( "Bloom intensity", &mBloomIntensity, "min=0.00 max=4.0 step=0.05" );
+    mParams.addParam( "Bloom radius", &mBloomRadius, "min=0 max=16 step=1" );
+    for (int l = 0 ; l < Bloom::MAX_LEVELS ; l++) {
+        mParams.addParam( "Bloom level " + toString(l) + " ms", &mBloomLevelMs[l], "", true );
+    }
+    mParams.addParam( "Background subtraction", &mBackgroundOn, "" );
+    mParams.addParam( "Background threshold", &mBackgroundThreshold, "min=0.00 max=1.0 step=0.01" );
+    mParams.addParam( "Background learn rate", &mBackgroundLearnRate, "min=0.000 max=1.0 step=0.001" );
+    mParams.addButton( "Re-learn background", [&]{mBackgroundResets++;} );
+    mParams.addParam( "Luma key", &mLumaKeyOn, "" );
+    mParams.addParam( "Luma key threshold", &mLumaKeyThreshold, "min=0.00 max=1.0 step=0.01" );
+    mParams.addParam( "Luma key knee", &mLumaKeyKnee, "min=0.00 max=1.0 step=0.01" );
+    mParams.addParam( "Luma key hysteresis", &mLumaKeyHysteresis, "min=0.00 max=1.0 step=0.01" );
+    mParams.addParam( "Motion trails", &mMotionTrailsOn, "" );
+    mParams.addParam( "Motion search", &mMotionSearch, "min=1 max=" + toString(MotionField::MAX_SEARCH) + " step=1" );
+    mParams.addParam( "Motion amount", &mMotionAmount, "min=0.00 max=2.0 step=0.05" );
+    mParams.addParam( "Motion ms", &mMotionMs, "", true );
+    mParams.addParam( "Edge mode", &mEdgeModeOn, "" );
+    mParams.addParam( "Edge gain", &mEdgeGain, "min=0.00 max=4.0 step=0.05" );
+    mParams.addParam( "Gradient map", &mGradientMapOn, "" );
+    mParams.addParam( "Gradient palette", &mGradientPalette, "step=1" );
+    mParams.addParam( "Palette name", &mGradientPaletteName, "", true );
+    mParams.addParam( "Posterize levels", &mPosterizeLevels, "min=0 max=" + toString(GradientMap::MAX_POSTERIZE_LEVELS) + " step=1" );
+    mParams.addParam( "Gradient by intensity", &mGradientIntensity, "" );
+    mParams.addButton( "Load palettes", [&]{loadPalettes();} );
+    mParams.addParam( "History frames", &mHistoryFrames, "", true );
+    mParams.addParam( "History MB", &mHistoryMB, "", true );
     mParams.addParam( "Hue rotation active", &mHueModOn, "" );
+    mParams.addParam( "Hue rotation LUT", &mHueLutOn, "" );
     mParams.addParam( "Hue rotation center", &mHueCenter, "min=0.00 max=1.0 step=0.01" );
     mParams.addParam( "Hue rotation width", &mHueWidth, "min=0.00 max=1.0 step=0.01" );
     mParams.addParam( "Hue rotation spd", &mHueRotSpeed, "min=0.00 max=1.0 step=0.01 keyIncr=y keyDecr=h" );
@@ -397,6 +682,115 @@ void IlluminateApp::keyDown( KeyEvent event )
     }
 }
 
+FeedbackParams IlluminateApp::getFeedbackParams() const
+{
+    FeedbackParams params;
+    params.feedback = mFeedback;
+    params.frameSkip = mFrameSkip;
+    params.blurOn = mBlurOn;
+    params.hueModOn = mHueModOn;
+    params.huePosition = mHuePosition;
+    params.newestFrameMix = mNewestFrameMix;
+    params.integerFeedback = mIntegerFeedback;
+    params.highPrecision = mHighPrecision;
+    params.lazyDecay = mLazyDecay;
+    params.linearLight = mLinearLight;
+    params.batchFrameSkip = mBatchFrameSkip;
+    params.blendMode = (FeedbackBlendMode)std::min(std::max(mBlendMode, 0), NUM_BLEND_MODES - 1);
+    params.blendWeight = mBlendWeight;
+    params.spatialBlurRadius = mSpatialBlurRadius;
+    params.spatialBlurPasses = mSpatialBlurPasses;
+    params.hueLut = mHueLutOn;
+    params.numThreads = mNumThreads;
+    params.region = mVisibleRegion;
+    params.downscale = 1 << std::min(std::max(mProcessingScale, 0), 2);
+    // taps mEchoSpacing, 2 * mEchoSpacing ... frames back, sharing the mix, the history
+    // goes at least as deep as the oldest one
+    params.numEchoTaps = std::min(std::max(mEchoTaps, 0), MAX_ECHO_TAPS);
+    const int echoSpacing = std::max(mEchoSpacing, 1);
+    for (int t = 0 ; t < params.numEchoTaps ; t++) {
+        params.echoTaps[t].age = (t + 1) * echoSpacing;
+        params.echoTaps[t].weight = mEchoMix / params.numEchoTaps;
+    }
+    params.numTrailLayers = std::min(std::max(mTrailLayers, 0), MAX_TRAIL_LAYERS);
+    for (int l = 0 ; l < params.numTrailLayers ; l++) {
+        TrailLayer &layer = params.trailLayers[l];
+        layer.feedback = mLayerFeedback[l];
+        layer.gate = mLayerGate[l];
+        layer.tintRed = mLayerTint[l].r;
+        layer.tintGreen = mLayerTint[l].g;
+        layer.tintBlue = mLayerTint[l].b;
+    }
+    params.bloomLevels = std::min(std::max(mBloomLevels, 0), (int)Bloom::MAX_LEVELS);
+    params.bloomThreshold = mBloomThreshold;
+    params.bloomIntensity = mBloomIntensity;
+    params.bloomRadius = std::min(std::max(mBloomRadius, 0), (int)BoxBlur::MAX_RADIUS);
+    params.backgroundSubtraction = mBackgroundOn;
+    params.backgroundThreshold = mBackgroundThreshold;
+    params.backgroundLearnRate = mBackgroundLearnRate;
+    params.backgroundResets = mBackgroundResets;
+    params.lumaKey = mLumaKeyOn;
+    params.lumaKeyThreshold = mLumaKeyThreshold;
+    params.lumaKeyKnee = mLumaKeyKnee;
+    params.lumaKeyHysteresis = mLumaKeyHysteresis;
+    params.motionTrails = mMotionTrailsOn;
+    params.motionSearch = std::min(std::max(mMotionSearch, 1), (int)MotionField::MAX_SEARCH);
+    params.motionAmount = mMotionAmount;
+    params.edgeMode = mEdgeModeOn;
+    params.edgeGain = mEdgeGain;
+    params.gradientMap = mGradientMapOn;
+    params.gradientPalettes = mGradientPalettes;
+    params.gradientPalette = mGradientPalette;
+    params.posterizeLevels = std::min(std::max(mPosterizeLevels, 0), (int)GradientMap::MAX_POSTERIZE_LEVELS);
+    params.gradientIntensity = mGradientIntensity;
+    params.displacementDepth = std::max(mDisplacementDepth, 0);
+    params.displaceColumns = mDisplacementDirection == 1;
+    params.historyDepth = std::max(std::max(mHistoryDepth, params.displacementDepth),
+                                   params.numEchoTaps > 0 ? params.numEchoTaps * echoSpacing + 1 : 0);
+    params.historyBudgetMB = mHistoryBudgetMB;
+    return params;
+}
+
+FrameRect IlluminateApp::getVisibleRegion() const
+{
+    if (mDrawArea.getWidth() <= 0 || mDrawArea.getHeight() <= 0) {
+        return FrameRect();
+    }
+    // The texture is drawn onto the z = 0 plane, capture pixel (x, y) at (x, y) * scale.
+    // Each window corner is unprojected into a ray that is cut with that plane, the
+    // visible part of the plane is the quad between the four points.
+    const float scale = mDrawAreaScreen.getWidth() / (float)mDrawArea.getWidth();
+    const Matrix44f unproject = (gl::getProjection() * gl::getModelView()).inverted();
+    const float corners[4][2] = { {-1.f, -1.f}, {1.f, -1.f}, {1.f, 1.f}, {-1.f, 1.f} };
+    Rectf visible;
+    for (int c = 0 ; c < 4 ; c++) {
+        Vec4f nearPoint = unproject * Vec4f(corners[c][0], corners[c][1], -1.f, 1.f);
+        Vec4f farPoint = unproject * Vec4f(corners[c][0], corners[c][1], 1.f, 1.f);
+        if (nearPoint.w == 0.f || farPoint.w == 0.f) {
+            return FrameRect();
+        }
+        const Vec3f a = nearPoint.xyz() / nearPoint.w;
+        const Vec3f b = farPoint.xyz() / farPoint.w;
+        // a corner that doesn't reach the plane between the clip planes sees past its
+        // edge (strong skew), keep it simple and process everything
+        if (a.z == b.z) {
+            return FrameRect();
+        }
+        const float t = a.z / (a.z - b.z);
+        if (t < 0.f || t > 1.f) {
+            return FrameRect();
+        }
+        const Vec2f point = (a.xy() + (b.xy() - a.xy()) * t) / scale;
+        if (c == 0) {
+            visible = Rectf(point, point);
+        } else {
+            visible.include(point);
+        }
+    }
+    return FrameRect((int32_t)floorf(visible.x1) - VISIBLE_REGION_MARGIN, (int32_t)floorf(visible.y1) - VISIBLE_REGION_MARGIN,
+                     (int32_t)ceilf(visible.x2) + VISIBLE_REGION_MARGIN, (int32_t)ceilf(visible.y2) + VISIBLE_REGION_MARGIN);
+}
+
 void IlluminateApp::update()
 {
     // get osc messages
@@ -405,6 +799,10 @@ void IlluminateApp::update()
         while (listener.hasWaitingMessages()) {
             listener.getNextMessage(&message);
             console() << "OSC message: " << message.getAddress() << std::endl;
+            if (message.getRemoteIp() != mOscReplyHost) {
+                mOscReplyHost = message.getRemoteIp();
+                mOscSender.setup(mOscReplyHost, OSC_REPLY_PORT);
+            }
             // process message
             if (message.getAddress().compare("/1/zoom") == 0) {
                 mCameraDistance = 50.f + (message.getArgAsFloat(0) * 1450.f);
@@ -419,8 +817,86 @@ void IlluminateApp::update()
                 mFlipVert = message.getArgAsFloat(0) != 0.f;
             } else if (message.getAddress().compare("/1/frame_skip") == 0) {
                 mFrameSkip = message.getArgAsInt32(0);
+            } else if (message.getAddress().compare("/1/processing_scale") == 0) {
+                // 0 full, 1 half, 2 quarter resolution
+                mProcessingScale = std::min(std::max(message.getArgAsInt32(0), 0), 2);
+            } else if (message.getAddress().compare("/1/displacement_depth") == 0) {
+                // frames, 0 switches the time displacement off
+                mDisplacementDepth = std::min(std::max(message.getArgAsInt32(0), 0), 240);
+            } else if (message.getAddress().compare("/1/displacement_direction") == 0) {
+                // 0 rows, 1 columns
+                mDisplacementDirection = std::min(std::max(message.getArgAsInt32(0), 0), 1);
+            } else if (message.getAddress().compare("/1/governor") == 0) {
+                mGovernorOn = message.getArgAsFloat(0) != 0.f;
+            } else if (message.getAddress().compare("/1/quality") == 0) {
+                reportQuality();
             } else if (message.getAddress().compare("/1/blur_switch") == 0) {
                 mBlurOn = message.getArgAsFloat(0) != 0.f;
+            } else if (message.getAddress().compare("/1/blend_mode") == 0) {
+                // 0 lighten, 1 screen, 2 add, 3 difference, 4 average
+                mBlendMode = std::min(std::max(message.getArgAsInt32(0), 0), NUM_BLEND_MODES - 1);
+            } else if (message.getAddress().compare("/1/blend_weight") == 0) {
+                mBlendWeight = message.getArgAsFloat(0);
+            } else if (message.getAddress().compare("/1/spatial_blur_radius") == 0) {
+                // pixels, 0 switches the trail blur off
+                mSpatialBlurRadius = std::min(std::max(message.getArgAsInt32(0), 0), (int)BoxBlur::MAX_RADIUS);
+            } else if (message.getAddress().compare("/1/spatial_blur_passes") == 0) {
+                mSpatialBlurPasses = std::min(std::max(message.getArgAsInt32(0), 1), (int)BoxBlur::MAX_PASSES);
+            } else if (message.getAddress().compare("/1/bloom_levels") == 0) {
+                // 0 switches the glow off
+                mBloomLevels = std::min(std::max(message.getArgAsInt32(0), 0), (int)Bloom::MAX_LEVELS);
+            } else if (message.getAddress().compare("/1/bloom_threshold") == 0) {
+                mBloomThreshold = message.getArgAsFloat(0);
+            } else if (message.getAddress().compare("/1/bloom_intensity") == 0) {
+                // fader 0-1 to intensity 0-4
+                mBloomIntensity = message.getArgAsFloat(0) * 4.f;
+            } else if (message.getAddress().compare("/1/bloom_radius") == 0) {
+                mBloomRadius = std::min(std::max(message.getArgAsInt32(0), 0), 16);
+            } else if (message.getAddress().compare("/1/background_switch") == 0) {
+                mBackgroundOn = message.getArgAsFloat(0) != 0.f;
+            } else if (message.getAddress().compare("/1/background_threshold") == 0) {
+                mBackgroundThreshold = message.getArgAsFloat(0);
+            } else if (message.getAddress().compare("/1/background_learn_rate") == 0) {
+                mBackgroundLearnRate = message.getArgAsFloat(0);
+            } else if (message.getAddress().compare("/1/background_relearn") == 0) {
+                // the next frame processed becomes the background
+                mBackgroundResets++;
+            } else if (message.getAddress().compare("/1/luma_key_switch") == 0) {
+                mLumaKeyOn = message.getArgAsFloat(0) != 0.f;
+            } else if (message.getAddress().compare("/1/luma_key_threshold") == 0) {
+                mLumaKeyThreshold = message.getArgAsFloat(0);
+            } else if (message.getAddress().compare("/1/luma_key_knee") == 0) {
+                mLumaKeyKnee = message.getArgAsFloat(0);
+            } else if (message.getAddress().compare("/1/luma_key_hysteresis") == 0) {
+                mLumaKeyHysteresis = message.getArgAsFloat(0);
+            } else if (message.getAddress().compare("/1/motion_switch") == 0) {
+                mMotionTrailsOn = message.getArgAsFloat(0) != 0.f;
+            } else if (message.getAddress().compare("/1/motion_amount") == 0) {
+                // fader 0-1 to 0-2
+                mMotionAmount = message.getArgAsFloat(0) * 2.f;
+            } else if (message.getAddress().compare("/1/motion_search") == 0) {
+                mMotionSearch = std::min(std::max(message.getArgAsInt32(0), 1), (int)MotionField::MAX_SEARCH);
+            } else if (message.getAddress().compare("/1/edge_switch") == 0) {
+                mEdgeModeOn = message.getArgAsFloat(0) != 0.f;
+            } else if (message.getAddress().compare("/1/edge_gain") == 0) {
+                // fader 0-1 to 0-4
+                mEdgeGain = message.getArgAsFloat(0) * 4.f;
+            } else if (message.getAddress().compare("/1/linear_light_switch") == 0) {
+                mLinearLight = message.getArgAsFloat(0) != 0.f;
+            } else if (message.getAddress().compare("/1/gradient_switch") == 0) {
+                mGradientMapOn = message.getArgAsFloat(0) != 0.f;
+            } else if (message.getAddress().compare("/1/gradient_palette") == 0) {
+                // wraps around the palettes
+                mGradientPalette = message.getArgAsInt32(0);
+            } else if (message.getAddress().compare("/1/gradient_next") == 0) {
+                mGradientPalette++;
+            } else if (message.getAddress().compare("/1/posterize_levels") == 0) {
+                // 0 or 1 keeps every level
+                mPosterizeLevels = std::min(std::max(message.getArgAsInt32(0), 0), (int)GradientMap::MAX_POSTERIZE_LEVELS);
+            } else if (message.getAddress().compare("/1/gradient_intensity") == 0) {
+                mGradientIntensity = message.getArgAsFloat(0) != 0.f;
+            } else if (message.getAddress().compare("/1/gradient_load") == 0) {
+                loadPalettes();
             } else if (message.getAddress().compare("/1/blur_amt") == 0) {
                 mFeedback = message.getArgAsFloat(0);
             } else if (message.getAddress().compare("/1/col_rot_switch") == 0) {
@@ -443,6 +919,18 @@ void IlluminateApp::update()
         }
     }
     
+    // draw area first, the visible region below is worked out from it
+    if (mCaptureInfo.width > 0 && mCaptureInfo.height > 0) {
+        mDrawArea.set(0, 0, mCaptureInfo.width, mCaptureInfo.height);
+        // update draw area
+        float multiplier = getWindowBounds().getWidth() / ((float)mCaptureInfo.width);
+        mDrawAreaScreen = Rectf(0, 0, ((float)mCaptureInfo.width) * multiplier, ((float)mCaptureInfo.height) * multiplier);
+        if (mDrawArea.getHeight() < getWindowBounds().getHeight()) {
+            multiplier = getWindowBounds().getHeight() / ((float)mCaptureInfo.height);
+            mDrawAreaScreen = Rectf(0, 0, mDrawArea.getX2() * multiplier, mDrawArea.getY2() * multiplier);
+        }
+    }
+    
     if (mCapture && mCapture->isCapturing()) {
         mHuePosition += (mHueRotSpeed * HUE_ROT_SPD_FACTOR * (mHueDirection ? 1.f : -1.f));
         float upperBound = mHueCenter + (mHueWidth / 2.f);
@@ -463,90 +951,120 @@ void IlluminateApp::update()
         gl::rotate(180);
         gl::rotate(Vec3f(mSkew, mFlipHorz ? 180 : 0, mFlipVert ? 180 : 0));
         gl::translate(mTrans);
+        
+        // only the part of the capture that ends up on screen is processed
+        mVisibleRegion = mVisibleRegionOnly ? getVisibleRegion() : FrameRect();
+        const FrameRect processed = mVisibleRegion.clippedTo(mCaptureInfo.width, mCaptureInfo.height);
+        mProcessedAreaPercent = mCaptureInfo.width > 0 && mCaptureInfo.height > 0
+                              ? (100.f * processed.getWidth() * processed.getHeight()) / (mCaptureInfo.width * mCaptureInfo.height) : 100.f;
     }
     
-    if (mCapture && mCapture->checkNewFrame()) {
-        mCameraActive = true;
-        if (++mSkippedFrames >= mFrameSkip) {
-            mSkippedFrames = 0;
+    if (mPipelined && !mPipeline.isRunning()) {
+        mPipeline.start(&mProcessor);
+    } else if (!mPipelined && mPipeline.isRunning()) {
+        // the processor is back on this thread once stop() returns
+        mPipeline.stop();
+    }
+    
+    const int qualityLevel = mGovernor.getLevel();
+    mGovernor.setEnabled(mGovernorOn);
+    if (mGovernor.getLevel() != qualityLevel) {
+        reportQuality();
+    }
+    mGovernor.setBudgetMs((1000.f / getFrameRate()) * (mPipelined ? PIPELINED_EFFECT_BUDGET_SHARE : EFFECT_BUDGET_SHARE));
+    // the lowest quality levels leave captured frames out
+    const bool captured = mCapture && mCapture->checkNewFrame();
+    const bool processFrame = captured && (mCapturedFrames++ % mGovernor.getFrameInterval()) == 0;
+    FeedbackParams params = getFeedbackParams();
+    mGovernor.apply(params);
+    mGradientPaletteName = mGradientPalettes->getName(mGradientPalette);
+    
+    if (mPipelined) {
+        // capture stage, the effect thread keeps the surface alive until it's done with it
+        if (processFrame) {
+            std::shared_ptr<Surface> newFrameSurface(new Surface(mCapture->getSurface()));
+            mCaptureChannelOrder = newFrameSurface->getChannelOrder();
+            mPipeline.submit(frameViewOf(*newFrameSurface), newFrameSurface, params);
+        }
+        // render stage, upload whatever finished last, the effect thread never waits on this
+        FrameView finished;
+        if (mPipeline.acquireLatest(finished)) {
+            mCameraActive = true;
+            imgTexture = gl::Texture(Surface(finished.data, finished.width, finished.height, finished.rowBytes, mCaptureChannelOrder));
+            governQuality(mPipeline.getEffectMs());
         }
+        mEffectMs = mPipeline.getEffectMs();
+        mPipelineLatencyMs = mPipeline.getLatencyMs();
+        mDroppedFrames = (int)mPipeline.getDroppedFrames();
+        reportHistory(mPipeline.getHistoryFrames(), mPipeline.getHistoryBytes());
+        reportBloom(mPipeline.getBloomTimings());
+        mMotionMs = mPipeline.getMotionMs();
+    } else if (processFrame) {
+        mCameraActive = true;
         Surface newFrameSurface = mCapture->getSurface();
-        if (mImgSurface) {
-            Surface::Iter iterOldSurface = mImgSurface.getIter();
-            Surface::Iter iterNewSurface = newFrameSurface.getIter();
-            Surface::Iter iterDisplaySurface = mDisplaySurface.getIter();
-            int c = 0;
-            while (iterOldSurface.line() && iterNewSurface.line() && iterDisplaySurface.line()) {
-                while (iterOldSurface.pixel() && iterNewSurface.pixel() && iterDisplaySurface.pixel()) {
-                    if (mHueModOn) {
-                        // hue rotation
-                        Vec3f hsvVec = rgbToHSV(Colorf(iterNewSurface.r(), iterNewSurface.g(), iterNewSurface.b()));
-                        float boundedHuePosition = mHuePosition;
-                        if (boundedHuePosition < 0.f) {
-                            boundedHuePosition += 1.f;
-                        } else if (boundedHuePosition > 1.f) {
-                            boundedHuePosition -= 1.f;
-                        }
-                        hsvVec.x += mHuePosition;
-                        if (hsvVec.x > 1.f) {
-                            hsvVec.x -= 1.f;
-                        } else if (hsvVec.x < 0.f) {
-                            hsvVec.x += 1.f;
-                        }
-                        Colorf pix = hsvToRGB(hsvVec);
-                        iterNewSurface.r() = pix.r;
-                        iterNewSurface.g() = pix.g;
-                        iterNewSurface.b() = pix.b;
-                    }
-                    if (mBlurOn) {
-                        if (mSkippedFrames == 0) {
-                            // feedback, using curve as applied to input number
-                            float feedback = powf(mFeedback, 1.f / 3.f); // cube root, more values closer to 1.f
-                            iterOldSurface.r() = (int)(((float)iterOldSurface.r()) * feedback);
-                            iterOldSurface.g() = (int)(((float)iterOldSurface.g()) * feedback);
-                            iterOldSurface.b() = (int)(((float)iterOldSurface.b()) * feedback);
-                        } else {
-                            // 100% feedback on skipped frames
-                            //iterOldSurface.r() = iterOldSurface.r();
-                            //iterOldSurface.g() = iterOldSurface.g();
-                            //iterOldSurface.b() = iterOldSurface.b();
-                        }
-                        // lighten
-                        iterOldSurface.r() = iterNewSurface.r() > iterOldSurface.r() ? iterNewSurface.r() : iterOldSurface.r();
-                        iterOldSurface.g() = iterNewSurface.g() > iterOldSurface.g() ? iterNewSurface.g() : iterOldSurface.g();
-                        iterOldSurface.b() = iterNewSurface.b() > iterOldSurface.b() ? iterNewSurface.b() : iterOldSurface.b();
-                    } else {
-                        iterOldSurface.r() = iterNewSurface.r();
-                        iterOldSurface.g() = iterNewSurface.g();
-                        iterOldSurface.b() = iterNewSurface.b();
-                    }
-                    iterDisplaySurface.r() = (iterOldSurface.r() * (1 - mNewestFrameMix)) + (iterNewSurface.r() * mNewestFrameMix);
-                    iterDisplaySurface.g() = (iterOldSurface.g() * (1 - mNewestFrameMix)) + (iterNewSurface.g() * mNewestFrameMix);
-                    iterDisplaySurface.b() = (iterOldSurface.b() * (1 - mNewestFrameMix)) + (iterNewSurface.b() * mNewestFrameMix);
-                    // inc c
-                    c++;
-                }
-            }
-            //std::cout << "Modified pixels: " << c << std::endl;
-        } else {
-            mImgSurface = newFrameSurface;
-            mDisplaySurface = newFrameSurface.clone();
+        // smaller than the capture with a processing scale, drawn scaled up. The processor
+        // resamples its trail to a new scale itself, a new capture size starts it over.
+        const Vec2i displaySize(params.getDisplaySize(newFrameSurface.getWidth()), params.getDisplaySize(newFrameSurface.getHeight()));
+        if (!mDisplaySurface || mDisplaySurface.getSize() != displaySize) {
+            mDisplaySurface = Surface(displaySize.x, displaySize.y, newFrameSurface.hasAlpha(), newFrameSurface.getChannelOrder());
         }
-        imgTexture = gl::Texture(mDisplaySurface);
-    }
-    
-    if (mCaptureInfo.width > 0 && mCaptureInfo.height > 0) {
-        mDrawArea.set(0, 0, mCaptureInfo.width, mCaptureInfo.height);
-        // update draw area
-        float multiplier = getWindowBounds().getWidth() / ((float)mCaptureInfo.width);
-        mDrawAreaScreen = Rectf(0, 0, ((float)mCaptureInfo.width) * multiplier, ((float)mCaptureInfo.height) * multiplier);
-        if (mDrawArea.getHeight() < getWindowBounds().getHeight()) {
-            multiplier = getWindowBounds().getHeight() / ((float)mCaptureInfo.height);
-            mDrawAreaScreen = Rectf(0, 0, mDrawArea.getX2() * multiplier, mDrawArea.getY2() * multiplier);
+        // process() only returns once every worker band is done, safe to upload after
+        double effectStart = getElapsedSeconds();
+        bool written = mProcessor.process(frameViewOf(newFrameSurface), frameViewOf(mDisplaySurface), params);
+        mEffectMs = (float)((getElapsedSeconds() - effectStart) * 1000.0);
+        governQuality(mEffectMs);
+        reportHistory(mProcessor.getHistory().getCapacity(), mProcessor.getHistory().getMemoryBytes());
+        reportBloom(mProcessor.getBloom().getTimings());
+        mMotionMs = mProcessor.getMotion().getEstimateMs();
+        // batched frame skip only writes the display once per skip window
+        if (written) {
+            imgTexture = gl::Texture(mDisplaySurface);
         }
     }
 }
 
+void IlluminateApp::governQuality(float effectMs)
+{
+    if (mGovernor.addFrameTime(effectMs, getFeedbackParams())) {
+        reportQuality();
+    }
+}
+
+void IlluminateApp::reportHistory(int frames, size_t bytes)
+{
+    const float megabytes = bytes / (1024.f * 1024.f);
+    if (frames != mHistoryFrames || megabytes != mHistoryMB) {
+        console() << "frame history: " << frames << " frames, " << megabytes << " MB" << std::endl;
+    }
+    mHistoryFrames = frames;
+    mHistoryMB = megabytes;
+}
+
+void IlluminateApp::reportBloom(const Bloom::Timings &timings)
+{
+    for (int l = 0 ; l < Bloom::MAX_LEVELS ; l++) {
+        mBloomLevelMs[l] = l < timings.numLevels ? timings.levelMs[l] : 0.f;
+    }
+}
+
+void IlluminateApp::reportQuality()
+{
+    mQualityLevel = mGovernor.getLevel();
+    if (!mGovernor.getLastDecision().empty()) {
+        console() << mGovernor.getLastDecision() << std::endl;
+    }
+    if (mOscReplyHost.empty()) {
+        return;
+    }
+    osc::Message message;
+    message.setAddress("/1/quality");
+    message.addIntArg(mGovernor.getLevel());
+    message.addFloatArg(mGovernor.getAverageMs());
+    message.addFloatArg(mGovernor.getBudgetMs());
+    message.addStringArg(mGovernor.getLastDecision());
+    mOscSender.sendMessage(message);
+}
+
 void IlluminateApp::draw()
 {
     // clear out the window with black
@@ -555,7 +1073,8 @@ void IlluminateApp::draw()
     gl::enableDepthWrite();
     
     if(mCameraActive) {
-        gl::draw(imgTexture, mDrawArea, mDrawAreaScreen);
+        // the whole texture, which is smaller than mDrawArea with a processing scale
+        gl::draw(imgTexture, imgTexture.getBounds(), mDrawAreaScreen);
     } else if (mCapture) {
         gl::drawStringCentered("Waiting for camera...\n\nIf this takes a long time\nthere is a problem", getWindowCenter());
     } else {
@@ -0,0 +1,226 @@
+//
+//  MotionField.cpp
+//  Illuminate
+//
+
+#include "MotionField.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+#include "FeedbackKernels.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+const int BANDS_PER_THREAD = 4;
+const int MIN_BAND_ROWS = 8;
+// a block has to beat standing still by this much, so noise in flat areas doesn't move the trail
+const uint32_t STILL_BIAS = MotionField::BLOCK_SIZE * MotionField::BLOCK_SIZE;
+const int32_t REFINE = 2;
+
+typedef std::chrono::steady_clock Clock;
+
+float getMsSince(Clock::time_point start)
+{
+    return std::chrono::duration<float, std::milli>(Clock::now() - start).count();
+}
+
+int getNumBands(const WorkerPool &pool, int32_t rows, int32_t minBandRows)
+{
+    if (pool.getNumThreads() == 1) {
+        return 1;
+    }
+    return std::max(std::min(pool.getNumThreads() * BANDS_PER_THREAD, (int)(rows / minBandRows)), 1);
+}
+
+// sum of absolute differences of the size x size squares at a and b, rows stride apart
+inline uint32_t blockSad(const uint8_t *a, const uint8_t *b, int32_t stride, int32_t size)
+{
+#if defined(__SSE2__)
+    // rows packed into 16 bytes, _mm_sad_epu8 sums each 8 byte half
+    if (size == MotionField::BLOCK_SIZE) {
+        __m128i sum = _mm_setzero_si128();
+        for (int32_t r = 0 ; r < size ; r += 2) {
+            const __m128i rowsA = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(a + r * stride)),
+                                                     _mm_loadl_epi64((const __m128i*)(a + (r + 1) * stride)));
+            const __m128i rowsB = _mm_unpacklo_epi64(_mm_loadl_epi64((const __m128i*)(b + r * stride)),
+                                                     _mm_loadl_epi64((const __m128i*)(b + (r + 1) * stride)));
+            sum = _mm_add_epi32(sum, _mm_sad_epu8(rowsA, rowsB));
+        }
+        return (uint32_t)(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+    }
+    if (size == MotionField::BLOCK_SIZE / 2) {
+        __m128i rows[2][4];
+        for (int32_t r = 0 ; r < 4 ; r++) {
+            int32_t rowA, rowB;
+            memcpy(&rowA, a + r * stride, 4);
+            memcpy(&rowB, b + r * stride, 4);
+            rows[0][r] = _mm_cvtsi32_si128(rowA);
+            rows[1][r] = _mm_cvtsi32_si128(rowB);
+        }
+        const __m128i blockA = _mm_unpacklo_epi64(_mm_unpacklo_epi32(rows[0][0], rows[0][1]), _mm_unpacklo_epi32(rows[0][2], rows[0][3]));
+        const __m128i blockB = _mm_unpacklo_epi64(_mm_unpacklo_epi32(rows[1][0], rows[1][1]), _mm_unpacklo_epi32(rows[1][2], rows[1][3]));
+        const __m128i sum = _mm_sad_epu8(blockA, blockB);
+        return (uint32_t)(_mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8)));
+    }
+#endif
+    uint32_t sum = 0;
+    for (int32_t r = 0 ; r < size ; r++) {
+        for (int32_t c = 0 ; c < size ; c++) {
+            const int32_t d = a[r * stride + c] - b[r * stride + c];
+            sum += d < 0 ? -d : d;
+        }
+    }
+    return sum;
+}
+
+}
+
+MotionField::MotionField()
+    : mWidth(0), mHeight(0), mBlockColumns(0), mBlockRows(0), mCurrent(0), mHasPrevious(false), mEstimateMs(0.f)
+{
+}
+
+void MotionField::release()
+{
+    for (int p = 0 ; p < 2 ; p++) {
+        std::vector<uint8_t>().swap(mPlanes[p]);
+        std::vector<uint8_t>().swap(mCoarse[p]);
+    }
+    std::vector<uint8_t>().swap(mScratch);
+    std::vector<int8_t>().swap(mVectors);
+    mWidth = mHeight = 0;
+    mBlockColumns = mBlockRows = 0;
+    mHasPrevious = false;
+    mEstimateMs = 0.f;
+}
+
+size_t MotionField::getMemoryBytes() const
+{
+    return mPlanes[0].size() + mPlanes[1].size() + mCoarse[0].size() + mCoarse[1].size()
+         + mScratch.size() + mVectors.size();
+}
+
+void MotionField::matchBlock(int32_t x, int32_t y, int search)
+{
+    int8_t *vector = &mVectors[((size_t)y * mBlockColumns + x) * 2];
+    // half the search on the quarter planes with half size blocks first, every candidate
+    const int32_t coarseWidth = mWidth / 2;
+    const int32_t coarseSize = BLOCK_SIZE / 2;
+    const int32_t coarseSearch = (search + 1) / 2;
+    const uint8_t *current = &mCoarse[mCurrent][(size_t)y * coarseSize * coarseWidth + x * coarseSize];
+    const uint8_t *previous = &mCoarse[mCurrent ^ 1][(size_t)y * coarseSize * coarseWidth + x * coarseSize];
+    int32_t bestX = 0;
+    int32_t bestY = 0;
+    uint32_t sad = blockSad(current, previous, coarseWidth, coarseSize);
+    uint32_t bestSad = sad > STILL_BIAS / 4 ? sad - STILL_BIAS / 4 : 0;
+    // only candidates wholly inside the previous plane
+    for (int32_t dy = std::max(-coarseSearch, -y * coarseSize) ; dy <= std::min(coarseSearch, mHeight / 2 - (y + 1) * coarseSize) ; dy++) {
+        for (int32_t dx = std::max(-coarseSearch, -x * coarseSize) ; dx <= std::min(coarseSearch, coarseWidth - (x + 1) * coarseSize) ; dx++) {
+            sad = blockSad(current, previous + dy * coarseWidth + dx, coarseWidth, coarseSize);
+            if (sad < bestSad) {
+                bestSad = sad;
+                bestX = dx;
+                bestY = dy;
+            }
+        }
+    }
+    // then REFINE pixels around it on the planes, the rough vector can be a coarse pixel out
+    const int32_t width = mWidth;
+    current = &mPlanes[mCurrent][(size_t)y * BLOCK_SIZE * width + x * BLOCK_SIZE];
+    previous = &mPlanes[mCurrent ^ 1][(size_t)y * BLOCK_SIZE * width + x * BLOCK_SIZE];
+    const int32_t centreX = 2 * bestX;
+    const int32_t centreY = 2 * bestY;
+    sad = blockSad(current, previous, width, BLOCK_SIZE);
+    bestSad = sad > STILL_BIAS ? sad - STILL_BIAS : 0;
+    vector[0] = vector[1] = 0;
+    if (bestSad == 0) {
+        return;
+    }
+    for (int32_t dy = std::max(std::max(centreY - REFINE, -search), -y * BLOCK_SIZE) ;
+         dy <= std::min(std::min(centreY + REFINE, search), mHeight - (y + 1) * BLOCK_SIZE) ; dy++) {
+        for (int32_t dx = std::max(std::max(centreX - REFINE, -search), -x * BLOCK_SIZE) ;
+             dx <= std::min(std::min(centreX + REFINE, search), width - (x + 1) * BLOCK_SIZE) ; dx++) {
+            sad = blockSad(current, previous + dy * width + dx, width, BLOCK_SIZE);
+            if (sad < bestSad) {
+                bestSad = sad;
+                vector[0] = (int8_t)dx;
+                vector[1] = (int8_t)dy;
+            }
+        }
+    }
+}
+
+void MotionField::estimate(const FrameView &newFrame, int downscale, int search, WorkerPool &pool)
+{
+    const Clock::time_point start = Clock::now();
+    const int32_t factor = PLANE_SCALE * std::max(downscale, 1);
+    const int32_t width = newFrame.width / factor;
+    const int32_t height = newFrame.height / factor;
+    if (width != mWidth || height != mHeight) {
+        mWidth = width;
+        mHeight = height;
+        mPlanes[0].assign((size_t)width * height, 0);
+        mPlanes[1].assign((size_t)width * height, 0);
+        mCoarse[0].assign((size_t)(width / 2) * (height / 2), 0);
+        mCoarse[1].assign((size_t)(width / 2) * (height / 2), 0);
+        mBlockColumns = width / BLOCK_SIZE;
+        mBlockRows = height / BLOCK_SIZE;
+        mVectors.assign((size_t)mBlockColumns * mBlockRows * 2, 0);
+        mHasPrevious = false;
+    }
+    if (mBlockColumns == 0 || mBlockRows == 0) {
+        return;
+    }
+    mCurrent ^= 1;
+
+    uint16_t weights[4];
+    newFrame.getLumaWeights(weights);
+    const int32_t pixelInc = newFrame.pixelInc;
+    const int numBands = getNumBands(pool, height, MIN_BAND_ROWS);
+    const size_t scratchStride = (size_t)width * pixelInc;
+    if (mScratch.size() < scratchStride * numBands) {
+        mScratch.resize(scratchStride * numBands);
+    }
+    pool.run(numBands, [&](int band) {
+        uint8_t *scratch = &mScratch[band * scratchStride];
+        const int32_t bandEnd = WorkerPool::getBandStart(band + 1, numBands, height);
+        for (int32_t y = WorkerPool::getBandStart(band, numBands, height) ; y < bandEnd ; y++) {
+            downsampleRow(scratch, newFrame.getRow(y * factor), newFrame.rowBytes, width, pixelInc, factor);
+            lumaRow(&mPlanes[mCurrent][(size_t)y * width], scratch, width, pixelInc, weights);
+        }
+    });
+    const int32_t coarseWidth = width / 2;
+    const int32_t coarseHeight = height / 2;
+    const int numCoarseBands = getNumBands(pool, coarseHeight, MIN_BAND_ROWS);
+    pool.run(numCoarseBands, [&](int band) {
+        const int32_t bandEnd = WorkerPool::getBandStart(band + 1, numCoarseBands, coarseHeight);
+        for (int32_t y = WorkerPool::getBandStart(band, numCoarseBands, coarseHeight) ; y < bandEnd ; y++) {
+            halveRow(&mCoarse[mCurrent][(size_t)y * coarseWidth], &mPlanes[mCurrent][(size_t)2 * y * width], width, coarseWidth);
+        }
+    });
+    if (!mHasPrevious) {
+        std::fill(mVectors.begin(), mVectors.end(), 0);
+        mHasPrevious = true;
+        mEstimateMs = getMsSince(start);
+        return;
+    }
+
+    const int clampedSearch = std::min(std::max(search, 0), (int)MAX_SEARCH);
+    // a block row is already a lot of work
+    const int numBlockBands = getNumBands(pool, mBlockRows, 1);
+    pool.run(numBlockBands, [&](int band) {
+        const int32_t bandEnd = WorkerPool::getBandStart(band + 1, numBlockBands, mBlockRows);
+        for (int32_t y = WorkerPool::getBandStart(band, numBlockBands, mBlockRows) ; y < bandEnd ; y++) {
+            for (int32_t x = 0 ; x < mBlockColumns ; x++) {
+                matchBlock(x, y, clampedSearch);
+            }
+        }
+    });
+    mEstimateMs = getMsSince(start);
+}
@@ -0,0 +1,62 @@
+//
+//  MotionField.h
+//  Illuminate
+//
+//  Block motion vectors between each frame and the one before it, from the sum of
+//  absolute differences over a luma plane at half the size of the frame. A full
+//  search on a plane half that size again finds the rough vector, the half size
+//  plane refines it by a pixel. The planes are allocated once per frame size.
+//
+
+#ifndef MotionField_h
+#define MotionField_h
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "FrameView.h"
+#include "WorkerPool.h"
+
+class MotionField {
+  public:
+    static const int PLANE_SCALE = 2;       // frame pixels per luma plane pixel
+    static const int BLOCK_SIZE = 8;        // luma plane pixels, 16 frame pixels
+    static const int MAX_SEARCH = 8;        // luma plane pixels each way
+
+    MotionField();
+
+    // Builds the luma plane of newFrame, box filtered by PLANE_SCALE * downscale, and
+    // matches each block of it against the previous plane up to search plane pixels
+    // each way. Vectors stay 0 when there is no previous plane of the same size.
+    void estimate(const FrameView &newFrame, int downscale, int search, WorkerPool &pool);
+    // memory goes too, the next estimate() starts over
+    void release();
+
+    int32_t getBlockColumns() const { return mBlockColumns; }
+    int32_t getBlockRows() const { return mBlockRows; }
+    // where block (x, y) of the new plane was in the previous one, in plane pixels,
+    // x then y. The last blocks take the pixels left over at the edges.
+    const int8_t* getVector(int32_t x, int32_t y) const { return &mVectors[((size_t)y * mBlockColumns + x) * 2]; }
+
+    float getEstimateMs() const { return mEstimateMs; }
+    size_t getMemoryBytes() const;
+
+  private:
+    // the best vector of block (x, y) against the previous planes
+    void matchBlock(int32_t x, int32_t y, int search);
+
+    int32_t                 mWidth;         // of the planes
+    int32_t                 mHeight;
+    int32_t                 mBlockColumns;
+    int32_t                 mBlockRows;
+    int                     mCurrent;       // plane of the newest frame
+    bool                    mHasPrevious;
+    std::vector<uint8_t>    mPlanes[2];
+    std::vector<uint8_t>    mCoarse[2];     // mPlanes box filtered to half the size
+    std::vector<uint8_t>    mScratch;       // per band, a row of the frame box filtered
+    std::vector<int8_t>     mVectors;
+    float                   mEstimateMs;
+};
+
+#endif /* MotionField_h */
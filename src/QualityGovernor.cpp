@@ -0,0 +1,165 @@
+//
+//  QualityGovernor.cpp
+//  Illuminate
+//
+
+#include "QualityGovernor.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+
+const float QualityGovernor::UP_SHARE = 0.6f;
+const float QualityGovernor::FAR_OVER_SHARE = 2.f;
+
+namespace {
+
+struct QualityLevel {
+    bool    allThreads;
+    int     hueLutSize;     // 0 leaves the hue rotation alone
+    int     downscale;
+    int     frameInterval;
+};
+
+// each level keeps everything the one before gave up
+const QualityLevel LEVELS[QualityGovernor::NUM_LEVELS] = {
+    { false, 0,                                   1, 1 },
+    { true,  0,                                   1, 1 },
+    { true,  QualityGovernor::SMALL_HUE_LUT_SIZE, 1, 1 },
+    { true,  QualityGovernor::SMALL_HUE_LUT_SIZE, 2, 1 },
+    { true,  QualityGovernor::SMALL_HUE_LUT_SIZE, 2, 2 },
+    { true,  QualityGovernor::SMALL_HUE_LUT_SIZE, 4, 2 }
+};
+
+bool hasSameCost(const FeedbackParams &a, const FeedbackParams &b)
+{
+    return a.numThreads == b.numThreads && a.hueLut == b.hueLut && a.hueLutSize == b.hueLutSize
+        && a.downscale == b.downscale && a.feedback == b.feedback;
+}
+
+}
+
+QualityGovernor::QualityGovernor()
+    : mEnabled(false), mBudgetMs(10.f), mLevel(0), mWindow(WINDOW_FRAMES, 0.f), mWindowNext(0),
+      mWindowSum(0.f), mUnderFrames(0), mUpHoldFrames(UP_HOLD_FRAMES), mFramesSinceUp(BACKOFF_FRAMES)
+{
+}
+
+void QualityGovernor::setEnabled(bool enabled)
+{
+    if (enabled == mEnabled) {
+        return;
+    }
+    mEnabled = enabled;
+    if (!enabled && mLevel != 0) {
+        changeLevel(0, "governor off");
+    }
+    mUpHoldFrames = UP_HOLD_FRAMES;
+}
+
+float QualityGovernor::getAverageMs() const
+{
+    return mWindowNext > 0 ? mWindowSum / std::min(mWindowNext, (int)WINDOW_FRAMES) : 0.f;
+}
+
+FeedbackParams QualityGovernor::applyLevel(int level, const FeedbackParams &params)
+{
+    const QualityLevel &quality = LEVELS[level];
+    FeedbackParams applied = params;
+    if (quality.allThreads) {
+        applied.numThreads = 0;
+    }
+    if (quality.hueLutSize > 0 && params.hueModOn) {
+        applied.hueLut = true;
+        applied.hueLutSize = std::min(params.hueLutSize, quality.hueLutSize);
+    }
+    applied.downscale = std::max(params.downscale, quality.downscale);
+    if (quality.frameInterval > 1) {
+        // the trail fades over the same time with fewer frames
+        applied.feedback = powf(params.feedback, (float)quality.frameInterval);
+    }
+    return applied;
+}
+
+int QualityGovernor::findLevel(int level, int step, const FeedbackParams &params)
+{
+    const FeedbackParams current = applyLevel(level, params);
+    for (int next = level + step ; next >= 0 && next < NUM_LEVELS ; next += step) {
+        if (!hasSameCost(applyLevel(next, params), current)) {
+            return next;
+        }
+    }
+    return level;
+}
+
+void QualityGovernor::apply(FeedbackParams &params) const
+{
+    params = applyLevel(mLevel, params);
+}
+
+int QualityGovernor::getFrameInterval() const
+{
+    return LEVELS[mLevel].frameInterval;
+}
+
+bool QualityGovernor::addFrameTime(float effectMs, const FeedbackParams &params)
+{
+    if (!mEnabled) {
+        return false;
+    }
+    mWindowSum += effectMs - mWindow[mWindowNext % WINDOW_FRAMES];
+    mWindow[mWindowNext % WINDOW_FRAMES] = effectMs;
+    mWindowNext++;
+    if (mFramesSinceUp < BACKOFF_FRAMES && ++mFramesSinceUp == BACKOFF_FRAMES) {
+        // the last step up held
+        mUpHoldFrames = UP_HOLD_FRAMES;
+    }
+    // a single slow frame doesn't count, a few far over budget do
+    if (mWindowNext < WINDOW_FRAMES
+            && (mWindowNext < MIN_FRAMES || getAverageMs() <= mBudgetMs * FAR_OVER_SHARE)) {
+        return false;
+    }
+
+    const float averageMs = getAverageMs();
+    if (averageMs > mBudgetMs) {
+        mUnderFrames = 0;
+        const int down = findLevel(mLevel, 1, params);
+        if (down == mLevel) {
+            return false;
+        }
+        if (mFramesSinceUp < BACKOFF_FRAMES) {
+            mUpHoldFrames = std::min(mUpHoldFrames * 2, (int)MAX_UP_HOLD_FRAMES);
+            mFramesSinceUp = BACKOFF_FRAMES;
+        }
+        changeLevel(down, "over budget");
+        return true;
+    }
+    if (averageMs > mBudgetMs * UP_SHARE) {
+        mUnderFrames = 0;
+        return false;
+    }
+    if (++mUnderFrames < mUpHoldFrames || mLevel == 0) {
+        return false;
+    }
+    const int up = findLevel(mLevel, -1, params);
+    if (up == mLevel) {
+        return false;
+    }
+    changeLevel(up, "under budget");
+    mFramesSinceUp = 0;
+    return true;
+}
+
+void QualityGovernor::changeLevel(int level, const char *reason)
+{
+    char decision[128];
+    snprintf(decision, sizeof(decision), "quality level %d -> %d, %s: average %.1f ms, budget %.1f ms",
+             mLevel, level, reason, getAverageMs(), mBudgetMs);
+    mLastDecision = decision;
+    mLevel = level;
+    // the window only ever holds frames of one level
+    std::fill(mWindow.begin(), mWindow.end(), 0.f);
+    mWindowNext = 0;
+    mWindowSum = 0.f;
+    mUnderFrames = 0;
+}
@@ -0,0 +1,74 @@
+//
+//  QualityGovernor.h
+//  Illuminate
+//
+//  Holds the effect inside its frame time budget by stepping quality down when
+//  the rolling average of the effect time goes over budget, and back up once it
+//  has stayed well under for a while. Levels trade quality for time in the order
+//  that shows least: all worker threads, a smaller hue cube, half scale, every
+//  other capture frame, quarter scale. Stepping up waits longer each time a step
+//  up had to be undone soon after, so a borderline load doesn't flip back and forth.
+//
+
+#ifndef QualityGovernor_h
+#define QualityGovernor_h
+
+#include <string>
+#include <vector>
+
+#include "FeedbackProcessor.h"
+
+class QualityGovernor {
+  public:
+    static const int NUM_LEVELS = 6;            // level 0 runs the settings as they are
+    static const int WINDOW_FRAMES = 30;        // rolling average length
+    static const int MIN_FRAMES = 8;            // enough to step down when FAR_OVER_SHARE over budget
+    static const int UP_HOLD_FRAMES = 120;      // under UP_SHARE this long before stepping up
+    static const int MAX_UP_HOLD_FRAMES = 1920;
+    static const int BACKOFF_FRAMES = 600;      // a step down this soon after a step up doubles the hold
+    static const int SMALL_HUE_LUT_SIZE = 17;
+
+    QualityGovernor();
+
+    // back to level 0 when switched off
+    void setEnabled(bool enabled);
+    bool isEnabled() const { return mEnabled; }
+    // effect time the average has to stay under
+    void setBudgetMs(float budgetMs) { mBudgetMs = budgetMs; }
+    float getBudgetMs() const { return mBudgetMs; }
+
+    // Effect time of one processed frame, params as the controls set them. Returns
+    // true when the level changed, getLastDecision() says why.
+    bool addFrameTime(float effectMs, const FeedbackParams &params);
+
+    int getLevel() const { return mLevel; }
+    float getAverageMs() const;
+    const std::string& getLastDecision() const { return mLastDecision; }
+
+    // lowers params to the current level
+    void apply(FeedbackParams &params) const;
+    // the current level only processes every nth captured frame
+    int getFrameInterval() const;
+
+  private:
+    static const float UP_SHARE;
+    static const float FAR_OVER_SHARE;
+
+    static FeedbackParams applyLevel(int level, const FeedbackParams &params);
+    // next level up / down that changes anything for these params, or level itself
+    static int findLevel(int level, int step, const FeedbackParams &params);
+    void changeLevel(int level, const char *reason);
+
+    bool                mEnabled;
+    float               mBudgetMs;
+    int                 mLevel;
+    std::vector<float>  mWindow;
+    int                 mWindowNext;
+    float               mWindowSum;
+    int                 mUnderFrames;       // consecutive frames averaging under UP_SHARE of the budget
+    int                 mUpHoldFrames;
+    int                 mFramesSinceUp;
+    std::string         mLastDecision;
+};
+
+#endif /* QualityGovernor_h */
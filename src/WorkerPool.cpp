@@ -0,0 +1,115 @@
+//
+//  WorkerPool.cpp
+//  Illuminate
+//
+
+#include "WorkerPool.h"
+
+#include <algorithm>
+
+WorkerPool::WorkerPool(int numThreads)
+    : mJob(NULL), mNumBands(0), mNextBand(0), mActiveWorkers(0), mGeneration(0), mQuit(false)
+{
+    setNumThreads(numThreads);
+}
+
+WorkerPool::~WorkerPool()
+{
+    stopThreads();
+}
+
+int WorkerPool::getHardwareThreads()
+{
+    return std::max((int)std::thread::hardware_concurrency(), 1);
+}
+
+void WorkerPool::setNumThreads(int numThreads)
+{
+    if (numThreads <= 0) {
+        numThreads = getHardwareThreads();
+    }
+    if (numThreads == getNumThreads()) {
+        return;
+    }
+    stopThreads();
+    startThreads(numThreads - 1);
+}
+
+void WorkerPool::startThreads(int numWorkers)
+{
+    // new workers wait for the next run, not one that already went by
+    uint64_t generation;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQuit = false;
+        generation = mGeneration;
+    }
+    for (int i = 0 ; i < numWorkers ; i++) {
+        mThreads.push_back(std::thread(&WorkerPool::workerLoop, this, generation));
+    }
+}
+
+void WorkerPool::stopThreads()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mQuit = true;
+        mWake.notify_all();
+    }
+    for (size_t i = 0 ; i < mThreads.size() ; i++) {
+        mThreads[i].join();
+    }
+    mThreads.clear();
+}
+
+void WorkerPool::runBands()
+{
+    int band;
+    while ((band = mNextBand++) < mNumBands) {
+        (*mJob)(band);
+    }
+}
+
+void WorkerPool::workerLoop(uint64_t seenGeneration)
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        mWake.wait(lock, [&]{ return mQuit || mGeneration != seenGeneration; });
+        if (mQuit) {
+            return;
+        }
+        seenGeneration = mGeneration;
+        lock.unlock();
+        runBands();
+        lock.lock();
+        if (--mActiveWorkers == 0) {
+            mDone.notify_one();
+        }
+    }
+}
+
+void WorkerPool::run(int numBands, const std::function<void(int)> &job)
+{
+    if (numBands <= 0) {
+        return;
+    }
+    if (mThreads.empty() || numBands == 1) {
+        for (int band = 0 ; band < numBands ; band++) {
+            job(band);
+        }
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mJob = &job;
+        mNumBands = numBands;
+        mNextBand = 0;
+        mActiveWorkers = (int)mThreads.size();
+        mGeneration++;
+        mWake.notify_all();
+    }
+    runBands();
+    std::unique_lock<std::mutex> lock(mMutex);
+    mDone.wait(lock, [this]{ return mActiveWorkers == 0; });
+    mJob = NULL;
+}
@@ -0,0 +1,59 @@
+//
+//  WorkerPool.h
+//  Illuminate
+//
+//  Persistent worker threads for splitting per frame work into bands. Threads are
+//  only created when the thread count changes, never per frame.
+//
+
+#ifndef WorkerPool_h
+#define WorkerPool_h
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WorkerPool {
+  public:
+    // numThreads counts the calling thread too, 0 means one per hardware thread
+    explicit WorkerPool(int numThreads = 1);
+    ~WorkerPool();
+
+    void setNumThreads(int numThreads);
+    int getNumThreads() const { return (int)mThreads.size() + 1; }
+    static int getHardwareThreads();
+
+    // Calls job(band) for every band in [0, numBands), spread over the workers and
+    // the calling thread. Returns once every band is done.
+    void run(int numBands, const std::function<void(int)> &job);
+
+    // first row of band out of numBands for height rows, band == numBands gives height
+    static int32_t getBandStart(int band, int numBands, int32_t height)
+    {
+        return (int32_t)(((int64_t)height * band) / numBands);
+    }
+
+  private:
+    void startThreads(int numWorkers);
+    void stopThreads();
+    // seenGeneration is the last run the worker doesn't take part in
+    void workerLoop(uint64_t seenGeneration);
+    void runBands();
+
+    std::vector<std::thread>            mThreads;
+    std::mutex                          mMutex;
+    std::condition_variable             mWake;
+    std::condition_variable             mDone;
+    const std::function<void(int)>      *mJob;
+    int                                 mNumBands;
+    std::atomic<int>                    mNextBand;
+    int                                 mActiveWorkers;
+    uint64_t                            mGeneration;
+    bool                                mQuit;
+};
+
+#endif /* WorkerPool_h */